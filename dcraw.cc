@@ -142,6 +142,9 @@ ifpReadCount = 0;
 ifpSize = 0;
 ifpStepProgress = 0;
 eofCount = 0;
+getbithuff_bitbuf = 0, getbithuff_vbits = 0, getbithuff_reset = 0;
+ph1_bitbuf = 0, ph1_vbits = 0, pana_vbits = 0, sony_p = 0;
+memset(ljpeg_cs, 0, sizeof ljpeg_cs);
 }
 
 CLASS ~DCRaw()
@@ -679,9 +682,8 @@ int CLASS canon_s2is()
 
 unsigned CLASS getbithuff (int nbits, ushort *huff)
 {
-  // TODO: The following static variables are not thread-safe
-  static unsigned bitbuf=0;
-  static int vbits=0, reset=0;
+  unsigned &bitbuf = getbithuff_bitbuf;
+  int &vbits = getbithuff_vbits, &reset = getbithuff_reset;
   unsigned c;
 
   if (nbits > 25) return 0;
@@ -1151,7 +1153,7 @@ void CLASS ljpeg_idct (struct jhead *jh)
 {
   int c, i, j, len, skip, coef;
   float work[3][8][8];
-  static float cs[106] = { 0 };
+  float *cs = ljpeg_cs;
   static const uchar zigzag[80] =
   {  0, 1, 8,16, 9, 2, 3,10,17,24,32,25,18,11, 4, 5,12,19,26,33,
     40,48,41,34,27,20,13, 6, 7,14,21,28,35,42,49,56,57,50,43,36,
@@ -1801,9 +1803,8 @@ void CLASS phase_one_load_raw()
 
 unsigned CLASS ph1_bithuff (int nbits, ushort *huff)
 {
-  // TODO: The following static variables are not thread-safe
-  static UINT64 bitbuf=0;
-  static int vbits=0;
+  UINT64 &bitbuf = ph1_bitbuf;
+  int &vbits = ph1_vbits;
   unsigned c;
 
   if (nbits == -1)
@@ -2103,8 +2104,8 @@ void CLASS canon_rmf_load_raw()
 
 unsigned CLASS pana_bits (int nbits)
 {
-  static uchar buf[0x4000];
-  static int vbits;
+  uchar *buf = pana_buf;
+  int &vbits = pana_vbits;
   int byte;
 
   if (!nbits) return vbits=0;
@@ -2393,10 +2394,9 @@ void CLASS lossy_dng_load_raw() {}
 METHODDEF(boolean)
 fill_input_buffer (j_decompress_ptr cinfo)
 {
-  // TODO: The following static variable is not thread-safe
-  static uchar jpeg_buffer[4096];
   size_t nbytes;
   DCRaw *d = (DCRaw*)cinfo->client_data;
+  uchar *jpeg_buffer = d->jpeg_buffer;
 
   nbytes = fread (jpeg_buffer, 1, 4096, d->ifp);
 #if defined(__MINGW64_VERSION_MAJOR) && __MINGW64_VERSION_MAJOR < 4
@@ -2756,8 +2756,7 @@ void CLASS kodak_thumb_load_raw()
 
 void CLASS sony_decrypt (unsigned *data, int len, int start, int key)
 {
-  // TODO: The following static variables are not thread-safe
-  static unsigned pad[128], p;
+  unsigned *pad = sony_pad, &p = sony_p;
 
   if (start) {
     for (p=0; p < 4; p++)
@@ -3153,8 +3152,7 @@ void CLASS redcine_load_raw()
 
 void CLASS foveon_decoder (int size, unsigned code)
 {
-  // TODO: The following static variable is not thread-safe
-  static unsigned huff[1024];
+  unsigned *huff = foveon_decoder_huff;
   struct decode *cur;
   int i, len;
 
@@ -5016,7 +5014,7 @@ void CLASS cielab (ushort rgb[3], short lab[3])
 {
   unsigned c, i, j, k;
   float r, xyz[3];
-  static float cbrt[0x10000], xyz_cam[3][4];
+  float *cbrt = cielab_cbrt, (*xyz_cam)[4] = cielab_xyz_cam;
 
   if (!rgb) {
     for (i=0; i < 0x10000; i++) {
@@ -103,6 +103,19 @@ public:
     unsigned ifpSize;
     unsigned ifpStepProgress;
     int eofCount;
+    /* Decoder state that dcraw keeps in function statics, which would be
+     * shared by concurrent loads. */
+    unsigned getbithuff_bitbuf;
+    int getbithuff_vbits, getbithuff_reset;
+    unsigned long long ph1_bitbuf;
+    int ph1_vbits;
+    float ljpeg_cs[106];
+    uchar pana_buf[0x4000];
+    int pana_vbits;
+    uchar jpeg_buffer[4096];
+    unsigned sony_pad[128], sony_p;
+    unsigned foveon_decoder_huff[1024];
+    float cielab_cbrt[0x10000], cielab_xyz_cam[3][4];
 #define STEPS 50
     void ifpProgress(unsigned readCount);
 // Override standard io function for integrity checks and progress report
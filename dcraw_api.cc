@@ -42,6 +42,9 @@ extern "C" {
     int fcol_INDI(const unsigned filters, const int row, const int col,
                   const int top_margin, const int left_margin,
                   /*const*/ char xtrans[6][6]);
+    void cfa_init_INDI(dcraw_cfa *cfa, const unsigned filters,
+                       const int top_margin, const int left_margin,
+                       /*const*/ char xtrans[6][6]);
     void wavelet_denoise_INDI(gushort(*image)[4], const int black,
                               const int iheight, const int iwidth, const int height, const int width,
                               const int colors, const int shrink, const float pre_mul[4],
@@ -50,24 +53,26 @@ extern "C" {
                            const int use_camera_wb, const float cam_mul[4], const int colors,
                            float pre_mul[4], const unsigned filters, /*const*/ gushort white[8][8],
                            const char *ifname_display, void *dcraw);
-    void lin_interpolate_INDI(gushort(*image)[4], const unsigned filters,
+    void lin_interpolate_INDI(gushort(*image)[4], const dcraw_cfa *cfa,
                               const int width, const int height,
-                              const int colors, void *dcraw, dcraw_data *h);
-    void vng_interpolate_INDI(gushort(*image)[4], const unsigned filters,
-                              const int width, const int height, const int colors, const int rgb_max,
-                              void *dcraw, dcraw_data *h);
-    void xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
+                              const int colors, void *dcraw);
+    void vng_interpolate_INDI(gushort(*image)[4], const dcraw_cfa *cfa,
+                              const int width, const int height, const int colors,
+                              void *dcraw);
+    void xtrans_interpolate_INDI(ushort(*image)[4], const dcraw_cfa *cfa,
                                  const int width, const int height,
                                  const int colors, const float rgb_cam[3][4],
-                                 void *dcraw, dcraw_data *hh, const int passes);
-    void ahd_interpolate_INDI(gushort(*image)[4], const unsigned filters,
+                                 void *dcraw, const int passes);
+    void ahd_interpolate_INDI(gushort(*image)[4], const dcraw_cfa *cfa,
                               const int width, const int height, const int colors, float rgb_cam[3][4],
-                              void *dcraw, dcraw_data *h);
+                              void *dcraw);
     void color_smooth(gushort(*image)[4], const int width, const int height,
                       const int passes);
-    void ppg_interpolate_INDI(gushort(*image)[4], const unsigned filters,
-                              const int width, const int height, const int colors, void *dcraw, dcraw_data *h);
-    void flip_image_INDI(gushort(*image)[4], int *height_p, int *width_p,
+    void ppg_interpolate_INDI(gushort(*image)[4], const dcraw_cfa *cfa,
+                              const int width, const int height, const int colors, void *dcraw);
+    void flip_buffer_INDI(void *dst, const void *src, int height, int width,
+                          int depth, int flip);
+    void flip_image_INDI(gushort(**image_p)[4], int *height_p, int *width_p,
                          const int flip);
     void fuji_rotate_INDI(gushort(**image_p)[4], int *height_p, int *width_p,
                           int *fuji_width_p, const int colors, const double step, void *dcraw);
@@ -251,6 +256,9 @@ extern "C" {
                 mul[0][2] = mul[1][0] = mul[2][2] = mul[3][0] = d->cam_mul[2] / saved_cam_mul[2];
             }
 
+#ifdef _OPENMP
+            #pragma omp parallel for default(shared) private(j,S,R,w)
+#endif
             for (i = 0 ; i < d->raw_height; i++)
                 for (j = 0 ; j < d->raw_width; j++) {
 
@@ -296,6 +304,9 @@ extern "C" {
                 m += 1;
                 l *= m;
 
+#ifdef _OPENMP
+                #pragma omp parallel for default(shared) private(S,R,w)
+#endif
                 for (i = 0 ; i < d->raw_height * d->raw_width; i++) {
 
                     /* Range check to avoid problems when value is below black. */
@@ -347,6 +358,12 @@ extern "C" {
         DCRaw * volatile d = (DCRaw *)h->dcraw;
         int c, i, j;
         double dmin;
+        /* The first frame of a Fuji Super CCD SR or EXR pair */
+        guint16 * volatile saved_raw_image = NULL;
+        int saved_fuji_dr = 0;
+        float saved_cam_mul[4];
+        /* The image accumulating the shots of a Pentax multishot */
+        dcraw_image_type * volatile multishot_image = NULL;
 
 start:
         g_free(d->messageBuffer);
@@ -356,6 +373,8 @@ start:
         if (setjmp(d->failure)) {
             d->dcraw_message(DCRAW_ERROR, _("Fatal internal error\n"));
             h->message = d->messageBuffer;
+            g_free(saved_raw_image);
+            g_free(multishot_image);
             delete d;
             return DCRAW_ERROR;
         }
@@ -385,17 +404,20 @@ start:
 
             int row, col, i;
             int positions[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
-            static dcraw_image_type *tmp = NULL;
+            dcraw_image_type *tmp = multishot_image;
+            dcraw_cfa cfa;
+
+            cfa_init_INDI(&cfa, d->filters, d->top_margin, d->left_margin, d->xtrans);
 
             if (!tmp)
-                tmp = d->image = g_new0(dcraw_image_type, d->height * d->width + d->meta_length);
+                multishot_image = tmp = d->image = g_new0(dcraw_image_type, d->height * d->width + d->meta_length);
 
 #ifdef _OPENMP
             #pragma omp parallel for private(col)
 #endif
             for (row = 0 ; row < d->height ; row++)
                 for (col = 0 ; col < d->width ; col++)
-                    tmp[row * d->width + col][fcol_INDI(d->filters, row + positions[d->shot_select][0], col + positions[d->shot_select][1], d->top_margin, d->left_margin, d->xtrans)] = d->raw_image[(row + d->top_margin + positions[d->shot_select][0]) * d->raw_width + col + d->left_margin + positions[d->shot_select][1]];
+                    tmp[row * d->width + col][DCRAW_CFA_COLOR(&cfa, row + positions[d->shot_select][0], col + positions[d->shot_select][1])] = d->raw_image[(row + d->top_margin + positions[d->shot_select][0]) * d->raw_width + col + d->left_margin + positions[d->shot_select][1]];
 
             g_free(d->raw_image);
             d->raw_image = NULL;
@@ -425,16 +447,12 @@ start:
             h->filters = 0;
             h->shrink = 0;
 
-            tmp = NULL;
+            multishot_image = NULL;
         }
 
         /* Fuji Super CCD SR and EXR support */
         if (d->is_raw == 2 && !strncasecmp(d->make, "Fujifilm", 8)) {
 
-            static int saved_fuji_dr;
-            static float saved_cam_mul[4];
-            static guint16 *saved_raw_image = NULL;
-
             if (!saved_raw_image) {
 
                 saved_raw_image = d->raw_image;
@@ -450,7 +468,7 @@ start:
 
             fuji_merge(d, saved_raw_image, saved_cam_mul, saved_fuji_dr);
 
-            free(saved_raw_image);
+            g_free(saved_raw_image);
             saved_raw_image = NULL;
             d->shot_select--;
 
@@ -470,8 +488,11 @@ start:
             d->crop_masked_pixels();
             g_free(d->raw_image);
 
-            if (d->filters > 1 && d->filters <= 1000)
-                lin_interpolate_INDI(d->image, d->filters, d->width, d->height, d->colors, d, h);
+            if (d->filters > 1 && d->filters <= 1000) {
+                dcraw_cfa cfa;
+                cfa_init_INDI(&cfa, d->filters, h->top_margin, h->left_margin, h->xtrans);
+                lin_interpolate_INDI(d->image, &cfa, d->width, d->height, d->colors, d);
+            }
         }
         if (!--d->data_error) d->lastStatus = DCRAW_ERROR;
         if (d->zero_is_bad) d->remove_zeroes();
@@ -588,7 +609,7 @@ start:
     }
 
     /*
-     * fcol_INDI() optimizing wrapper.
+     * DCRAW_CFA_ROW() optimizing wrapper.
      * fcol_sequence() cooks up the filter color sequence for a row knowing that
      * it doesn't have to store more than 16 values. The result can be indexed
      * by the column using fcol_color() and that part must of course be inlined
@@ -596,14 +617,14 @@ start:
      * always try to index the column and not the row in order to reduce the
      * data cache footprint.
      */
-    static unsigned fcol_sequence(int filters, int row, int top_margin,
-                                  int left_margin, char xtrans[6][6])
+    static unsigned fcol_sequence(const dcraw_cfa *cfa, int row)
     {
+        const unsigned char *color = DCRAW_CFA_ROW(cfa, row);
         unsigned sequence = 0;
         int c;
 
         for (c = 15; c >= 0; --c)
-            sequence = (sequence << 2) | fcol_INDI(filters, row, c, top_margin, left_margin, xtrans);
+            sequence = (sequence << 2) | color[c];
         return sequence;
     }
 
@@ -699,6 +720,8 @@ start:
             f->image = (dcraw_image_type *)
                        g_realloc(f->image, h * w * sizeof(dcraw_image_type));
             f4 = hh->fourColorFilters;
+            dcraw_cfa cfa4;
+            cfa_init_INDI(&cfa4, f4, hh->top_margin, hh->left_margin, hh->xtrans);
 
 #ifdef _OPENMP
             #pragma omp parallel for schedule(static) private(r,ri,fseq,c,pixp)
@@ -706,7 +729,7 @@ start:
             for (r = 0; r < h; ++r) {
                 fseq = (unsigned*) g_malloc(scale * sizeof(unsigned));
                 for (ri = 0; ri < scale; ++ri)
-                    fseq[ri] = fcol_sequence(f4, r + ri, hh->top_margin, hh->left_margin, hh->xtrans);
+                    fseq[ri] = fcol_sequence(&cfa4, r + ri);
                 for (c = 0; c < w; ++c) {
                     pixp = f->image[r * w + c];
                     shrink_pixel(pixp, r, c, hh, fseq, scale);
@@ -846,10 +869,170 @@ start:
     int dcraw_flip_image(dcraw_image_data *image, int flip)
     {
         if (flip)
-            flip_image_INDI(image->image, &image->height, &image->width, flip);
+            flip_image_INDI(&image->image, &image->height, &image->width, flip);
         return DCRAW_SUCCESS;
     }
 
+    void dcraw_flip_buffer(void *dst, const void *src, int height, int width,
+                           int depth, int flip)
+    {
+        flip_buffer_INDI(dst, src, height, width, depth, flip);
+    }
+
+    /* One pixel of the dcraw_finalize_shrink() output. If fseq is not NULL
+     * it holds the filter sequences of the scale raw rows of each output
+     * row, see shrink_pixel(). Otherwise scale is the box size in the
+     * raw image, which is already shrunk in half if there are filters. */
+    static inline void shrink_flip_pixel(dcraw_image_type pixp, int row,
+                                         int col, dcraw_data *hh, unsigned *fseq, int scale,
+                                         int recombine)
+    {
+        if (fseq != NULL) {
+            shrink_pixel(pixp, row, col, hh, fseq + row * scale, scale);
+        } else if (scale == 1) {
+            memcpy(pixp, hh->raw.image[row * hh->raw.width + col],
+                   sizeof(dcraw_image_type));
+        } else {
+            dcraw_image_type *ibase = hh->raw.image +
+                                      row * scale * hh->raw.width + col * scale;
+            int cl, ri, ci;
+            for (cl = 0; cl < hh->raw.colors; ++cl) {
+                unsigned sum = 0;
+                for (ri = 0; ri < scale; ++ri)
+                    for (ci = 0; ci < scale; ++ci)
+                        sum += ibase[ri * hh->raw.width + ci][cl];
+                pixp[cl] = sum / (scale * scale);
+            }
+        }
+        if (recombine)
+            pixp[1] = (pixp[1] + pixp[3]) / 2;
+    }
+
+    /* Source positions of dcraw_image_stretch() along one axis. */
+    static void shrink_flip_axis(int *pos, double *frac, int newdim,
+                                 double step)
+    {
+        double rc;
+        int i, c;
+
+        for (rc = i = 0; i < newdim; i++, rc += step) {
+            frac[i] = rc - (c = (int)rc);
+            pos[i] = c;
+        }
+    }
+
+    /*
+     * The same as dcraw_finalize_shrink(), dcraw_image_stretch() and
+     * dcraw_flip_image() in a single pass over the final image, computing
+     * each pixel directly from the raw image. This saves the intermediate
+     * buffers and the single threaded stretch and flip passes.
+     * Fuji images, which need fuji_rotate_INDI(), take the long way.
+     */
+    int dcraw_finalize_shrink_flip(dcraw_image_data *f, dcraw_data *hh,
+                                   int scale, int flip)
+    {
+        DCRaw *d = (DCRaw *)hh->dcraw;
+        int h, w, sh, sw, r, ri, recombine, colors = hh->colors;
+        int *rpos, *cpos;
+        double *rfrac, *cfrac;
+        unsigned *fseq = NULL;
+
+        if (hh->fuji_width) {
+            int status = dcraw_finalize_shrink(f, hh, scale);
+            dcraw_image_stretch(f, hh->pixel_aspect);
+            dcraw_flip_image(f, flip);
+            return status;
+        }
+        g_free(d->messageBuffer);
+        d->messageBuffer = NULL;
+        d->lastStatus = DCRAW_SUCCESS;
+
+        recombine = (hh->colors == 3 && hh->raw.colors == 4);
+        /* the last row/column will be skipped if input is incomplete */
+        sh = h = hh->height / scale;
+        sw = w = hh->width / scale;
+        if (hh->pixel_aspect < 1)
+            sh = (int)(h / hh->pixel_aspect + 0.5);
+        if (hh->pixel_aspect > 1)
+            sw = (int)(w * hh->pixel_aspect + 0.5);
+
+        rpos = g_new(int, sh + sw);
+        cpos = rpos + sh;
+        rfrac = g_new(double, sh + sw);
+        cfrac = rfrac + sh;
+        shrink_flip_axis(rpos, rfrac, sh,
+                         hh->pixel_aspect < 1 ? hh->pixel_aspect : 1);
+        shrink_flip_axis(cpos, cfrac, sw,
+                         hh->pixel_aspect > 1 ? 1 / hh->pixel_aspect : 1);
+
+        /* hh->raw.image is shrunk in half if there are filters.
+         * If scale is odd we need to "unshrink" it using the info in
+         * hh->fourColorFilters before scaling it. */
+        if ((hh->filters == 1 || hh->filters > 1000) && scale % 2 == 1) {
+            dcraw_cfa cfa4;
+            cfa_init_INDI(&cfa4, hh->fourColorFilters, hh->top_margin,
+                          hh->left_margin, hh->xtrans);
+            fseq = g_new(unsigned, h * scale);
+            for (r = 0; r < h; ++r)
+                for (ri = 0; ri < scale; ++ri)
+                    fseq[r * scale + ri] = fcol_sequence(&cfa4, r + ri);
+        } else if (hh->filters == 1 || hh->filters > 1000) {
+            scale /= 2;
+        }
+
+        f->colors = colors;
+        if (flip & 4) {
+            f->height = sw;
+            f->width = sh;
+        } else {
+            f->height = sh;
+            f->width = sw;
+        }
+        f->image = (dcraw_image_type *)g_realloc(f->image,
+                   (gsize)sh * sw * sizeof(dcraw_image_type));
+
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(static) private(r)
+#endif
+        for (r = 0; r < f->height; ++r) {
+            dcraw_image_type *obase = f->image + (gsize)r * f->width;
+            dcraw_image_type pix1;
+            int col, c;
+            for (col = 0; col < f->width; ++col) {
+                /* The inverse of the mapping in flip_image_INDI() */
+                int sr = (flip & 4) ? col : r;
+                int sc = (flip & 4) ? r : col;
+                if (flip & 2) sr = sh - 1 - sr;
+                if (flip & 1) sc = sw - 1 - sc;
+                int r0 = rpos[sr], c0 = cpos[sc];
+                shrink_flip_pixel(obase[col], r0, c0, hh, fseq, scale,
+                                  recombine);
+                /* Interpolate like dcraw_image_stretch(). At most one
+                 * of the axes is stretched. */
+                int r1 = r0, c1 = c0;
+                double frac = 0;
+                if (rfrac[sr] != 0 && r0 + 1 < h) {
+                    r1 = r0 + 1;
+                    frac = rfrac[sr];
+                } else if (cfrac[sc] != 0 && c0 + 1 < w) {
+                    c1 = c0 + 1;
+                    frac = cfrac[sc];
+                }
+                if (frac == 0)
+                    continue;
+                shrink_flip_pixel(pix1, r1, c1, hh, fseq, scale, recombine);
+                FORCC obase[col][c] = (guint16)(obase[col][c] * (1 - frac) +
+                                                pix1[c] * frac + 0.5);
+            }
+        }
+        g_free(fseq);
+        g_free(rpos);
+        g_free(rfrac);
+
+        hh->message = d->messageBuffer;
+        return d->lastStatus;
+    }
+
     int dcraw_set_color_scale(dcraw_data *h, int useCameraWB)
     {
         DCRaw *d = (DCRaw *)h->dcraw;
@@ -932,6 +1115,7 @@ start:
         DCRaw *d = (DCRaw *)h->dcraw;
         int fujiWidth, i, r, c, cl;
         unsigned ff, f4;
+        dcraw_cfa cfa, cfa4;
 
         g_free(d->messageBuffer);
         d->messageBuffer = NULL;
@@ -966,34 +1150,37 @@ start:
         if (interpolation == dcraw_ppg_interpolation && h->colors > 3)
             interpolation = dcraw_vng_interpolation;
         f4 = h->fourColorFilters;
+        cfa_init_INDI(&cfa, ff, h->top_margin, h->left_margin, h->xtrans);
         if (h->filters == 1 || h->filters > 1000) {
-            for (r = 0; r < h->height; r++)
-                for (c = 0; c < h->width; c++) {
-                    int cc = fcol_INDI(f4, r, c, h->top_margin, h->left_margin, h->xtrans);
-                    f->image[r * f->width + c][fcol_INDI(ff, r, c, h->top_margin, h->left_margin, h->xtrans)] =
-                        h->raw.image[r / 2 * h->raw.width + c / 2][cc];
-                }
+            cfa_init_INDI(&cfa4, f4, h->top_margin, h->left_margin, h->xtrans);
+            for (r = 0; r < h->height; r++) {
+                const unsigned char *color = DCRAW_CFA_ROW(&cfa, r);
+                const unsigned char *color4 = DCRAW_CFA_ROW(&cfa4, r);
+                for (c = 0; c < h->width; c++)
+                    f->image[r * f->width + c][color[c % DCRAW_CFA_PERIOD]] =
+                        h->raw.image[r / 2 * h->raw.width + c / 2][color4[c % DCRAW_CFA_PERIOD]];
+            }
         } else
             memcpy(f->image, h->raw.image, h->height * h->width * sizeof(dcraw_image_type));
         int smoothPasses = 1;
         if (interpolation == dcraw_bilinear_interpolation && (h->filters == 1 || h->filters > 1000))
-            lin_interpolate_INDI(f->image, ff, f->width, f->height, cl, d, h);
+            lin_interpolate_INDI(f->image, &cfa, f->width, f->height, cl, d);
 #ifdef ENABLE_INTERP_NONE
         else if (interpolation == dcraw_none_interpolation)
             smoothing = 0;
 #endif
         else if (interpolation == dcraw_vng_interpolation || h->colors > 3)
-            vng_interpolate_INDI(f->image, ff, f->width, f->height, cl, 0xFFFF, d, h);
+            vng_interpolate_INDI(f->image, &cfa, f->width, f->height, cl, d);
         else if (interpolation == dcraw_ppg_interpolation && h->filters > 1000)
-            ppg_interpolate_INDI(f->image, ff, f->width, f->height, cl, d, h);
+            ppg_interpolate_INDI(f->image, &cfa, f->width, f->height, cl, d);
 
         else if (interpolation == dcraw_xtrans_interpolation) {
-            xtrans_interpolate_INDI(f->image, h->filters, f->width, f->height,
-                                    h->colors, h->rgb_cam, d, h, 3);
+            xtrans_interpolate_INDI(f->image, &cfa, f->width, f->height,
+                                    h->colors, h->rgb_cam, d, 3);
             smoothPasses = 3;
         } else if (interpolation == dcraw_ahd_interpolation) {
-            ahd_interpolate_INDI(f->image, ff, f->width, f->height, cl,
-                                 h->rgb_cam, d, h);
+            ahd_interpolate_INDI(f->image, &cfa, f->width, f->height, cl,
+                                 h->rgb_cam, d);
             smoothPasses = 3;
         }
         if (smoothing)
@@ -51,6 +51,23 @@ typedef struct {
     size_t thumbBufferLength;
 } dcraw_data;
 
+/* The color of every pixel of a color filter array pattern, see
+ * cfa_init_INDI(). 48 is a multiple of the 2x8 rows of the Bayer
+ * filters, the 6x6 X-Trans and the 16x16 Leaf patterns, so a single
+ * table lookup serves them all. */
+#define DCRAW_CFA_PERIOD 48
+typedef struct {
+    unsigned filters;
+    unsigned char color[DCRAW_CFA_PERIOD][DCRAW_CFA_PERIOD];
+} dcraw_cfa;
+
+/* The color sequence of a row, and the color of a pixel.
+ * row and col may be as low as -DCRAW_CFA_PERIOD. */
+#define DCRAW_CFA_ROW(cfa, row) \
+    ((cfa)->color[(unsigned)((row) + DCRAW_CFA_PERIOD) % DCRAW_CFA_PERIOD])
+#define DCRAW_CFA_COLOR(cfa, row, col) \
+    DCRAW_CFA_ROW(cfa, row)[(unsigned)((col) + DCRAW_CFA_PERIOD) % DCRAW_CFA_PERIOD]
+
 enum { dcraw_ahd_interpolation,
        dcraw_vng_interpolation, dcraw_four_color_interpolation,
        dcraw_ppg_interpolation, dcraw_bilinear_interpolation,
@@ -65,6 +82,10 @@ int dcraw_finalize_shrink(dcraw_image_data *f, dcraw_data *h,
 int dcraw_image_resize(dcraw_image_data *image, int size);
 int dcraw_image_stretch(dcraw_image_data *image, double pixel_aspect);
 int dcraw_flip_image(dcraw_image_data *image, int flip);
+void dcraw_flip_buffer(void *dst, const void *src, int height, int width,
+                       int depth, int flip);
+int dcraw_finalize_shrink_flip(dcraw_image_data *f, dcraw_data *h,
+                               int scale, int flip);
 int dcraw_set_color_scale(dcraw_data *h, int useCameraWB);
 void dcraw_wavelet_denoise(dcraw_data *h, float threshold);
 void dcraw_wavelet_denoise_shrinked(dcraw_image_data *f, float threshold);
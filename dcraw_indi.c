@@ -26,6 +26,7 @@
 #include <glib/gi18n.h> /*For _(String) definition - NKBJ*/
 #include "dcraw_api.h"
 #include "uf_progress.h"
+#include "uf_parallel.h"
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -97,6 +98,20 @@ int CLASS fcol_INDI(const unsigned filters, const int row, const int col,
     return FC(row, col);
 }
 
+/* Tabulate fcol_INDI() once, for kernels that look up every pixel */
+void CLASS cfa_init_INDI(dcraw_cfa *cfa, const unsigned filters,
+                         const int top_margin, const int left_margin,
+                         /*const*/ char xtrans[6][6])
+{
+    int row, col;
+
+    cfa->filters = filters;
+    for (row = 0; row < DCRAW_CFA_PERIOD; row++)
+        for (col = 0; col < DCRAW_CFA_PERIOD; col++)
+            cfa->color[row][col] = fcol_INDI(filters, row, col, top_margin,
+                                             left_margin, xtrans);
+}
+
 static void CLASS merror(void *ptr, char *where)
 {
     if (ptr) return;
@@ -148,6 +163,7 @@ void CLASS wavelet_denoise_INDI(ushort(*image)[4], const int black,
 #endif
 #endif
     FORC(nc) {			/* denoise R,G1,B,G3 individually */
+        if (cancelled()) continue;
         fimg = (float *) malloc(size * 3 * sizeof * fimg);
         for (i = 0; i < size; i++)
             fimg[i] = 256 * sqrt(image[i][c] /*<< scale*/);
@@ -173,11 +189,13 @@ void CLASS wavelet_denoise_INDI(ushort(*image)[4], const int black,
                 if (hpass) fimg[i] += fimg[hpass + i];
             }
             hpass = lpass;
+            if (cancelled()) break;
         }
         for (i = 0; i < size; i++)
             image[i][c] = CLIP(SQR(fimg[i] + fimg[lpass + i]) / 0x10000);
         free(fimg);
     }
+    if (cancelled()) return;
     if (filters && colors == 3) {  /* pull G1 and G3 closer together */
         for (row = 0; row < 2; row++)
             mul[row] = 0.125 * pre_mul[FC(row + 1, 0) | 1] / pre_mul[FC(row, 0) | 1];
@@ -256,7 +274,7 @@ void CLASS scale_colors_INDI(const int maximum, const int black,
 }
 
 void CLASS border_interpolate_INDI(const int height, const int width,
-                                   ushort(*image)[4], const unsigned filters, int colors, int border, dcraw_data *h)
+                                   ushort(*image)[4], const dcraw_cfa *cfa, int colors, int border)
 {
     int row, col, y, x, f, c, sum[8];
 
@@ -268,35 +286,35 @@ void CLASS border_interpolate_INDI(const int height, const int width,
             for (y = row - 1; y != row + 2; y++)
                 for (x = col - 1; x != col + 2; x++)
                     if (y >= 0 && y < height && x >= 0 && x < width) {
-                        f = fcol_INDI(filters, y, x, h->top_margin, h->left_margin, h->xtrans);
+                        f = DCRAW_CFA_COLOR(cfa, y, x);
                         sum[f] += image[y * width + x][f];
                         sum[f + 4]++;
                     }
-            f = fcol_INDI(filters, row, col, h->top_margin, h->left_margin, h->xtrans);
+            f = DCRAW_CFA_COLOR(cfa, row, col);
             FORCC if (c != f && sum[c + 4])
                 image[row * width + col][c] = sum[c] / sum[c + 4];
         }
 }
 
-void CLASS lin_interpolate_INDI(ushort(*image)[4], const unsigned filters,
-                                const int width, const int height, const int colors, void *dcraw, dcraw_data *h) /*UF*/
+void CLASS lin_interpolate_INDI(ushort(*image)[4], const dcraw_cfa *cfa,
+                                const int width, const int height, const int colors, void *dcraw) /*UF*/
 {
     int code[16][16][32], size = 16, *ip, sum[4];
     int f, c, i, x, y, row, col, shift, color;
     ushort *pix;
 
     dcraw_message(dcraw, DCRAW_VERBOSE, _("Bilinear interpolation...\n")); /*UF*/
-    if (filters == 9) size = 6;
-    border_interpolate_INDI(height, width, image, filters, colors, 1, h);
+    if (cfa->filters == 9) size = 6;
+    border_interpolate_INDI(height, width, image, cfa, colors, 1);
     for (row = 0; row < size; row++) {
         for (col = 0; col < size; col++) {
             ip = code[row][col] + 1;
-            f = fcol_INDI(filters, row, col, h->top_margin, h->left_margin, h->xtrans);
+            f = DCRAW_CFA_COLOR(cfa, row, col);
             memset(sum, 0, sizeof sum);
             for (y = -1; y <= 1; y++)
                 for (x = -1; x <= 1; x++) {
                     shift = (y == 0) + (x == 0);
-                    color = fcol_INDI(filters, row + y, col + x, h->top_margin, h->left_margin, h->xtrans);
+                    color = DCRAW_CFA_COLOR(cfa, row + y, col + x);
                     if (color == f) continue;
                     *ip++ = (width * y + x) * 4 + color;
                     *ip++ = shift;
@@ -337,8 +355,8 @@ void CLASS lin_interpolate_INDI(ushort(*image)[4], const unsigned filters,
    I've extended the basic idea to work with non-Bayer filter arrays.
    Gradients are numbered clockwise from NW=0 to W=7.
  */
-void CLASS vng_interpolate_INDI(ushort(*image)[4], const unsigned filters,
-                                const int width, const int height, const int colors, void *dcraw, dcraw_data *h) /*UF*/
+void CLASS vng_interpolate_INDI(ushort(*image)[4], const dcraw_cfa *cfa,
+                                const int width, const int height, const int colors, void *dcraw) /*UF*/
 {
     static const signed char *cp, terms[] = {
         -2, -2, +0, -1, 0, 0x01, -2, -2, +0, +0, 1, 0x01, -2, -1, -1, +0, 0, 0x01,
@@ -370,11 +388,11 @@ void CLASS vng_interpolate_INDI(ushort(*image)[4], const unsigned filters,
     int g, diff, thold, num, c;
     ushort rowtmp[4][width * 4];
 
-    lin_interpolate_INDI(image, filters, width, height, colors, dcraw, h); /*UF*/
+    lin_interpolate_INDI(image, cfa, width, height, colors, dcraw); /*UF*/
     dcraw_message(dcraw, DCRAW_VERBOSE, _("VNG interpolation...\n")); /*UF*/
 
-    if (filters == 1) prow = pcol = 16;
-    if (filters == 9) prow = pcol =  6;
+    if (cfa->filters == 1) prow = pcol = 16;
+    if (cfa->filters == 9) prow = pcol =  6;
     int *ipalloc = ip = (int *) calloc(prow * pcol, 1280);
     merror(ip, "vng_interpolate()");
     for (row = 0; row < prow; row++)		/* Precalculate for VNG */
@@ -387,9 +405,9 @@ void CLASS vng_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                 x2 = *cp++;
                 weight = *cp++;
                 grads = *cp++;
-                color = fcol_INDI(filters, row + y1, col + x1, h->top_margin, h->left_margin, h->xtrans);
-                if (fcol_INDI(filters, row + y2, col + x2, h->top_margin, h->left_margin, h->xtrans) != color) continue;
-                diag = (fcol_INDI(filters, row, col + 1, h->top_margin, h->left_margin, h->xtrans) == color && fcol_INDI(filters, row + 1, col, h->top_margin, h->left_margin, h->xtrans) == color) ? 2 : 1;
+                color = DCRAW_CFA_COLOR(cfa, row + y1, col + x1);
+                if (DCRAW_CFA_COLOR(cfa, row + y2, col + x2) != color) continue;
+                diag = (DCRAW_CFA_COLOR(cfa, row, col + 1) == color && DCRAW_CFA_COLOR(cfa, row + 1, col) == color) ? 2 : 1;
                 if (abs(y1 - y2) == diag && abs(x1 - x2) == diag) continue;
                 *ip++ = (y1 * width + x1) * 4 + color;
                 *ip++ = (y2 * width + x2) * 4 + color;
@@ -403,8 +421,8 @@ void CLASS vng_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                 y = *cp++;
                 x = *cp++;
                 *ip++ = (y * width + x) * 4;
-                color = fcol_INDI(filters, row, col, h->top_margin, h->left_margin, h->xtrans);
-                if (fcol_INDI(filters, row + y, col + x, h->top_margin, h->left_margin, h->xtrans) != color && fcol_INDI(filters, row + y * 2, col + x * 2, h->top_margin, h->left_margin, h->xtrans) == color)
+                color = DCRAW_CFA_COLOR(cfa, row, col);
+                if (DCRAW_CFA_COLOR(cfa, row + y, col + x) != color && DCRAW_CFA_COLOR(cfa, row + y * 2, col + x * 2) == color)
                     *ip++ = (y * width + x) * 8 + color;
                 else
                     *ip++ = 0;
@@ -414,7 +432,7 @@ void CLASS vng_interpolate_INDI(ushort(*image)[4], const unsigned filters,
 #ifdef _OPENMP
     #pragma omp parallel				\
     default(none)					\
-    shared(image,code,prow,pcol,h)			\
+    shared(image,code,prow,pcol,cfa)			\
     private(row,col,g,brow,rowtmp,pix,ip,gval,diff,gmin,gmax,thold,sum,color,num,c,t)
 #endif
     {
@@ -450,7 +468,7 @@ void CLASS vng_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                 }
                 thold = gmin + (gmax >> 1);
                 memset(sum, 0, sizeof sum);
-                color = fcol_INDI(filters, row, col, h->top_margin, h->left_margin, h->xtrans);
+                color = DCRAW_CFA_COLOR(cfa, row, col);
                 for (num = g = 0; g < 8; g++, ip += 2) { /* Average the neighbors */
                     if (gval[g] <= thold) {
                         FORCC
@@ -483,97 +501,154 @@ void CLASS vng_interpolate_INDI(ushort(*image)[4], const unsigned filters,
 /*
    Patterned Pixel Grouping Interpolation by Alain Desbiolles
 */
-void CLASS ppg_interpolate_INDI(ushort(*image)[4], const unsigned filters,
-                                const int width, const int height,
-                                const int colors, void *dcraw, dcraw_data *h)
+/* The three steps of PPG for one row. The green step reads only raw
+   values, the other two read raw values and the green of the rows above
+   and below, so they can follow the green step band by band. */
+static void CLASS ppg_green_row(ushort(*image)[4], const unsigned filters,
+                                const int width, const int row)
+{
+    const int w = width;
+    int col, c, gh, gv, dh, dv;
+    ushort(*pix)[4];
+
+    /*  Fill in the green layer with gradients and pattern recognition: */
+    for (col = 3 + (FC(row, 3) & 1), c = FC(row, col); col < width - 3; col += 2) {
+        pix = image + row * width + col;
+        gh = (pix[-1][1] + pix[0][c] + pix[1][1]) * 2
+             - pix[-2][c] - pix[2][c];
+        dh = (ABS(pix[-2][c] - pix[0][c]) +
+              ABS(pix[ 2][c] - pix[0][c]) +
+              ABS(pix[-1][1] - pix[1][1])) * 3 +
+             (ABS(pix[ 3][1] - pix[1][1]) +
+              ABS(pix[-3][1] - pix[-1][1])) * 2;
+        gv = (pix[-w][1] + pix[0][c] + pix[w][1]) * 2
+             - pix[-2 * w][c] - pix[2 * w][c];
+        dv = (ABS(pix[-2 * w][c] - pix[0][c]) +
+              ABS(pix[ 2 * w][c] - pix[0][c]) +
+              ABS(pix[-w][1] - pix[w][1])) * 3 +
+             (ABS(pix[ 3 * w][1] - pix[w][1]) +
+              ABS(pix[-3 * w][1] - pix[-w][1])) * 2;
+        pix[0][1] = dh > dv ? ULIM(gv >> 2, pix[w][1], pix[-w][1])
+                    : ULIM(gh >> 2, pix[1][1], pix[-1][1]);
+    }
+}
+
+static void CLASS ppg_redblue_row(ushort(*image)[4], const unsigned filters,
+                                  const int width, const int row)
 {
-    int dir[5] = { 1, width, -1, -width, 1 };
-    int row, col, diff[2] = { 0, 0 }, guess[2], c, d, i;
+    const int w = width;
+    int col, c, dp, dm, gp, gm;
     ushort(*pix)[4];
 
-    border_interpolate_INDI(height, width, image, filters, colors, 3, h);
+    /*  Calculate red and blue for each green pixel: */
+    for (col = 1 + (FC(row, 2) & 1), c = FC(row, col + 1); col < width - 1; col += 2) {
+        pix = image + row * width + col;
+        pix[0][c] = CLIP((pix[-1][c] + pix[1][c] + 2 * pix[0][1]
+                          - pix[-1][1] - pix[1][1]) >> 1);
+        pix[0][2 - c] = CLIP((pix[-w][2 - c] + pix[w][2 - c] + 2 * pix[0][1]
+                              - pix[-w][1] - pix[w][1]) >> 1);
+    }
+    /*  Calculate blue for red pixels and vice versa: */
+    for (col = 1 + (FC(row, 1) & 1), c = 2 - FC(row, col); col < width - 1; col += 2) {
+        pix = image + row * width + col;
+        dp = ABS(pix[-w - 1][c] - pix[w + 1][c]) +
+             ABS(pix[-w - 1][1] - pix[0][1]) +
+             ABS(pix[ w + 1][1] - pix[0][1]);
+        gp = pix[-w - 1][c] + pix[w + 1][c] + 2 * pix[0][1]
+             - pix[-w - 1][1] - pix[w + 1][1];
+        dm = ABS(pix[-w + 1][c] - pix[w - 1][c]) +
+             ABS(pix[-w + 1][1] - pix[0][1]) +
+             ABS(pix[ w - 1][1] - pix[0][1]);
+        gm = pix[-w + 1][c] + pix[w - 1][c] + 2 * pix[0][1]
+             - pix[-w + 1][1] - pix[w - 1][1];
+        if (dp != dm)
+            pix[0][c] = CLIP((dp > dm ? gm : gp) >> 1);
+        else
+            pix[0][c] = CLIP((gp + gm) >> 2);
+    }
+}
+
+#define PPG_BAND 16	/* Rows per band */
+
+void CLASS ppg_interpolate_INDI(ushort(*image)[4], const dcraw_cfa *cfa,
+                                const int width, const int height,
+                                const int colors, void *dcraw)
+{
+    /* Bayer only, FC() is quicker than the table */
+    const unsigned filters = cfa->filters;
+    const int bands = (height - 2 + PPG_BAND - 1) / PPG_BAND;
+    int band, top, bottom, row;
+
+    border_interpolate_INDI(height, width, image, cfa, colors, 3);
     dcraw_message(dcraw, DCRAW_VERBOSE, _("PPG interpolation...\n")); /*UF*/
 
+    /* Each band gets its green and then red and blue while it is still in
+       the cache. Only the first and last rows of a band need the green of
+       the neighbouring bands, they are left until all bands are done. */
 #ifdef _OPENMP
-    #pragma omp parallel				\
-    default(none)					\
-    shared(image,dir,diff)				\
-    private(row,col,i,d,c,pix,guess)
+    #pragma omp parallel default(shared) private(band,top,bottom,row)
 #endif
     {
-        /*  Fill in the green layer with gradients and pattern recognition: */
-#ifdef _OPENMP
-        #pragma omp for
-#endif
-        for (row = 3; row < height - 3; row++) {
-            for (col = 3 + (FC(row, 3) & 1), c = FC(row, col); col < width - 3; col += 2) {
-                pix = image + row * width + col;
-                for (i = 0; (d = dir[i]) > 0; i++) {
-                    guess[i] = (pix[-d][1] + pix[0][c] + pix[d][1]) * 2
-                               - pix[-2 * d][c] - pix[2 * d][c];
-                    diff[i] = (ABS(pix[-2 * d][c] - pix[ 0][c]) +
-                               ABS(pix[ 2 * d][c] - pix[ 0][c]) +
-                               ABS(pix[  -d][1] - pix[ d][1])) * 3 +
-                              (ABS(pix[ 3 * d][1] - pix[ d][1]) +
-                               ABS(pix[-3 * d][1] - pix[-d][1])) * 2;
-                }
-                d = dir[i = diff[0] > diff[1]];
-                pix[0][1] = ULIM(guess[i] >> 2, pix[d][1], pix[-d][1]);
-            }
-        }
-        /*  Calculate red and blue for each green pixel: */
 #ifdef _OPENMP
         #pragma omp for
 #endif
-        for (row = 1; row < height - 1; row++) {
-            for (col = 1 + (FC(row, 2) & 1), c = FC(row, col + 1); col < width - 1; col += 2) {
-                pix = image + row * width + col;
-                for (i = 0; (d = dir[i]) > 0; c = 2 - c, i++)
-                    pix[0][c] = CLIP((pix[-d][c] + pix[d][c] + 2 * pix[0][1]
-                                      - pix[-d][1] - pix[d][1]) >> 1);
-            }
+        for (band = 0; band < bands; band++) {
+            top = 1 + band * PPG_BAND;
+            bottom = MIN(top + PPG_BAND, height - 1);
+            for (row = MAX(top, 3); row < MIN(bottom, height - 3); row++)
+                ppg_green_row(image, filters, width, row);
+            for (row = top + 1; row < bottom - 1; row++)
+                ppg_redblue_row(image, filters, width, row);
         }
-        /*  Calculate blue for red pixels and vice versa: */
 #ifdef _OPENMP
         #pragma omp for
 #endif
-        for (row = 1; row < height - 1; row++) {
-            for (col = 1 + (FC(row, 1) & 1), c = 2 - FC(row, col); col < width - 1; col += 2) {
-                pix = image + row * width + col;
-                for (i = 0; (d = dir[i] + dir[i + 1]) > 0; i++) {
-                    diff[i] = ABS(pix[-d][c] - pix[d][c]) +
-                              ABS(pix[-d][1] - pix[0][1]) +
-                              ABS(pix[ d][1] - pix[0][1]);
-                    guess[i] = pix[-d][c] + pix[d][c] + 2 * pix[0][1]
-                               - pix[-d][1] - pix[d][1];
-                }
-                if (diff[0] != diff[1])
-                    pix[0][c] = CLIP(guess[diff[0] > diff[1]] >> 1);
-                else
-                    pix[0][c] = CLIP((guess[0] + guess[1]) >> 2);
-            }
+        for (band = 0; band < bands; band++) {
+            top = 1 + band * PPG_BAND;
+            bottom = MIN(top + PPG_BAND, height - 1);
+            ppg_redblue_row(image, filters, width, top);
+            if (bottom - 1 > top)
+                ppg_redblue_row(image, filters, width, bottom - 1);
         }
     }
 }
 
-void CLASS cielab_INDI(ushort rgb[3], short lab[3], const int colors,
-                       const float rgb_cam[3][4])
+/* The cube root table is the same for every image, the camera matrix is
+ * kept by the caller, since images are demosaiced concurrently. */
+static float cielab_cbrt[0x10000];
+
+static gpointer cielab_cbrt_init(gpointer data)
 {
-    int c, i, j, k;
-    float r, xyz[3];
-    static float cbrt[0x10000], xyz_cam[3][4];
-
-    if (!rgb) {
-        for (i = 0; i < 0x10000; i++) {
-            r = i / 65535.0;
-            cbrt[i] = r > 0.008856 ? pow(r, (float)(1 / 3.0)) : 7.787 * r + 16 / 116.0;
-        }
-        for (i = 0; i < 3; i++)
-            for (j = 0; j < colors; j++)
-                for (xyz_cam[i][j] = k = 0; k < 3; k++)
-                    xyz_cam[i][j] += xyz_rgb[i][k] * rgb_cam[k][j] / d65_white[i];
-        return;
+    int i;
+    float r;
+    (void)data;
+    for (i = 0; i < 0x10000; i++) {
+        r = i / 65535.0;
+        cielab_cbrt[i] = r > 0.008856 ? pow(r, (float)(1 / 3.0)) : 7.787 * r + 16 / 116.0;
     }
+    return NULL;
+}
+
+static void CLASS cielab_init_INDI(float xyz_cam[3][4], const int colors,
+                                   const float rgb_cam[3][4])
+{
+    static GOnce once = G_ONCE_INIT;
+    int i, j, k;
+
+    g_once(&once, cielab_cbrt_init, NULL);
+    for (i = 0; i < 3; i++)
+        for (j = 0; j < colors; j++)
+            for (xyz_cam[i][j] = k = 0; k < 3; k++)
+                xyz_cam[i][j] += xyz_rgb[i][k] * rgb_cam[k][j] / d65_white[i];
+}
+
+void CLASS cielab_INDI(ushort rgb[3], short lab[3], const int colors,
+                       const float xyz_cam[3][4])
+{
+    const float *cbrt = cielab_cbrt;
+    int c;
+    float xyz[3];
+
     xyz[0] = xyz[1] = xyz[2] = 0.5;
     FORCC {
         xyz[0] += xyz_cam[0][c] * rgb[c];
@@ -589,13 +664,62 @@ void CLASS cielab_INDI(ushort rgb[3], short lab[3], const int colors,
 }
 
 #define TS 512		/* Tile Size */
+
+/* The tile buffers of xtrans_interpolate_INDI() are large, one per thread.
+ * Keep a few of them from one call to the next, up to one per processor
+ * and XTRANS_BUFFERS_BYTES in total, since the GIMP plug-in and the
+ * conversion service hold them for the life of the process. */
+#define XTRANS_BUFFERS_MAX 64
+#define XTRANS_BUFFERS_BYTES (64 << 20)
+static char *xtrans_buffers[XTRANS_BUFFERS_MAX];
+static size_t xtrans_buffers_size = 0;
+static int xtrans_buffers_count = 0;
+G_LOCK_DEFINE_STATIC(xtrans_buffers);
+
+static char *xtrans_buffer_get(size_t size)
+{
+    char *buffer = NULL;
+    G_LOCK(xtrans_buffers);
+    if (xtrans_buffers_count > 0 && xtrans_buffers_size == size)
+        buffer = xtrans_buffers[--xtrans_buffers_count];
+    G_UNLOCK(xtrans_buffers);
+    if (buffer == NULL) {
+        buffer = (char *) malloc(size);
+        merror(buffer, "xtrans_interpolate()");
+    }
+    return buffer;
+}
+
+static void xtrans_buffer_put(char *buffer, size_t size)
+{
+    G_LOCK(xtrans_buffers);
+    if (xtrans_buffers_size != size) {
+        // Buffers of another size, passes setting changed
+        while (xtrans_buffers_count > 0)
+            free(xtrans_buffers[--xtrans_buffers_count]);
+        xtrans_buffers_size = size;
+    }
+#ifdef _OPENMP
+    int keep = MIN(omp_get_num_procs(), XTRANS_BUFFERS_MAX);
+#else
+    int keep = 1;
+#endif
+    keep = MIN(keep, (int)(XTRANS_BUFFERS_BYTES / size));
+    if (xtrans_buffers_count < keep) {
+        xtrans_buffers[xtrans_buffers_count++] = buffer;
+        buffer = NULL;
+    }
+    G_UNLOCK(xtrans_buffers);
+    free(buffer);
+}
+
 /*
    Frank Markesteijn's algorithm for Fuji X-Trans sensors
  */
-void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
+void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const dcraw_cfa *cfa,
                                    const int width, const int height,
                                    const int colors, const float rgb_cam[3][4],
-                                   void *dcraw, dcraw_data *hh, const int passes)
+                                   void *dcraw, const int passes)
 {
     int c, d, f, g, h, i, v, ng, row, col, top, left, mrow, mcol;
     int val, ndir, pass, hm[8], avg[4], color[3][8];
@@ -610,18 +734,19 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
     short(*lab)    [TS][3], (*lix)[3];
     float(*drv)[TS][TS], diff[6], tr;
     char(*homo)[TS][TS], *buffer;
+    float xyz_cam[3][4];
 
     dcraw_message(dcraw, DCRAW_VERBOSE, _("%d-pass X-Trans interpolation...\n"), passes); /*NKBJ*/
 
-    cielab_INDI(0, 0, colors, rgb_cam);
+    cielab_init_INDI(xyz_cam, colors, rgb_cam);
     ndir = 4 << (passes > 1);
 
     /* Map a green hexagon around each non-green pixel and vice versa:      */
     for (row = 0; row < 3; row++)
         for (col = 0; col < 3; col++)
             for (ng = d = 0; d < 10; d += 2) {
-                g = fcol_INDI(filters, row, col, hh->top_margin, hh->left_margin, hh->xtrans) == 1;
-                if (fcol_INDI(filters, row + orth[d], col + orth[d + 2], hh->top_margin, hh->left_margin, hh->xtrans) == 1) ng = 0;
+                g = DCRAW_CFA_COLOR(cfa, row, col) == 1;
+                if (DCRAW_CFA_COLOR(cfa, row + orth[d], col + orth[d + 2]) == 1) ng = 0;
                 else ng++;
                 if (ng == 4) {
                     sgrow = row;
@@ -635,40 +760,34 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                 }
             }
 
-    /* Set green1 and green3 to the minimum and maximum allowed values:     */
+    /* Set green1 and green3 to the minimum and maximum allowed values.
+     * Every non-green pixel takes the range of its own green hexagon,
+     * which only holds green pixels, so the rows are independent.     */
+#ifdef _OPENMP
+    #pragma omp parallel for default(shared) private(row, col, pix, hex, min, max, val, c)
+#endif
     for (row = 2; row < height - 2; row++)
-        for (min = ~(max = 0), col = 2; col < width - 2; col++) {
-            if (fcol_INDI(filters, row, col, hh->top_margin, hh->left_margin, hh->xtrans) == 1 && (min = ~(max = 0))) continue;
+        for (col = 2; col < width - 2; col++) {
+            if (DCRAW_CFA_COLOR(cfa, row, col) == 1) continue;
             pix = image + row * width + col;
             hex = allhex[row % 3][col % 3][0];
-            if (!max) FORC(6) {
+            min = ~(max = 0);
+            FORC(6) {
                 val = pix[hex[c]][1];
                 if (min > val) min = val;
                 if (max < val) max = val;
             }
             pix[0][1] = min;
             pix[0][3] = max;
-            switch ((row - sgrow) % 3) {
-                case 1:
-                    if (row < height - 3) {
-                        row++;
-                        col--;
-                    }
-                    break;
-                case 2:
-                    if ((min = ~(max = 0)) && (col += 2) < width - 3 && row > 2) row--;
-            }
         }
 
-
 #ifdef _OPENMP
     #pragma omp parallel				\
     default(shared)					\
     private(top, left, row, col, pix, mrow, mcol, hex, color, c, pass, rix, val, d, f, g, h, i, diff, lix, tr, avg, v, buffer, rgb, lab, drv, homo, hm, max)
 #endif
     {
-        buffer = (char *) malloc(TS * TS * (ndir * 11 + 6));
-        merror(buffer, "xtrans_interpolate()");
+        buffer = xtrans_buffer_get(TS * TS * (ndir * 11 + 6));
         rgb  = (ushort(*)[TS][TS][3]) buffer;
         lab  = (short(*)    [TS][3])(buffer + TS * TS * (ndir * 6));
         drv  = (float(*)[TS][TS])(buffer + TS * TS * (ndir * 6 + 6));
@@ -682,6 +801,7 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
 
         for (top = 3; top < height - 19; top += TS - 16) {
             progress(PROGRESS_INTERPOLATE, TS - 16);
+            if (cancelled()) continue;
             for (left = 3; left < width - 19; left += TS - 16) {
                 mrow = MIN(top + TS, height - 3);
                 mcol = MIN(left + TS, width - 3);
@@ -693,7 +813,7 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                 /* Interpolate green horizontally, vertically, and along both diagonals: */
                 for (row = top; row < mrow; row++)
                     for (col = left; col < mcol; col++) {
-                        if ((f = fcol_INDI(filters, row, col, hh->top_margin, hh->left_margin, hh->xtrans)) == 1) continue;
+                        if ((f = DCRAW_CFA_COLOR(cfa, row, col)) == 1) continue;
                         pix = image + row * width + col;
                         hex = allhex[row % 3][col % 3][0];
                         color[1][0] = 174 * (pix[  hex[1]][1] + pix[  hex[0]][1]) -
@@ -715,7 +835,7 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                     if (pass) {
                         for (row = top + 2; row < mrow - 2; row++)
                             for (col = left + 2; col < mcol - 2; col++) {
-                                if ((f = fcol_INDI(filters, row, col, hh->top_margin, hh->left_margin, hh->xtrans)) == 1) continue;
+                                if ((f = DCRAW_CFA_COLOR(cfa, row, col)) == 1) continue;
                                 pix = image + row * width + col;
                                 hex = allhex[row % 3][col % 3][1];
                                 for (d = 3; d < 6; d++) {
@@ -731,7 +851,7 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                     for (row = (top - sgrow + 4) / 3 * 3 + sgrow; row < mrow - 2; row += 3)
                         for (col = (left - sgcol + 4) / 3 * 3 + sgcol; col < mcol - 2; col += 3) {
                             rix = &rgb[0][row - top][col - left];
-                            h = fcol_INDI(filters, row, col + 1, hh->top_margin, hh->left_margin, hh->xtrans);
+                            h = DCRAW_CFA_COLOR(cfa, row, col + 1);
                             memset(diff, 0, sizeof diff);
                             for (i = 1, d = 0; d < 6; d++, i ^= TS ^ 1, h ^= 2) {
                                 for (c = 0; c < 2; c++, h ^= 2) {
@@ -754,7 +874,7 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                     /* Interpolate red for blue pixels and vice versa:              */
                     for (row = top + 3; row < mrow - 3; row++)
                         for (col = left + 3; col < mcol - 3; col++) {
-                            if ((f = 2 - fcol_INDI(filters, row, col, hh->top_margin, hh->left_margin, hh->xtrans)) == 1) continue;
+                            if ((f = 2 - DCRAW_CFA_COLOR(cfa, row, col)) == 1) continue;
                             rix = &rgb[0][row - top][col - left];
                             c = (row - sgrow) % 3 ? TS : 1;
                             h = 3 * (c ^ TS ^ 1);
@@ -792,7 +912,7 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                 for (d = 0; d < ndir; d++) {
                     for (row = 2; row < mrow - 2; row++)
                         for (col = 2; col < mcol - 2; col++)
-                            cielab_INDI(rgb[d][row][col], lab[row][col], colors, rgb_cam);
+                            cielab_INDI(rgb[d][row][col], lab[row][col], colors, xyz_cam);
                     for (f = dir[d & 3], row = 3; row < mrow - 3; row++)
                         for (col = 3; col < mcol - 3; col++) {
                             lix = &lab[row][col];
@@ -843,28 +963,32 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                     }
             }
         }
-        free(buffer);
+        xtrans_buffer_put(buffer, TS * TS * (ndir * 11 + 6));
     } /* _OPENMP */
-    border_interpolate_INDI(height, width, image, filters, colors, 8, hh);
+    border_interpolate_INDI(height, width, image, cfa, colors, 8);
 }
 
 /*
    Adaptive Homogeneity-Directed interpolation is based on
    the work of Keigo Hirakawa, Thomas Parks, and Paul Lee.
  */
-void CLASS ahd_interpolate_INDI(ushort(*image)[4], const unsigned filters,
+void CLASS ahd_interpolate_INDI(ushort(*image)[4], const dcraw_cfa *cfa,
                                 const int width, const int height,
                                 const int colors, const float rgb_cam[3][4],
-                                void *dcraw, dcraw_data *h)
+                                void *dcraw)
 {
+    /* Bayer only, FC() is quicker than the table */
+    const unsigned filters = cfa->filters;
     int i, j, top, left, row, col, tr, tc, c, d, val, hm[2];
     static const int dir[4] = { -1, 1, -TS, TS };
     unsigned ldiff[2][4], abdiff[2][4], leps, abeps;
     ushort(*rgb)[TS][TS][3], (*rix)[3], (*pix)[4];
     short(*lab)[TS][TS][3], (*lix)[3];
     char(*homo)[TS][TS], *buffer;
+    float xyz_cam[3][4];
 
     dcraw_message(dcraw, DCRAW_VERBOSE, _("AHD interpolation...\n")); /*UF*/
+    cielab_init_INDI(xyz_cam, colors, rgb_cam);
 
 #ifdef _OPENMP
     #pragma omp parallel				\
@@ -872,8 +996,7 @@ void CLASS ahd_interpolate_INDI(ushort(*image)[4], const unsigned filters,
     private(top, left, row, col, pix, rix, lix, c, val, d, tc, tr, i, j, ldiff, abdiff, leps, abeps, hm, buffer, rgb, lab, homo)
 #endif
     {
-        cielab_INDI(0, 0, colors, rgb_cam);
-        border_interpolate_INDI(height, width, image, filters, colors, 5, h);
+        border_interpolate_INDI(height, width, image, cfa, colors, 5);
         buffer = (char *) malloc(26 * TS * TS);
         merror(buffer, "ahd_interpolate()");
         rgb  = (ushort(*)[TS][TS][3]) buffer;
@@ -886,6 +1009,7 @@ void CLASS ahd_interpolate_INDI(ushort(*image)[4], const unsigned filters,
 #endif
         for (top = 2; top < height - 5; top += TS - 6) {
             progress(PROGRESS_INTERPOLATE, TS - 6);
+            if (cancelled()) continue;
             for (left = 2; left < width - 5; left += TS - 6) {
 
                 /*  Interpolate green horizontally and vertically: */
@@ -923,7 +1047,7 @@ void CLASS ahd_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                             rix[0][c] = CLIP(val);
                             c = FC(row, col);
                             rix[0][c] = pix[0][c];
-                            cielab_INDI(rix[0], lix[0], colors, rgb_cam);
+                            cielab_INDI(rix[0], lix[0], colors, xyz_cam);
                         }
                 /*  Build homogeneity maps from the CIELab images: */
                 memset(homo, 0, 2 * TS * TS);
@@ -1077,43 +1201,97 @@ void CLASS color_smooth(ushort(*image)[4], const int width, const int height,
     }
 }
 
+/* Output tiles of fuji_rotate_INDI(). A tile reads a diamond of the
+   source that fits easily in the cache. */
+#define FUJI_TILE 64
+/* Fixed point bits of the source positions and of the interpolation
+   weights. Four weighted 16 bit values still fit in 32 bits. */
+#define FUJI_POS_BITS 16
+#define FUJI_WEIGHT_BITS 8
+
+typedef struct {
+    ushort(*image)[4], (*img)[4];
+    int height, width, fuji_width, colors;
+    ushort wide, high;
+    double step;
+    int stepFix, tilesWide;
+} fuji_rotate_job;
+
+static void fuji_rotate_task(int tile, void *data)
+{
+    const fuji_rotate_job *job = data;
+    const int shift = FUJI_POS_BITS - FUJI_WEIGHT_BITS;
+    const int one = 1 << FUJI_WEIGHT_BITS;
+    const int mask = one - 1;
+    const int height = job->height, width = job->width;
+    const double step = job->step;
+    int i, row, col, top, left, r, c, ur, uc;
+    unsigned fr, fc, w00, w01, w10, w11;
+    ushort(*pix)[4], *out;
+
+    top = tile / job->tilesWide * FUJI_TILE;
+    left = tile % job->tilesWide * FUJI_TILE;
+    for (row = top; row < MIN(top + FUJI_TILE, job->high); row++) {
+        /* Positions are exact at the tile edge, and move by the
+           rounded step for at most FUJI_TILE pixels. */
+        r = (job->fuji_width + (row - left) * step) * (1 << FUJI_POS_BITS);
+        c = (row + left) * step * (1 << FUJI_POS_BITS);
+        for (col = left; col < MIN(left + FUJI_TILE, job->wide);
+                col++, r -= job->stepFix, c += job->stepFix) {
+            out = job->img[row * job->wide + col];
+            ur = r >> FUJI_POS_BITS;
+            uc = c >> FUJI_POS_BITS;
+            if (r < 0 || ur > height - 2 || uc > width - 2) {
+                memset(out, 0, sizeof * job->img);
+                continue;
+            }
+            fr = (r >> shift) & mask;
+            fc = (c >> shift) & mask;
+            w00 = (one - fr) * (one - fc);
+            w01 = (one - fr) * fc;
+            w10 = fr * (one - fc);
+            w11 = fr * fc;
+            pix = job->image + ur * width + uc;
+            for (i = 0; i < 4; i++)
+                out[i] = (pix[0][i] * w00 + pix[1][i] * w01 +
+                          pix[width][i] * w10 + pix[width + 1][i] * w11 +
+                          (1 << (2 * FUJI_WEIGHT_BITS - 1))) >>
+                         (2 * FUJI_WEIGHT_BITS);
+            for (i = job->colors; i < 4; i++)
+                out[i] = 0;
+        }
+    }
+}
+
 void CLASS fuji_rotate_INDI(ushort(**image_p)[4], int *height_p,
                             int *width_p, int *fuji_width_p, const int colors,
                             const double step, void *dcraw)
 {
     int height = *height_p, width = *width_p, fuji_width = *fuji_width_p; /*UF*/
     ushort(*image)[4] = *image_p;  /*UF*/
-    int i, row, col;
-    float r, c, fr, fc;
-    int ur, uc;
-    ushort wide, high, (*img)[4], (*pix)[4];
+    fuji_rotate_job job;
+    ushort wide, high, (*img)[4];
 
     if (!fuji_width) return;
     dcraw_message(dcraw, DCRAW_VERBOSE, _("Rotating image 45 degrees...\n"));
     fuji_width = (fuji_width - 1/* + shrink*/)/* >> shrink*/;
     wide = fuji_width / step;
     high = (height - fuji_width) / step;
-    img = (ushort(*)[4]) calloc(wide * high, sizeof * img);
-    merror(img, "fuji_rotate()");
-
-#ifdef _OPENMP
-    #pragma omp parallel for default(shared) private(row,col,ur,uc,r,c,fr,fc,pix,i)
-#endif
-    for (row = 0; row < high; row++) {
-        for (col = 0; col < wide; col++) {
-            ur = r = fuji_width + (row - col) * step;
-            uc = c = (row + col) * step;
-            if (ur > height - 2 || uc > width - 2) continue;
-            fr = r - ur;
-            fc = c - uc;
-            pix = image + ur * width + uc;
-            for (i = 0; i < colors; i++)
-                img[row * wide + col][i] =
-                    (pix[    0][i] * (1 - fc) + pix[      1][i] * fc) * (1 - fr) +
-                    (pix[width][i] * (1 - fc) + pix[width + 1][i] * fc) * fr;
-        }
-    }
-    free(image);
+    img = (ushort(*)[4]) g_malloc((size_t)wide * high * sizeof * img);
+    job.image = image;
+    job.img = img;
+    job.height = height;
+    job.width = width;
+    job.fuji_width = fuji_width;
+    job.colors = colors;
+    job.wide = wide;
+    job.high = high;
+    job.step = step;
+    job.stepFix = step * (1 << FUJI_POS_BITS) + 0.5;
+    job.tilesWide = (wide + FUJI_TILE - 1) / FUJI_TILE;
+    parallel_for(fuji_rotate_task,
+                 job.tilesWide * ((high + FUJI_TILE - 1) / FUJI_TILE), &job);
+    g_free(image);
     width  = wide;
     height = high;
     image  = img;
@@ -1124,48 +1302,103 @@ void CLASS fuji_rotate_INDI(ushort(**image_p)[4], int *height_p,
     *image_p = image;
 }
 
-void CLASS flip_image_INDI(ushort(*image)[4], int *height_p, int *width_p,
+/* Copy count pixels of depth bytes to consecutive dst pixels, taking
+ * them step bytes apart in src. The fixed sizes let the compiler turn
+ * each memcpy() into plain register moves. */
+#define FLIP_COPY(size) \
+    for (i = 0; i < count; i++, dst += size, src += step) \
+        memcpy(dst, src, size)
+
+static inline void flip_copy_pixels(guint8 *dst, const guint8 *src,
+                                    int count, ptrdiff_t step, int depth)
+{
+    int i;
+    switch (depth) {
+        case 8:
+            FLIP_COPY(8);
+            break;
+        case 6:
+            FLIP_COPY(6);
+            break;
+        case 4:
+            FLIP_COPY(4);
+            break;
+        case 3:
+            FLIP_COPY(3);
+            break;
+        default:
+            FLIP_COPY(depth);
+    }
+}
+
+/* Output tiles of FLIP_TILE x FLIP_TILE pixels keep both the source and
+ * the destination rows of a transpose in the cache. */
+#define FLIP_TILE 64
+
+typedef struct {
+    guint8 *dst;
+    const guint8 *origin;
+    int outHeight, outWidth, depth;
+    ptrdiff_t rowStep, colStep;
+} flip_buffer_job;
+
+static void flip_buffer_task(int tile, void *data)
+{
+    const flip_buffer_job *job = data;
+    int row, col;
+    int rowEnd = MIN((tile + 1) * FLIP_TILE, job->outHeight);
+    for (col = 0; col < job->outWidth; col += FLIP_TILE) {
+        int count = MIN(FLIP_TILE, job->outWidth - col);
+        for (row = tile * FLIP_TILE; row < rowEnd; row++)
+            flip_copy_pixels(job->dst +
+                             ((ptrdiff_t)row * job->outWidth + col) * job->depth,
+                             job->origin + row * job->rowStep + col * job->colStep,
+                             count, job->colStep, job->depth);
+    }
+}
+
+/* Write the height x width image src, of depth bytes pixels, flipped into
+ * dst, which must not overlap src. flip & 1 mirrors the columns, flip & 2
+ * the rows and flip & 4 transposes the image, like dcraw's flip_image().
+ * The output is width x height pixels if flip & 4 is set. */
+void CLASS flip_buffer_INDI(void *dst, const void *src, int height,
+                            int width, int depth, int flip)
+{
+    flip_buffer_job job;
+    ptrdiff_t rowSize = (ptrdiff_t)width * depth;
+    job.dst = dst;
+    job.outHeight = flip & 4 ? width : height;
+    job.outWidth = flip & 4 ? height : width;
+    job.depth = depth;
+    /* Source step between two output rows and two output columns */
+    job.rowStep = flip & 4 ? depth : rowSize;
+    job.colStep = flip & 4 ? rowSize : depth;
+    if (flip & 4 ? flip & 1 : flip & 2) job.rowStep = -job.rowStep;
+    if (flip & 4 ? flip & 2 : flip & 1) job.colStep = -job.colStep;
+    /* Source of the top left output pixel */
+    job.origin = (const guint8 *)src +
+                 (flip & 2 ? (height - 1) * rowSize : 0) +
+                 (flip & 1 ? (ptrdiff_t)(width - 1) * depth : 0);
+    parallel_for(flip_buffer_task,
+                 (job.outHeight + FLIP_TILE - 1) / FLIP_TILE, &job);
+}
+
+void CLASS flip_image_INDI(ushort(**image_p)[4], int *height_p, int *width_p,
                            /*const*/ int flip) /*UF*/
 {
-    unsigned *flag;
-    int size, base, dest, next, row, col;
-    gint64 *img, hold;
     int height = *height_p, width = *width_p;/* INDI - UF*/
+    ushort(*img)[4];
 
 //  Message is suppressed because error handling is not enabled here.
 //  dcraw_message (dcraw, DCRAW_VERBOSE,_("Flipping image %c:%c:%c...\n"),
 //      flip & 1 ? 'H':'0', flip & 2 ? 'V':'0', flip & 4 ? 'T':'0'); /*UF*/
 
-    img = (gint64 *) image;
-    size = height * width;
-    flag = calloc((size + 31) >> 5, sizeof * flag);
-    merror(flag, "flip_image()");
-    for (base = 0; base < size; base++) {
-        if (flag[base >> 5] & (1 << (base & 31)))
-            continue;
-        dest = base;
-        hold = img[base];
-        while (1) {
-            if (flip & 4) {
-                row = dest % height;
-                col = dest / height;
-            } else {
-                row = dest / width;
-                col = dest % width;
-            }
-            if (flip & 2)
-                row = height - 1 - row;
-            if (flip & 1)
-                col = width - 1 - col;
-            next = row * width + col;
-            if (next == base) break;
-            flag[next >> 5] |= 1 << (next & 31);
-            img[dest] = img[next];
-            dest = next;
-        }
-        img[dest] = hold;
-    }
-    free(flag);
+    /* Flipping out of place walks the memory in order,
+     * following the permutation cycles in place does not. */
+    img = (ushort(*)[4]) g_malloc((gsize)height * width * sizeof * img);
+    flip_buffer_INDI(img, *image_p, height, width, sizeof * img, flip);
+    g_free(*image_p);
+    *image_p = img;
     if (flip & 4) SWAP(height, width);
     *height_p = height; /* INDI - UF*/
     *width_p = width;
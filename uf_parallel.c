@@ -0,0 +1,176 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * uf_parallel.c - built-in task scheduler
+ * Copyright 2004-2016 by Udi Fuchs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "uf_glib.h"
+#include "uf_parallel.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if !GLIB_CHECK_VERSION(2,30,0)
+#define g_atomic_int_add g_atomic_int_exchange_and_add
+#endif
+
+static ufraw_executor Executor = NULL;
+static int MaxThreads = 0;
+static GThreadPool *Pool = NULL;
+
+typedef struct {
+    ufraw_task task;
+    void *data;
+    int count;
+    volatile gint next;
+    volatile gint done;
+    volatile gint refs;
+#if GLIB_CHECK_VERSION(2,32,0)
+    GMutex mutex;
+    GCond cond;
+#else
+    GMutex *mutex;
+    GCond *cond;
+#endif
+} parallel_job;
+
+#if GLIB_CHECK_VERSION(2,32,0)
+#define JOB_MUTEX(job) (&(job)->mutex)
+#define JOB_COND(job) (&(job)->cond)
+#else
+#define JOB_MUTEX(job) ((job)->mutex)
+#define JOB_COND(job) ((job)->cond)
+#endif
+
+static void parallel_job_unref(parallel_job *job)
+{
+    if (!g_atomic_int_dec_and_test(&job->refs))
+        return;
+#if GLIB_CHECK_VERSION(2,32,0)
+    g_mutex_clear(&job->mutex);
+    g_cond_clear(&job->cond);
+#else
+    g_mutex_free(job->mutex);
+    g_cond_free(job->cond);
+#endif
+    g_free(job);
+}
+
+/* Take indexes until none are left. The OpenMP kernels inside the tasks
+ * run single threaded, the pool already keeps all processors busy. */
+static void parallel_job_run(parallel_job *job)
+{
+    int i;
+#ifdef _OPENMP
+    int threads = omp_get_max_threads();
+    omp_set_num_threads(1);
+#endif
+    while ((i = g_atomic_int_add(&job->next, 1)) < job->count) {
+        job->task(i, job->data);
+        if (g_atomic_int_add(&job->done, 1) + 1 == job->count) {
+            g_mutex_lock(JOB_MUTEX(job));
+            g_cond_broadcast(JOB_COND(job));
+            g_mutex_unlock(JOB_MUTEX(job));
+        }
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+}
+
+static void parallel_worker(gpointer job, gpointer user_data)
+{
+    (void)user_data;
+    parallel_job_run(job);
+    parallel_job_unref(job);
+}
+
+static gpointer parallel_pool_new(gpointer data)
+{
+    (void)data;
+    Pool = g_thread_pool_new(parallel_worker, NULL,
+                             MAX(parallel_get_max_threads() - 1, 1), FALSE, NULL);
+    return Pool;
+}
+
+void parallel_for(ufraw_task task, int count, void *data)
+{
+    static GOnce once = G_ONCE_INIT;
+    int i;
+
+    if (count <= 0)
+        return;
+    if (Executor != NULL) {
+        Executor(task, count, data);
+        return;
+    }
+    int helpers = MIN(count, parallel_get_max_threads()) - 1;
+    if (helpers < 1) {
+        for (i = 0; i < count; i++)
+            task(i, data);
+        return;
+    }
+    GThreadPool *pool = g_once(&once, parallel_pool_new, NULL);
+    parallel_job *job = g_new0(parallel_job, 1);
+    job->task = task;
+    job->data = data;
+    job->count = count;
+#if GLIB_CHECK_VERSION(2,32,0)
+    g_mutex_init(&job->mutex);
+    g_cond_init(&job->cond);
+#else
+    job->mutex = g_mutex_new();
+    job->cond = g_cond_new();
+#endif
+    job->refs = helpers + 1;
+    for (i = 0; i < helpers; i++)
+        g_thread_pool_push(pool, job, NULL);
+
+    parallel_job_run(job);
+    // Wait for the indexes taken by the helpers
+    g_mutex_lock(JOB_MUTEX(job));
+    while (g_atomic_int_get(&job->done) < count)
+        g_cond_wait(JOB_COND(job), JOB_MUTEX(job));
+    g_mutex_unlock(JOB_MUTEX(job));
+    parallel_job_unref(job);
+}
+
+void parallel_set_executor(ufraw_executor executor)
+{
+    Executor = executor;
+}
+
+void parallel_set_max_threads(int threads)
+{
+    MaxThreads = MAX(threads, 0);
+    if (Pool != NULL)
+        g_thread_pool_set_max_threads(Pool,
+                                      MAX(parallel_get_max_threads() - 1, 1), NULL);
+#ifdef _OPENMP
+    omp_set_num_threads(parallel_get_max_threads());
+#endif
+}
+
+int parallel_get_max_threads(void)
+{
+    if (MaxThreads > 0)
+        return MaxThreads;
+#if GLIB_CHECK_VERSION(2,36,0)
+    return g_get_num_processors();
+#elif defined(_OPENMP)
+    return omp_get_num_procs();
+#else
+    return 1;
+#endif
+}
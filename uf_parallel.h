@@ -0,0 +1,50 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * uf_parallel.h - task scheduler header
+ * Copyright 2004-2016 by Udi Fuchs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _UF_PARALLEL_H
+#define _UF_PARALLEL_H
+
+typedef void (*ufraw_task)(int index, void *data);
+typedef void (*ufraw_executor)(ufraw_task task, int count, void *data);
+
+/*
+ * Coarse grained parallel work (preview tiles, file strips) is handed to
+ * parallel_for(), which calls task(index, data) once for every index in
+ * [0, count) and returns when all calls returned. The calls may run in
+ * any order on any thread, the calling thread included.
+ *
+ * By default the work is shared by a built-in thread pool: the threads
+ * take the next index as soon as they finish the previous one. Nested
+ * calls are safe, since the calling thread keeps taking indexes itself
+ * until none are left.
+ */
+
+void parallel_for(ufraw_task task, int count, void *data);
+
+/*
+ * A host application with its own thread pool can run the work of
+ * parallel_for() instead of the built-in pool. The executor must follow
+ * the same contract as parallel_for(), nested calls included. NULL
+ * restores the built-in pool. This should be set before the first
+ * conversion.
+ */
+void parallel_set_executor(ufraw_executor executor);
+
+/*
+ * Limit the number of threads of the built-in pool and of the OpenMP
+ * kernels started by the calling thread. Zero, the default, means one
+ * thread per processor. This should be set before the first conversion.
+ */
+void parallel_set_max_threads(int threads);
+int parallel_get_max_threads(void);
+
+#endif /* _UF_PARALLEL_H */
@@ -38,4 +38,17 @@ static inline void progress(int what, int ticks)
         ufraw_progress(what, ticks);
 }
 
+extern int (*ufraw_cancelled)(void);
+
+/*
+ * Long running loops poll cancelled() where they report progress. Once it
+ * returns non-zero the result of the current conversion will be thrown
+ * away, so the remaining work may be skipped as long as no memory is
+ * corrupted. This function is thread safe.
+ */
+static inline int cancelled(void)
+{
+    return ufraw_cancelled && ufraw_cancelled();
+}
+
 #endif /* _UF_PROGRESS_H */
@@ -14,12 +14,14 @@
 #include <stdlib.h>    /* for exit */
 #include <errno.h>     /* for errno */
 #include <string.h>
+#include <math.h>
 #include <glib/gi18n.h>
 
 static gboolean silentMessenger;
+static gboolean printStats;
 char *ufraw_binary;
 
-int ufraw_batch_saver(ufraw_data *uf);
+static void ufraw_batch_stats(ufraw_data *uf);
 
 int main(int argc, char **argv)
 {
@@ -55,6 +57,20 @@ int main(int argc, char **argv)
     if (optInd < 0) exit(1);
     if (optInd == 0) exit(0);
     silentMessenger = cmd.silent;
+    printStats = cmd.stats;
+
+    if (strlen(cmd.serveSocket) > 0) {
+        if (optInd < argc) {
+            ufraw_message(UFRAW_ERROR,
+                          _("Input files can not be given with --serve"));
+            exit(1);
+        }
+        /* Every job parses these options again, followed by its own */
+        status = ufraw_serve(cmd.serveSocket, &rc, optInd - 1, argv + 1);
+        ufobject_delete(cmd.ufobject);
+        ufobject_delete(rc.ufobject);
+        exit(status == UFRAW_SUCCESS ? 0 : 1);
+    }
 
     conf_file_load(&conf, cmd.inputFilename);
 
@@ -63,6 +79,8 @@ int main(int argc, char **argv)
     }
     int fileCount = argc - optInd;
     int fileIndex = 1;
+    /* Image buffers are recycled from one file to the next */
+    ufraw_buffer_pool *pool = ufraw_buffer_pool_new();
     for (; optInd < argc; optInd++, fileIndex++) {
         argFile = uf_win32_locale_to_utf8(argv[optInd]);
         uf = ufraw_open(argFile);
@@ -72,6 +90,7 @@ int main(int argc, char **argv)
             ufraw_message(UFRAW_REPORT, NULL);
             continue;
         }
+        uf->pool = pool;
         status = ufraw_config(uf, &rc, &conf, &cmd);
         if (uf->conf && uf->conf->createID == only_id && cmd.createID == -1)
             uf->conf->createID = no_id;
@@ -108,6 +127,7 @@ int main(int argc, char **argv)
         g_free(uf);
     }
 //    ufraw_close(cmd.darkframe);
+    ufraw_buffer_pool_destroy(pool);
     ufobject_delete(cmd.ufobject);
     ufobject_delete(rc.ufobject);
     exit(exitCode);
@@ -155,10 +175,47 @@ int ufraw_batch_saver(ufraw_data *uf)
         int status = ufraw_write_image(uf);
         if (status != UFRAW_SUCCESS)
             ufraw_message(status, ufraw_get_message(uf));
+        else if (printStats && uf->conf->createID != only_id)
+            ufraw_batch_stats(uf);
         return status;
     }
 }
 
+/* Print the histogram statistics of the image that was just written. */
+static void ufraw_batch_stats(ufraw_data *uf)
+{
+    static const char *channelName[3] = { N_("red"), N_("green"), N_("blue") };
+    ufraw_histogram his;
+    int x, c;
+
+    ufraw_final_histogram(uf, &his);
+    GString *text = g_string_new("");
+    g_string_append_printf(text, "%s:\n", uf->conf->outputFilename);
+    for (c = 0; c < 3; c++) {
+        double count = 0, sum = 0, sqr = 0;
+        for (x = 0; x < 256; x++) {
+            count += his.count[x][c];
+            sum += (double)x * his.count[x][c];
+            sqr += (double)x * x * his.count[x][c];
+        }
+        if (count == 0) count = 1;
+        double mean = sum / count;
+        g_string_append_printf(text,
+                               _("  %-6s average %6.2f  deviation %6.2f  "
+                                 "overexposed %5.2f%%  underexposed %5.2f%%\n"),
+                               _(channelName[c]), mean,
+                               sqrt(MAX(sqr / count - mean * mean, 0)),
+                               100.0 * his.count[255][c] / count,
+                               100.0 * his.count[0][c] / count);
+    }
+    // Keep the image stream clean when writing to stdout
+    if (!strcmp(uf->conf->outputFilename, "-"))
+        g_printerr("%s", text->str);
+    else
+        g_print("%s", text->str);
+    g_string_free(text, TRUE);
+}
+
 void ufraw_messenger(char *message, void *parentWindow)
 {
     parentWindow = parentWindow;
@@ -25,6 +25,7 @@
 #include <libgimp/gimpui.h>
 #include <glib/gi18n.h>
 #include <string.h>
+#include <stdlib.h>
 
 void query();
 void run(const gchar *name,
@@ -135,6 +136,11 @@ void run(const gchar *name,
 #endif
     ufraw_binary = g_path_get_basename(gimp_get_progname());
     uf_init_locale(gimp_get_progname());
+    /* Use as many threads as GIMP is allowed to use */
+    char *processors = gimp_gimprc_query("num-processors");
+    if (processors != NULL)
+        parallel_set_max_threads(atoi(processors));
+    g_free(processors);
 #if HAVE_GIMP_2_9
     gegl_init(NULL, NULL);
 #endif
@@ -78,6 +78,16 @@ int main(int argc, char **argv)
                       _("The --embedded-image option is only valid with 'ufraw-batch'"));
         optInd = -1;
     }
+    if (cmd.stats) {
+        ufraw_message(UFRAW_ERROR,
+                      _("The --stats option is only valid with 'ufraw-batch'"));
+        optInd = -1;
+    }
+    if (strlen(cmd.serveSocket) > 0) {
+        ufraw_message(UFRAW_ERROR,
+                      _("The --serve option is only valid with 'ufraw-batch'"));
+        optInd = -1;
+    }
     if (optInd < 0) {
 #ifndef _WIN32
         gdk_threads_leave();
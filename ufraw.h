@@ -23,6 +23,7 @@
 
 #include "nikon_curve.h"
 #include "uf_progress.h"
+#include "uf_parallel.h"
 
 #ifndef HAVE_STRCASECMP
 #define strcasecmp stricmp
@@ -119,6 +120,9 @@ enum { ahd_interpolation, vng_interpolation, four_color_interpolation,
        num_interpolations
      };
 enum { no_id, also_id, only_id, send_id };
+enum { adaptive_png_filter, no_png_filter, sub_png_filter, up_png_filter,
+       average_png_filter, paeth_png_filter
+     };
 enum { manual_curve, linear_curve, custom_curve, camera_curve };
 enum { in_profile, out_profile, display_profile, profile_types};
 enum { raw_expander, live_expander, expander_count };
@@ -174,9 +178,9 @@ typedef struct {
     void *profile[profile_types];
     Intent intent[profile_types];
     gboolean updateTransform;
-    void *colorTransform;
+    void *colorTransform, *colorTransformRef;
     void *working2displayTransform;
-    void *rgbtolabTransform;
+    void *rgbtolabTransform, *rgbtolabTransformRef;
     double saturation;
 #ifdef UFRAW_CONTRAST
     double contrast;
@@ -282,9 +286,11 @@ typedef struct {
     char inputFilename[max_path], outputFilename[max_path],
          outputPath[max_path];
     char inputURI[max_path], inputModTime[max_name];
-    int type, compression, createID, embedExif, progressiveJPEG;
+    int type, compression, createID, embedExif, progressiveJPEG, pngFilter;
+    int tiffRowsPerStrip;
     int shrink, size;
-    gboolean overwrite, losslessCompress, embeddedImage, noExit;
+    gboolean overwrite, losslessCompress, parallelSave, bigTIFF, embeddedImage,
+             noExit;
     gboolean rotate;
 
     /* GUI settings */
@@ -300,7 +306,9 @@ typedef struct {
     int drawLines;
     char curvePath[max_path];
     char profilePath[max_path];
-    gboolean silent;
+    gboolean silent, stats;
+    char serveSocket[max_path];
+    char hotpixelMap[max_path];
     char remoteGimpCommand[max_path];
 
     /* EXIF data */
@@ -316,19 +324,44 @@ typedef struct {
     char real_make[max_name], real_model[max_name];
 } conf_data;
 
+/* The tiled phases are rendered in square subareas of UFRAW_SUBAREA_SIZE
+ * pixels. Small images use smaller subareas so that there is enough
+ * parallel work, huge images use larger ones so that the count never
+ * exceeds UFRAW_MAX_SUBAREAS. */
+#define UFRAW_SUBAREA_SIZE 256
+#define UFRAW_MIN_SUBAREA_SIZE 32
+#define UFRAW_MAX_SUBAREAS 4096
+
 typedef struct {
     guint8 *buffer;
     int height, width, depth, rowstride;
-    /* This bit field marks valid pieces of the image with 1's.
-       The variable contains a fixed 4x8 matrix of bits, every bit containing
-       the validity of the respective subarea of the whole image. The subarea
-       sizes are determined by dividing the width by 4 and height by 8.
-       This field must always contain at least 32 bits. */
-    guint32 valid;
+    /* This bitmap marks valid pieces of the image with 1's, one bit for
+       every subarea, see ufraw_image_get_subarea_rectangle(). Only the
+       bits below ufraw_image_get_subarea_count() are meaningful, the others
+       are left as ufraw_image_set_valid() last set them. */
+    guint32 valid[UFRAW_MAX_SUBAREAS / 32];
     gboolean rgbg;
     gboolean invalidate_event;
+    /* Hash of the parameters the buffer was computed from, or 0 if the
+       buffer content is not known. Only kept for the untiled phases. */
+    guint64 key;
 } ufraw_image_data;
 
+/* Histogram of an 8 bit RGB image. Besides the RGB channels it counts the
+ * luminosity, value and saturation of each pixel. */
+enum { ufraw_his_luminosity = 3, ufraw_his_value, ufraw_his_saturation,
+       ufraw_his_channels
+     };
+typedef struct {
+    guint32 count[256][ufraw_his_channels];
+} ufraw_histogram;
+
+/* Number of binned raw images kept for the preview, at 1/2, 1/4 and 1/8 */
+#define UFRAW_PROXY_LEVELS 3
+
+/* Recycles image buffers between ufraw_data instances, see ufraw_routines.c */
+typedef struct _ufraw_buffer_pool ufraw_buffer_pool;
+
 typedef struct ufraw_struct {
     int status;
     char *message;
@@ -368,11 +401,26 @@ typedef struct ufraw_struct {
     gboolean mark_hotpixels;
     unsigned raw_multiplier;
     gboolean wb_presets_make_model_match;
+    ufraw_buffer_pool *pool; /* Not owned, may be NULL */
+    /* Binned copies of the raw image used by the preview when it is
+     * shrunk enough, and the binning factor of the raw phase image. */
+    void *rawProxy[UFRAW_PROXY_LEVELS];
+    int proxyLevel;
+    /* Incremented whenever a phase is invalidated. Conversions that
+     * overlap an increment do not mark their results as valid. */
+    volatile gint generation;
+    /* Recently computed untiled phase images, see ufraw_stage_key() */
+    struct _ufraw_stage_cache *stageCache;
+    /* Histograms of the develop phase subareas, which are computed
+     * together with the subareas, see ufraw_develop_histogram(). */
+    ufraw_histogram *tileHistogram;
+    guint32 tileHistogramValid[UFRAW_MAX_SUBAREAS / 32];
 } ufraw_data;
 
 extern const conf_data conf_default;
 extern const wb_data wb_preset[];
 extern const int wb_preset_count;
+int wb_preset_find(const char *make, const char *model, int *first);
 extern const char raw_ext[];
 extern const char *file_type[];
 
@@ -417,9 +465,21 @@ void ufraw_get_image_dimensions(ufraw_data *uf);
 /* Get scaled crop coordinates in final image coordinates */
 void ufraw_get_scaled_crop(ufraw_data *uf, UFRectangle *crop);
 
+int ufraw_image_get_subarea_size(ufraw_image_data *img);
+int ufraw_image_get_subarea_count(ufraw_image_data *img);
 UFRectangle ufraw_image_get_subarea_rectangle(ufraw_image_data *img,
         unsigned saidx);
 unsigned ufraw_img_get_subarea_idx(ufraw_image_data *img, int x, int y);
+gboolean ufraw_image_subarea_is_valid(ufraw_image_data *img, unsigned saidx);
+void ufraw_image_set_valid(ufraw_image_data *img, gboolean valid);
+
+void ufraw_histogram_add(ufraw_histogram *his, const guint8 *buffer,
+                         int rowstride, int depth, int width, int height);
+void ufraw_histogram_merge(ufraw_histogram *dst, const ufraw_histogram *src);
+/* Histogram of the cropped develop phase, which must be up to date */
+void ufraw_develop_histogram(ufraw_data *uf, ufraw_histogram *his);
+/* Histogram of the output image after ufraw_convert_image() */
+void ufraw_final_histogram(ufraw_data *uf, ufraw_histogram *his);
 
 /* prototypes for functions in ufraw_message.c */
 char *ufraw_get_message(ufraw_data *uf);
@@ -433,8 +493,14 @@ int ufraw_get_status(ufraw_data *uf);
 int ufraw_is_error(ufraw_data *uf);
 // Old error handling, should be removed after being fully implemented.
 char *ufraw_message(int code, const char *format, ...);
+void ufraw_message_private_buffers(gboolean private);
 void ufraw_batch_messenger(char *message);
 
+/* prototypes for functions in ufraw-batch.c and ufraw_serve.c */
+int ufraw_batch_saver(ufraw_data *uf);
+int ufraw_serve(const char *socketPath, conf_data *rc,
+                int optc, char **optv);
+
 /* prototypes for functions in ufraw_preview.c */
 int ufraw_preview(ufraw_data *uf, conf_data *rc, int plugin,
                   long(*save_func)());
@@ -461,6 +527,13 @@ char *curve_buffer(CurveData *cp);
 int ptr_array_insert_sorted(GPtrArray *array, const void *item, GCompareFunc compare);
 int ptr_array_find_sorted(const GPtrArray *array, const void *item, GCompareFunc compare);
 void ptr_array_insert_index(GPtrArray *array, const void *item, int index);
+/* Pool of image buffers. A NULL pool falls back to g_malloc()/g_free().
+ * Released buffers must have been allocated with g_malloc() and hold
+ * at least 'size' bytes. */
+ufraw_buffer_pool *ufraw_buffer_pool_new(void);
+void ufraw_buffer_pool_destroy(ufraw_buffer_pool *pool);
+void *ufraw_buffer_pool_alloc(ufraw_buffer_pool *pool, gsize size);
+void ufraw_buffer_pool_release(ufraw_buffer_pool *pool, void *buffer, gsize size);
 
 /* prototypes for functions in ufraw_conf.c */
 int conf_load(conf_data *c, const char *confFilename);
@@ -493,6 +566,8 @@ void developer_prepare(developer_data *d, conf_data *conf,
                        int rgbMax, float rgb_cam[3][4], int colors, int useMatrix,
                        DeveloperMode mode);
 void develop(void *po, guint16 pix[4], developer_data *d, int mode, int count);
+void develop48(void *po, guint16 pix[3], developer_data *d, int mode,
+               int count);
 void develop_display(void *pout, void *pin, developer_data *d, int count);
 void develop_linear(guint16 in[4], guint16 out[3], developer_data *d);
 
@@ -547,9 +622,9 @@ int ufraw_exif_write(ufraw_data *uf);
 #define UFRAW_SET_ERROR 200
 #define UFRAW_SET_WARNING 201
 #define UFRAW_SET_LOG 202
-#define UFRAW_GET_ERROR 203 /* Return the warning buffer if an error occured */
-#define UFRAW_GET_WARNING 204 /* Return the warning buffer */
-#define UFRAW_GET_LOG 205 /* Return the log buffer */
+#define UFRAW_GET_ERROR 203 /* Copy the warning buffer if an error occured */
+#define UFRAW_GET_WARNING 204 /* Copy the warning buffer */
+#define UFRAW_GET_LOG 205 /* Copy the log buffer */
 #define UFRAW_BATCH_MESSAGE 206
 #define UFRAW_INTERACTIVE_MESSAGE 207
 #define UFRAW_REPORT 208 /* Report previous messages */
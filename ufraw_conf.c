@@ -111,9 +111,13 @@ const conf_data conf_default = {
     ppm_type, 85, no_id, /* type, compression, createID */
     TRUE, /* embedExif */
     FALSE, /* progressiveJPEG */
+    adaptive_png_filter, /* pngFilter */
+    0, /* tiffRowsPerStrip, 0 for automatic */
     1, 0, /* shrink, size */
     FALSE, /* overwrite existing files without asking */
     FALSE, /* losslessCompress */
+    FALSE, /* parallelSave */
+    FALSE, /* bigTIFF */
     FALSE, /* load embedded preview image */
     FALSE, /* noExit */
     TRUE, /* rotate to camera's setting */
@@ -133,6 +137,9 @@ const conf_data conf_default = {
     0, /* number of helper lines to draw */
     "", "", /* curvePath, profilePath */
     FALSE, /* silent */
+    FALSE, /* stats */
+    "", /* serveSocket */
+    "", /* hotpixelMap */
 #ifdef _WIN32
     "gimp-win-remote gimp-2.8.exe", /* remoteGimpCommand */
 #elif HAVE_GIMP_2_4
@@ -759,10 +766,15 @@ static void conf_parse_text(GMarkupParseContext *context, const gchar *text,
     if (!strcmp("CreateID", element)) sscanf(temp, "%d", &c->createID);
     if (!strcmp("EmbedExif", element)) sscanf(temp, "%d", &c->embedExif);
     if (!strcmp("ProgressiveJPEG", element)) sscanf(temp, "%d", &c->progressiveJPEG);
+    if (!strcmp("PNGFilter", element)) sscanf(temp, "%d", &c->pngFilter);
     if (!strcmp("Compression", element)) sscanf(temp, "%d", &c->compression);
     if (!strcmp("Overwrite", element)) sscanf(temp, "%d", &c->overwrite);
     if (!strcmp("LosslessCompression", element))
         sscanf(temp, "%d", &c->losslessCompress);
+    if (!strcmp("ParallelSave", element)) sscanf(temp, "%d", &c->parallelSave);
+    if (!strcmp("TIFFRowsPerStrip", element))
+        sscanf(temp, "%d", &c->tiffRowsPerStrip);
+    if (!strcmp("BigTIFF", element)) sscanf(temp, "%d", &c->bigTIFF);
     if (!strcmp("NoExit", element)) sscanf(temp, "%d", &c->noExit);
 }
 
@@ -1107,6 +1119,8 @@ int conf_save(conf_data *c, char *IDFilename, char **confBuffer)
         buf = uf_markup_buf(buf, "<EmbedExif>%d</EmbedExif>\n", c->embedExif);
     if (c->progressiveJPEG != conf_default.progressiveJPEG)
         buf = uf_markup_buf(buf, "<ProgressiveJPEG>%d</ProgressiveJPEG>\n", c->progressiveJPEG);
+    if (c->pngFilter != conf_default.pngFilter)
+        buf = uf_markup_buf(buf, "<PNGFilter>%d</PNGFilter>\n", c->pngFilter);
     if (c->compression != conf_default.compression)
         buf = uf_markup_buf(buf,
                             "<Compression>%d</Compression>\n", c->compression);
@@ -1116,6 +1130,14 @@ int conf_save(conf_data *c, char *IDFilename, char **confBuffer)
         buf = uf_markup_buf(buf,
                             "<LosslessCompression>%d</LosslessCompression>\n",
                             c->losslessCompress);
+    if (c->parallelSave != conf_default.parallelSave)
+        buf = uf_markup_buf(buf, "<ParallelSave>%d</ParallelSave>\n",
+                            c->parallelSave);
+    if (c->tiffRowsPerStrip != conf_default.tiffRowsPerStrip)
+        buf = uf_markup_buf(buf, "<TIFFRowsPerStrip>%d</TIFFRowsPerStrip>\n",
+                            c->tiffRowsPerStrip);
+    if (c->bigTIFF != conf_default.bigTIFF)
+        buf = uf_markup_buf(buf, "<BigTIFF>%d</BigTIFF>\n", c->bigTIFF);
     if (c->noExit != conf_default.noExit)
         buf = uf_markup_buf(buf, "<NoExit>%d</NoExit>\n", c->noExit);
     for (i = 0; i < c->BaseCurveCount; i++) {
@@ -1279,6 +1301,7 @@ int conf_save(conf_data *c, char *IDFilename, char **confBuffer)
             char *utf8 = g_filename_display_name(log);
             buf = uf_markup_buf(buf, "<Log>\n%s</Log>\n", utf8);
             g_free(utf8);
+            g_free(log);
         }
         /* As long as darkframe is not in the GUI we save it only to ID files.*/
     }
@@ -1479,7 +1502,11 @@ void conf_copy_save(conf_data *dst, const conf_data *src)
     dst->overwrite = src->overwrite;
     dst->RememberOutputPath = src->RememberOutputPath;
     dst->progressiveJPEG = src->progressiveJPEG;
+    dst->pngFilter = src->pngFilter;
     dst->losslessCompress = src->losslessCompress;
+    dst->parallelSave = src->parallelSave;
+    dst->tiffRowsPerStrip = src->tiffRowsPerStrip;
+    dst->bigTIFF = src->bigTIFF;
     dst->embeddedImage = src->embeddedImage;
     dst->noExit = src->noExit;
 }
@@ -1497,6 +1524,10 @@ int conf_set_cmd(conf_data *conf, const conf_data *cmd)
         conf->clipHighlights = cmd->clipHighlights;
     if (cmd->losslessCompress != -1)
         conf->losslessCompress = cmd->losslessCompress;
+    if (cmd->parallelSave != -1) conf->parallelSave = cmd->parallelSave;
+    if (cmd->tiffRowsPerStrip != -1)
+        conf->tiffRowsPerStrip = cmd->tiffRowsPerStrip;
+    if (cmd->bigTIFF != -1) conf->bigTIFF = cmd->bigTIFF;
     if (cmd->embedExif != -1) conf->embedExif = cmd->embedExif;
     if (cmd->embeddedImage != -1) conf->embeddedImage = cmd->embeddedImage;
     if (cmd->noExit != -1) conf->noExit = cmd->noExit;
@@ -1516,12 +1547,15 @@ int conf_set_cmd(conf_data *conf, const conf_data *cmd)
     if (cmd->CropY2 != -1) conf->CropY2 = cmd->CropY2;
     if (cmd->aspectRatio != 0.0) conf->aspectRatio = cmd->aspectRatio;
     if (cmd->silent != -1) conf->silent = cmd->silent;
+    if (cmd->stats != -1) conf->stats = cmd->stats;
     if (cmd->compression != NULLF) conf->compression = cmd->compression;
     if (cmd->autoExposure) {
         conf->autoExposure = cmd->autoExposure;
     }
     if (cmd->threshold != NULLF) conf->threshold = cmd->threshold;
     if (cmd->hotpixel != NULLF) conf->hotpixel = cmd->hotpixel;
+    if (strlen(cmd->hotpixelMap) > 0)
+        g_strlcpy(conf->hotpixelMap, cmd->hotpixelMap, max_path);
 #ifdef UFRAW_CONTRAST
     if (cmd->contrast != NULLF) conf->contrast = cmd->contrast;
 #endif
@@ -1580,6 +1614,7 @@ int conf_set_cmd(conf_data *conf, const conf_data *cmd)
     }
     if (cmd->type >= 0) conf->type = cmd->type;
     if (cmd->createID >= 0) conf->createID = cmd->createID;
+    if (cmd->pngFilter >= 0) conf->pngFilter = cmd->pngFilter;
     if (strlen(cmd->darkframeFile) > 0)
         g_strlcpy(conf->darkframeFile, cmd->darkframeFile, max_path);
     if (cmd->darkframe != NULL)
@@ -1657,6 +1692,8 @@ char *helpText[] = {
     "                      Wavelet denoising threshold (default 0.0).\n"),
     N_("--hotpixel-sensitivity=VALUE\n"
     "                      Sensitivity for detecting and shaving hot pixels (default 0.0).\n"),
+    N_("--hotpixel-map=FILE   Keep the hot pixels found in FILE and shave the same\n"
+    "                      pixels in later images of the camera (default none).\n"),
     N_("--exposure=auto|EXPOSURE\n"
     "                      Auto exposure or exposure correction in EV (default 0).\n"),
     N_("--black-point=auto|BLACK\n"
@@ -1679,8 +1716,16 @@ char *helpText[] = {
     N_("--create-id=no|also|only\n"
     "                      Create no|also|only ID file (default no).\n"),
     N_("--compression=VALUE   JPEG compression (0-100, default 85).\n"),
+    N_("--png-filter=adaptive|none|sub|up|average|paeth\n"
+    "                      PNG row filter to use (default adaptive).\n"),
     N_("--[no]exif            Embed EXIF in output (default embed EXIF).\n"),
     N_("--[no]zip             Enable [disable] TIFF zip compression (default nozip).\n"),
+    N_("--[no]parallel-save   Enable [disable] multi-threaded encoding of the output\n"
+    "                      file (default noparallel-save).\n"),
+    N_("--tiff-rows-per-strip=ROWS\n"
+    "                      Number of rows in each TIFF strip (default 0, let\n"
+    "                      UFRaw choose).\n"),
+    N_("--[no]bigtiff         Enable [disable] writing BigTIFF files (default nobigtiff).\n"),
     N_("--embedded-image      Extract the preview image embedded in the raw file\n"
     "                      instead of converting the raw image. This option\n"
     "                      is only valid with 'ufraw-batch'.\n"),
@@ -1703,6 +1748,11 @@ char *helpText[] = {
     N_("--maximize-window     Force window to be maximized.\n"),
     N_("--silent              Do not display any messages during conversion. This\n"
     "                      option is only valid with 'ufraw-batch'.\n"),
+    N_("--stats               Print the histogram statistics of each output image.\n"
+    "                      This option is only valid with 'ufraw-batch'.\n"),
+    N_("--serve=SOCKET        Keep running and convert the jobs sent to the local\n"
+    "                      socket SOCKET. This option is only valid with\n"
+    "                      'ufraw-batch'.\n"),
     "\n",
     N_("UFRaw first reads the setting from the resource file $HOME/.ufrawrc.\n"
     "Then, if an ID file is specified, its setting are read. Next, the setting from\n"
@@ -1798,7 +1848,8 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
            *createIDName = NULL, *outPath = NULL, *output = NULL, *conf = NULL,
             *interpolationName = NULL, *darkframeFile = NULL,
              *restoreName = NULL, *clipName = NULL, *grayscaleName = NULL,
-              *grayscaleMixer = NULL;
+              *grayscaleMixer = NULL, *pngFilterName = NULL,
+               *serveSocket = NULL, *hotpixelMap = NULL;
     static const struct option options[] = {
         { "wb", 1, 0, 'w'},
         { "temperature", 1, 0, 't'},
@@ -1841,9 +1892,17 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
         { "crop-right", 1, 0, '3'},
         { "crop-bottom", 1, 0, '4'},
         { "aspect-ratio", 1, 0, 'P'},
+        { "png-filter", 1, 0, 'Q'},
+        { "tiff-rows-per-strip", 1, 0, 'U'},
+        { "serve", 1, 0, '5'},
+        { "hotpixel-map", 1, 0, '6'},
         /* Binary flags that don't have a value are here at the end */
         { "zip", 0, 0, 'z'},
         { "nozip", 0, 0, 'Z'},
+        { "parallel-save", 0, 0, 'J'},
+        { "noparallel-save", 0, 0, 'K'},
+        { "bigtiff", 0, 0, 'V'},
+        { "nobigtiff", 0, 0, 'N'},
         { "overwrite", 0, 0, 'O'},
         { "color-smoothing", 0, 0, 'M' },
         { "maximize-window", 0, 0, 'W'},
@@ -1851,6 +1910,7 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
         { "noexif", 0, 0, 'F'},
         { "embedded-image", 0, 0, 'm'},
         { "silent", 0, 0, 'q'},
+        { "stats", 0, 0, 'l'},
         { "help", 0, 0, 'h'},
         { "version", 0, 0, 'v'},
         { "batch", 0, 0, 'b'},
@@ -1880,11 +1940,15 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
         &createIDName, &outPath, &output, &darkframeFile,
         &restoreName, &clipName, &conf,
         &cmd->CropX1, &cmd->CropY1, &cmd->CropX2, &cmd->CropY2,
-        &cmd->aspectRatio
+        &cmd->aspectRatio, &pngFilterName, &cmd->tiffRowsPerStrip,
+        &serveSocket, &hotpixelMap
     };
     cmd->autoExposure = disabled_state;
     cmd->autoBlack = disabled_state;
     cmd->losslessCompress = -1;
+    cmd->parallelSave = -1;
+    cmd->tiffRowsPerStrip = -1;
+    cmd->bigTIFF = -1;
     cmd->overwrite = -1;
     cmd->noExit = -1;
     cmd->WindowMaximized = -1;
@@ -1892,6 +1956,9 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
     cmd->profile[1][0].BitDepth = -1;
     cmd->embeddedImage = FALSE;
     cmd->silent = FALSE;
+    cmd->stats = FALSE;
+    g_strlcpy(cmd->serveSocket, "", max_path);
+    g_strlcpy(cmd->hotpixelMap, "", max_path);
     cmd->profile[0][0].gamma = NULLF;
     cmd->profile[0][0].linear = NULLF;
     cmd->hotpixel = NULLF;
@@ -1972,6 +2039,7 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
             case '2':
             case '3':
             case '4':
+            case 'U':
                 locale = uf_set_locale_C();
                 if (sscanf(optarg, "%d", (int *)optPointer[index]) == 0) {
                     ufraw_message(UFRAW_ERROR,
@@ -1998,6 +2066,9 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
             case 'u':
             case 'Y':
             case 'a':
+            case 'Q':
+            case '5':
+            case '6':
                 *(char **)optPointer[index] = optarg;
                 break;
             case 'O':
@@ -2015,6 +2086,9 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
             case 'q':
                 cmd->silent = TRUE;
                 break;
+            case 'l':
+                cmd->stats = TRUE;
+                break;
             case 'z':
 #ifdef HAVE_LIBZ
                 cmd->losslessCompress = TRUE;
@@ -2027,18 +2101,32 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
             case 'Z':
                 cmd->losslessCompress = FALSE;
                 break;
+            case 'J':
+                cmd->parallelSave = TRUE;
+                break;
+            case 'K':
+                cmd->parallelSave = FALSE;
+                break;
+            case 'V':
+                cmd->bigTIFF = TRUE;
+                break;
+            case 'N':
+                cmd->bigTIFF = FALSE;
+                break;
             case 'E':
                 cmd->embedExif = TRUE;
                 break;
             case 'F':
                 cmd->embedExif = FALSE;
                 break;
-            case 'h':
+            case 'h': {
                 for (i = 0; strcmp(helpText[i], "END") != 0; i++)
                     ufraw_message(UFRAW_SET_WARNING, _(helpText[i]));
-                ufraw_message(UFRAW_WARNING,
-                              ufraw_message(UFRAW_GET_WARNING, NULL));
+                char *help = ufraw_message(UFRAW_GET_WARNING, NULL);
+                ufraw_message(UFRAW_WARNING, help);
+                g_free(help);
                 return 0;
+            }
             case 'v':
                 base = g_path_get_basename(*argv[0]);
                 ufraw_message(UFRAW_WARNING, versionText, base);
@@ -2417,6 +2505,27 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
             return -1;
         }
     }
+    cmd->pngFilter = -1;
+    if (pngFilterName != NULL) {
+        if (!strcmp(pngFilterName, "adaptive"))
+            cmd->pngFilter = adaptive_png_filter;
+        else if (!strcmp(pngFilterName, "none"))
+            cmd->pngFilter = no_png_filter;
+        else if (!strcmp(pngFilterName, "sub"))
+            cmd->pngFilter = sub_png_filter;
+        else if (!strcmp(pngFilterName, "up"))
+            cmd->pngFilter = up_png_filter;
+        else if (!strcmp(pngFilterName, "average"))
+            cmd->pngFilter = average_png_filter;
+        else if (!strcmp(pngFilterName, "paeth"))
+            cmd->pngFilter = paeth_png_filter;
+        else {
+            ufraw_message(UFRAW_ERROR,
+                          _("'%s' is not a valid png-filter option."),
+                          pngFilterName);
+            return -1;
+        }
+    }
     g_strlcpy(cmd->outputPath, "", max_path);
     if (outPath != NULL) {
         outPath = uf_win32_locale_to_utf8(outPath);
@@ -2440,6 +2549,15 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
         g_strlcpy(cmd->outputFilename, output, max_path);
         uf_win32_locale_free(output);
     }
+    if (serveSocket != NULL)
+        g_strlcpy(cmd->serveSocket, serveSocket, max_path);
+    if (hotpixelMap != NULL) {
+        hotpixelMap = uf_win32_locale_to_utf8(hotpixelMap);
+        char *map = uf_file_set_absolute(hotpixelMap);
+        uf_win32_locale_free(hotpixelMap);
+        g_strlcpy(cmd->hotpixelMap, map, max_path);
+        g_free(map);
+    }
     g_strlcpy(cmd->darkframeFile, "", max_path);
     cmd->darkframe = NULL;
     if (darkframeFile != NULL) {
@@ -30,6 +30,120 @@ static void lcms_message(cmsContext ContextID,
     ufraw_message(UFRAW_ERROR, "%s", ErrorText);
 }
 
+/*
+ * Color transforms shared by all the developers. A transform depends only
+ * on the profile files, intent and abstract profile settings in its key,
+ * so a batch of images with the same settings builds it once, and threads
+ * use it concurrently. Up to MAX_IDLE_TRANSFORMS unused transforms are
+ * kept for the next image. Transforms that use an embedded display profile
+ * are not shared, their key is NULL.
+ */
+#define MAX_IDLE_TRANSFORMS 4
+
+typedef struct _shared_transform {
+    GString *key;
+    cmsHTRANSFORM transform;
+    int refs;
+    unsigned lastUse;
+} shared_transform;
+
+static GHashTable *SharedTransforms = NULL;
+static unsigned SharedTransformsClock = 0;
+G_LOCK_DEFINE_STATIC(shared_transforms);
+
+static void shared_transform_free(shared_transform *t)
+{
+    if (t->transform != NULL)
+        cmsDeleteTransform(t->transform);
+    if (t->key != NULL)
+        g_string_free(t->key, TRUE);
+    g_free(t);
+}
+
+static shared_transform *shared_transform_lookup(GString *key)
+{
+    shared_transform *t;
+
+    if (key == NULL)
+        return NULL;
+    G_LOCK(shared_transforms);
+    if (SharedTransforms == NULL)
+        SharedTransforms = g_hash_table_new((GHashFunc)g_string_hash,
+                                            (GEqualFunc)g_string_equal);
+    t = g_hash_table_lookup(SharedTransforms, key);
+    if (t != NULL)
+        t->refs++;
+    G_UNLOCK(shared_transforms);
+    return t;
+}
+
+/* Take ownership of key and transform. If another thread was quicker
+ * to build the same transform, use its copy. */
+static shared_transform *shared_transform_insert(GString *key,
+        cmsHTRANSFORM transform)
+{
+    shared_transform *t = g_new(shared_transform, 1), *old;
+
+    t->key = key;
+    t->transform = transform;
+    t->refs = 1;
+    t->lastUse = 0;
+    if (key == NULL)
+        return t;
+    G_LOCK(shared_transforms);
+    old = g_hash_table_lookup(SharedTransforms, key);
+    if (old == NULL)
+        g_hash_table_insert(SharedTransforms, key, t);
+    else
+        old->refs++;
+    G_UNLOCK(shared_transforms);
+    if (old == NULL)
+        return t;
+    shared_transform_free(t);
+    return old;
+}
+
+typedef struct {
+    shared_transform *oldest;
+    int count;
+} shared_transform_idle;
+
+static void shared_transform_find_idle(gpointer key, gpointer value,
+                                       gpointer user_data)
+{
+    shared_transform *t = value;
+    shared_transform_idle *idle = user_data;
+
+    (void)key;
+    if (t->refs > 0)
+        return;
+    idle->count++;
+    if (idle->oldest == NULL || t->lastUse < idle->oldest->lastUse)
+        idle->oldest = t;
+}
+
+static void shared_transform_release(void *ref)
+{
+    shared_transform *t = ref;
+    shared_transform_idle idle = { NULL, 0 };
+
+    if (t == NULL)
+        return;
+    if (t->key == NULL) {
+        shared_transform_free(t);
+        return;
+    }
+    G_LOCK(shared_transforms);
+    t->refs--;
+    t->lastUse = ++SharedTransformsClock;
+    g_hash_table_foreach(SharedTransforms, shared_transform_find_idle, &idle);
+    if (idle.count > MAX_IDLE_TRANSFORMS) {
+        g_hash_table_remove(SharedTransforms, idle.oldest->key);
+        shared_transform_free(idle.oldest);
+    }
+    G_UNLOCK(shared_transforms);
+}
+
 developer_data *developer_init()
 {
     int i;
@@ -59,8 +173,10 @@ developer_data *developer_init()
     d->intent[display_profile] = -1;
     d->updateTransform = TRUE;
     d->colorTransform = NULL;
+    d->colorTransformRef = NULL;
     d->working2displayTransform = NULL;
     d->rgbtolabTransform = NULL;
+    d->rgbtolabTransformRef = NULL;
     d->grayscaleMode = -1;
     d->grayscaleMixer[0] = d->grayscaleMixer[1] = d->grayscaleMixer[2] = -1;
     for (i = 0; i < max_adjustments; i++) { /* Suppress valgrind error. */
@@ -83,12 +199,10 @@ void developer_destroy(developer_data *d)
     cmsFreeToneCurve(d->TransferFunction[1]);
     cmsCloseProfile(d->saturationProfile);
     cmsCloseProfile(d->adjustmentProfile);
-    if (d->colorTransform != NULL)
-        cmsDeleteTransform(d->colorTransform);
+    shared_transform_release(d->colorTransformRef);
     if (d->working2displayTransform != NULL)
         cmsDeleteTransform(d->working2displayTransform);
-    if (d->rgbtolabTransform != NULL)
-        cmsDeleteTransform(d->rgbtolabTransform);
+    shared_transform_release(d->rgbtolabTransformRef);
     g_free(d);
 }
 
@@ -394,6 +508,16 @@ static double findExpCoeff(double b)
     return a;
 }
 
+static gboolean test_adjustments(const lightness_adjustment values[max_adjustments],
+                                 gdouble reference, gdouble threshold)
+{
+    int i;
+    for (i = 0; i < max_adjustments; ++i)
+        if (fabs(values[i].adjustment - reference) >= threshold)
+            return TRUE;
+    return FALSE;
+}
+
 static void developer_create_transform(developer_data *d, DeveloperMode mode)
 {
     if (!d->updateTransform)
@@ -418,29 +542,83 @@ static void developer_create_transform(developer_data *d, DeveloperMode mode)
     } else {
         targetProfile = out_profile;
     }
-    if (d->colorTransform != NULL)
-        cmsDeleteTransform(d->colorTransform);
+    /* For auto-tools the adjustments and saturation are ignored.
+     * Their profiles are only built if the transform is not shared yet. */
+    gboolean adjust = mode != auto_developer &&
+                      test_adjustments(d->lightnessAdjustment, 1.0, 0.01);
+    gboolean saturate = mode != auto_developer && (d->saturation != 1.0
+#ifdef UFRAW_CONTRAST
+                        || d->contrast != 1.0
+#endif
+                                                  );
+    shared_transform *t = NULL;
     if (strcmp(d->profileFile[in_profile], "") == 0 &&
             strcmp(d->profileFile[targetProfile], "") == 0 &&
-            d->luminosityProfile == NULL &&
-            d->adjustmentProfile == NULL &&
-            d->saturationProfile == NULL) {
+            d->luminosityProfile == NULL && !adjust && !saturate) {
         /* No transformation at all. */
-        d->colorTransform = NULL;
     } else {
-        cmsHPROFILE prof[5];
-        int i = 0;
-        prof[i++] = d->profile[in_profile];
-        if (d->luminosityProfile != NULL)
-            prof[i++] = d->luminosityProfile;
-        if (d->adjustmentProfile != NULL)
-            prof[i++] = d->adjustmentProfile;
-        if (d->saturationProfile != NULL)
-            prof[i++] = d->saturationProfile;
-        prof[i++] = d->profile[targetProfile];
-        d->colorTransform = cmsCreateMultiprofileTransform(prof, i,
-                            TYPE_RGB_16, TYPE_RGB_16, d->intent[out_profile], 0);
+        GString *key = NULL;
+        if (strcmp(d->profileFile[in_profile], embedded_display_profile) != 0 &&
+                strcmp(d->profileFile[targetProfile],
+                       embedded_display_profile) != 0) {
+            key = g_string_new("color");
+            g_string_append_len(key, d->profileFile[in_profile],
+                                strlen(d->profileFile[in_profile]) + 1);
+            g_string_append_len(key, d->profileFile[targetProfile],
+                                strlen(d->profileFile[targetProfile]) + 1);
+            g_string_append_len(key, (char *)&d->intent[out_profile],
+                                sizeof(Intent));
+            if (d->luminosityProfile != NULL) {
+                g_string_append_c(key, 'L');
+                g_string_append_len(key, (char *)&d->luminosityCurveData,
+                                    sizeof(CurveData));
+            }
+            if (adjust) {
+                g_string_append_c(key, 'A');
+                g_string_append_len(key, (char *)d->lightnessAdjustment,
+                                    sizeof d->lightnessAdjustment);
+            }
+            if (saturate) {
+                g_string_append_c(key, 'S');
+                g_string_append_len(key, (char *)&d->saturation,
+                                    sizeof(double));
+#ifdef UFRAW_CONTRAST
+                g_string_append_len(key, (char *)&d->contrast, sizeof(double));
+#endif
+            }
+        }
+        t = shared_transform_lookup(key);
+        if (t != NULL) {
+            g_string_free(key, TRUE);
+        } else {
+            if (adjust && d->adjustmentProfile == NULL)
+                d->adjustmentProfile = create_adjustment_profile(d);
+            if (saturate && d->saturationProfile == NULL)
+                d->saturationProfile = create_contrast_saturation_profile(
+#ifdef UFRAW_CONTRAST
+                                           d->contrast,
+#else
+                                           1.0,
+#endif
+                                           d->saturation);
+            cmsHPROFILE prof[5];
+            int i = 0;
+            prof[i++] = d->profile[in_profile];
+            if (d->luminosityProfile != NULL)
+                prof[i++] = d->luminosityProfile;
+            if (adjust && d->adjustmentProfile != NULL)
+                prof[i++] = d->adjustmentProfile;
+            if (saturate && d->saturationProfile != NULL)
+                prof[i++] = d->saturationProfile;
+            prof[i++] = d->profile[targetProfile];
+            t = shared_transform_insert(key, cmsCreateMultiprofileTransform(
+                                            prof, i, TYPE_RGB_16, TYPE_RGB_16,
+                                            d->intent[out_profile], 0));
+        }
     }
+    shared_transform_release(d->colorTransformRef);
+    d->colorTransformRef = t;
+    d->colorTransform = t != NULL ? t->transform : NULL;
 
     if (d->working2displayTransform != NULL)
         cmsDeleteTransform(d->working2displayTransform);
@@ -457,23 +635,194 @@ static void developer_create_transform(developer_data *d, DeveloperMode mode)
         d->working2displayTransform = NULL;
     }
 
-    if (d->rgbtolabTransform == NULL) {
+    GString *key = g_string_new("lab");
+    g_string_append_len(key, d->profileFile[in_profile],
+                        strlen(d->profileFile[in_profile]) + 1);
+    t = shared_transform_lookup(key);
+    if (t != NULL) {
+        g_string_free(key, TRUE);
+    } else {
         cmsHPROFILE labProfile = cmsCreateLab2Profile(cmsD50_xyY());
-        d->rgbtolabTransform = cmsCreateTransform(d->profile[in_profile],
-                               TYPE_RGB_16, labProfile,
-                               TYPE_Lab_16, INTENT_ABSOLUTE_COLORIMETRIC, 0);
+        t = shared_transform_insert(key, cmsCreateTransform(
+                                        d->profile[in_profile], TYPE_RGB_16,
+                                        labProfile, TYPE_Lab_16,
+                                        INTENT_ABSOLUTE_COLORIMETRIC, 0));
         cmsCloseProfile(labProfile);
     }
+    shared_transform_release(d->rgbtolabTransformRef);
+    d->rgbtolabTransformRef = t;
+    d->rgbtolabTransform = t->transform;
 }
 
-static gboolean test_adjustments(const lightness_adjustment values[max_adjustments],
-                                 gdouble reference, gdouble threshold)
+/*
+ * A small LRU cache of 0x10000 entry curve tables, shared by all the
+ * developers. Going back and forth with a slider, or developing a batch
+ * of images with the same settings, finds the tables already computed.
+ * The tables are copied in and out under the lock, so an entry can be
+ * replaced while its old contents are still in use.
+ */
+#define CURVE_CACHE_SIZE 8
+
+typedef struct {
+    void *key;
+    gsize keySize;
+    guint16 *table;
+    unsigned lastUse;
+} curve_cache_entry;
+
+static curve_cache_entry BaseCurveCache[CURVE_CACHE_SIZE];
+static curve_cache_entry GammaCurveCache[CURVE_CACHE_SIZE];
+static unsigned CurveCacheClock = 0;
+G_LOCK_DEFINE_STATIC(curve_cache);
+
+static gboolean curve_cache_get(curve_cache_entry *cache, const void *key,
+                                gsize keySize, guint16 table[0x10000])
 {
     int i;
-    for (i = 0; i < max_adjustments; ++i)
-        if (fabs(values[i].adjustment - reference) >= threshold)
-            return TRUE;
-    return FALSE;
+    gboolean found = FALSE;
+
+    G_LOCK(curve_cache);
+    for (i = 0; i < CURVE_CACHE_SIZE && !found; i++) {
+        if (cache[i].table == NULL || cache[i].keySize != keySize ||
+                memcmp(cache[i].key, key, keySize) != 0)
+            continue;
+        memcpy(table, cache[i].table, 0x10000 * sizeof(guint16));
+        cache[i].lastUse = ++CurveCacheClock;
+        found = TRUE;
+    }
+    G_UNLOCK(curve_cache);
+    return found;
+}
+
+static void curve_cache_put(curve_cache_entry *cache, const void *key,
+                            gsize keySize, const guint16 table[0x10000])
+{
+    int i, victim = 0;
+
+    G_LOCK(curve_cache);
+    for (i = 1; i < CURVE_CACHE_SIZE; i++)
+        if (cache[i].lastUse < cache[victim].lastUse)
+            victim = i;
+    if (cache[victim].table == NULL)
+        cache[victim].table = g_new(guint16, 0x10000);
+    g_free(cache[victim].key);
+    cache[victim].key = g_memdup(key, keySize);
+    cache[victim].keySize = keySize;
+    memcpy(cache[victim].table, table, 0x10000 * sizeof(guint16));
+    cache[victim].lastUse = ++CurveCacheClock;
+    G_UNLOCK(curve_cache);
+}
+
+/* The key of a gamma curve. It is compared with memcmp(), so it must be
+ * cleared before it is filled. */
+typedef struct {
+    CurveData baseCurve;
+    double gamma, linear;
+    unsigned exposure;
+    int clipHighlights;
+} gamma_curve_key;
+
+static void developer_base_curve(const CurveData *baseCurve,
+                                 guint16 BaseCurve[0x10000])
+{
+    int i;
+
+    if (curve_cache_get(BaseCurveCache, baseCurve, sizeof(CurveData),
+                        BaseCurve))
+        return;
+    CurveSample *cs = CurveSampleInit(0x10000, 0x10000);
+    ufraw_message(UFRAW_RESET, NULL);
+    if (CurveDataSample((CurveData *)baseCurve, cs) != UFRAW_SUCCESS) {
+        /* Failures are not cached, so that they are reported again */
+        ufraw_message(UFRAW_REPORT, NULL);
+        for (i = 0; i < 0x10000; i++) BaseCurve[i] = i;
+    } else {
+        for (i = 0; i < 0x10000; i++) BaseCurve[i] = cs->m_Samples[i];
+        curve_cache_put(BaseCurveCache, baseCurve, sizeof(CurveData),
+                        BaseCurve);
+    }
+    CurveSampleFree(cs);
+}
+
+/* The gamma curve is computed in bands by parallel_for() */
+#define GAMMA_CURVE_BANDS 16
+
+typedef struct {
+    developer_data *d;
+    const guint16 *BaseCurve;
+    double film; /* Film curve coefficient, zero for digital highlights */
+    double a, b, c, g;
+} gamma_curve_job;
+
+static void gamma_curve_task(int band, void *data)
+{
+    const gamma_curve_job *job = data;
+    developer_data *d = job->d;
+    const double a = job->a, b = job->b, c = job->c, g = job->g;
+    int first = band * (0x10000 / GAMMA_CURVE_BANDS);
+    int i;
+
+    /* pow() dominates, but the curve often maps runs of input values to
+     * the same base curve value, so each band remembers its last one. */
+    unsigned last = 0x10000;
+    guint16 value = 0;
+    for (i = first; i < first + 0x10000 / GAMMA_CURVE_BANDS; i++) {
+        /* Exposure is set by the film curve.
+         * Its initial slope is d->exposure/0x10000 */
+        guint16 film = job->film == 0 ? i :
+                       (1 - exp(-job->film * i / 0x10000)) /
+                       (1 - exp(-job->film)) * 0xFFFF;
+        unsigned v = job->BaseCurve[film];
+        if (v != last) {
+            last = v;
+            if (v < 0x10000 * d->linear)
+                value = MIN(c * v, 0xFFFF);
+            else
+                value = MIN(pow(a * v / 0x10000 + b, g) * 0x10000, 0xFFFF);
+        }
+        d->gammaCurve[i] = value;
+    }
+}
+
+static void developer_gamma_curve(developer_data *d)
+{
+    gamma_curve_key key;
+    gamma_curve_job job;
+
+    memset(&key, 0, sizeof key);
+    memcpy(&key.baseCurve, &d->baseCurveData, sizeof(CurveData));
+    key.gamma = d->gamma;
+    key.linear = d->linear;
+    key.exposure = d->exposure;
+    key.clipHighlights = d->clipHighlights;
+    if (curve_cache_get(GammaCurveCache, &key, sizeof key, d->gammaCurve))
+        return;
+
+    guint16 BaseCurve[0x10000];
+    developer_base_curve(&d->baseCurveData, BaseCurve);
+    job.d = d;
+    job.BaseCurve = BaseCurve;
+    if (d->clipHighlights == film_highlights)
+        job.film = findExpCoeff((double)d->exposure / 0x10000);
+    else
+        job.film = 0;
+    /* The parameters of the linearized gamma curve are set in a way that
+     * keeps the curve continuous and smooth at the connecting point.
+     * d->linear also changes the real gamma used for the curve (g) in
+     * a way that keeps the derivative at i=0x10000 constant.
+     * This way changing the linearity changes the curve behaviour in
+     * the shadows, but has a minimal effect on the rest of the range. */
+    if (d->linear < 1.0) {
+        job.g = d->gamma * (1.0 - d->linear) / (1.0 - d->gamma * d->linear);
+        job.a = 1.0 / (1.0 + d->linear * (job.g - 1));
+        job.b = d->linear * (job.g - 1) * job.a;
+        job.c = pow(job.a * d->linear + job.b, job.g) / d->linear;
+    } else {
+        job.a = job.b = job.g = 0.0;
+        job.c = 1.0;
+    }
+    parallel_for(gamma_curve_task, GAMMA_CURVE_BANDS, &job);
+    curve_cache_put(GammaCurveCache, &key, sizeof key, d->gammaCurve);
 }
 
 void developer_prepare(developer_data *d, conf_data *conf,
@@ -560,52 +909,11 @@ void developer_prepare(developer_data *d, conf_data *conf,
             exposure != d->exposure || clipHighlights != d->clipHighlights ||
             memcmp(baseCurve, &d->baseCurveData, sizeof(CurveData)) != 0) {
         d->baseCurveData = *baseCurve;
-        guint16 BaseCurve[0x10000];
-        CurveSample *cs = CurveSampleInit(0x10000, 0x10000);
-        ufraw_message(UFRAW_RESET, NULL);
-        if (CurveDataSample(baseCurve, cs) != UFRAW_SUCCESS) {
-            ufraw_message(UFRAW_REPORT, NULL);
-            for (i = 0; i < 0x10000; i++) cs->m_Samples[i] = i;
-        }
-        for (i = 0; i < 0x10000; i++) BaseCurve[i] = cs->m_Samples[i];
-        CurveSampleFree(cs);
-
         d->gamma = in->gamma;
         d->linear = in->linear;
         d->exposure = exposure;
         d->clipHighlights = clipHighlights;
-        guint16 FilmCurve[0x10000];
-        if (d->clipHighlights == film_highlights) {
-            /* Exposure is set by FilmCurve[].
-             * Set initial slope to d->exposuse/0x10000 */
-            double a = findExpCoeff((double)d->exposure / 0x10000);
-            for (i = 0; i < 0x10000; i++) FilmCurve[i] =
-                    (1 - exp(-a * i / 0x10000)) / (1 - exp(-a)) * 0xFFFF;
-        } else { /* digital highlights */
-            for (i = 0; i < 0x10000; i++) FilmCurve[i] = i;
-        }
-        double a, b, c, g;
-        /* The parameters of the linearized gamma curve are set in a way that
-         * keeps the curve continuous and smooth at the connecting point.
-         * d->linear also changes the real gamma used for the curve (g) in
-         * a way that keeps the derivative at i=0x10000 constant.
-         * This way changing the linearity changes the curve behaviour in
-         * the shadows, but has a minimal effect on the rest of the range. */
-        if (d->linear < 1.0) {
-            g = d->gamma * (1.0 - d->linear) / (1.0 - d->gamma * d->linear);
-            a = 1.0 / (1.0 + d->linear * (g - 1));
-            b = d->linear * (g - 1) * a;
-            c = pow(a * d->linear + b, g) / d->linear;
-        } else {
-            a = b = g = 0.0;
-            c = 1.0;
-        }
-        for (i = 0; i < 0x10000; i++)
-            if (BaseCurve[FilmCurve[i]] < 0x10000 * d->linear)
-                d->gammaCurve[i] = MIN(c * BaseCurve[FilmCurve[i]], 0xFFFF);
-            else
-                d->gammaCurve[i] = MIN(pow(a * BaseCurve[FilmCurve[i]] / 0x10000 + b,
-                                           g) * 0x10000, 0xFFFF);
+        developer_gamma_curve(d);
     }
     developer_profile(d, in_profile, in);
     developer_profile(d, out_profile, out);
@@ -660,10 +968,9 @@ void developer_prepare(developer_data *d, conf_data *conf,
         d->updateTransform = TRUE;
         memcpy(d->lightnessAdjustment, conf->lightnessAdjustment,
                sizeof d->lightnessAdjustment);
+        /* Built by developer_create_transform() when needed */
         cmsCloseProfile(d->adjustmentProfile);
-        d->adjustmentProfile = test_adjustments(d->lightnessAdjustment, 1.0, 0.01)
-                               ? create_adjustment_profile(d)
-                               : NULL;
+        d->adjustmentProfile = NULL;
     }
 
     if (conf->saturation != d->saturation
@@ -676,21 +983,9 @@ void developer_prepare(developer_data *d, conf_data *conf,
 #endif
         d->saturation = (conf->grayscaleMode == grayscale_luminance)
                         ? 0 : conf->saturation;
+        /* Built by developer_create_transform() when needed */
         cmsCloseProfile(d->saturationProfile);
-        if (d->saturation == 1.0
-#ifdef UFRAW_CONTRAST
-                && d->contrast == 1.0
-#endif
-           )
-            d->saturationProfile = NULL;
-        else
-            d->saturationProfile = create_contrast_saturation_profile(
-#ifdef UFRAW_CONTRAST
-                                       d->contrast,
-#else
-                                       1.0,
-#endif
-                                       d->saturation);
+        d->saturationProfile = NULL;
         d->updateTransform = TRUE;
     }
     developer_create_transform(d, mode);
@@ -851,7 +1146,9 @@ static void MaxMidMin(const gint64 p[3], int *maxc, int *midc, int *minc)
     *minc = min;
 }
 
-void develop(void *po, guint16 pix[4], developer_data *d, int mode, int count)
+/* Develop count pixels which are stride guint16 apart. */
+static void develop_pixels(void *po, guint16 *pix, developer_data *d,
+                           int mode, int count, int stride)
 {
     guint16 c, tmppix[3], *buf;
     int i;
@@ -862,14 +1159,14 @@ void develop(void *po, guint16 pix[4], developer_data *d, int mode, int count)
     #pragma omp parallel				\
     if (count > 16)				\
         default(none)				\
-        shared(d, buf, count, pix)			\
+        shared(d, buf, count, pix, stride)		\
         private(i, tmppix, c)
     {
         int chunk = count / omp_get_num_threads() + 1;
         int offset = chunk * omp_get_thread_num();
         int width = (chunk > count - offset) ? count - offset : chunk;
         for (i = offset; i < offset + width; i++) {
-            develop_linear(pix + i * 4, tmppix, d);
+            develop_linear(pix + i * stride, tmppix, d);
             for (c = 0; c < 3; c++)
                 buf[i * 3 + c] = d->gammaCurve[tmppix[c]];
         }
@@ -879,7 +1176,7 @@ void develop(void *po, guint16 pix[4], developer_data *d, int mode, int count)
     }
 #else
     for (i = 0; i < count; i++) {
-        develop_linear(pix + i * 4, tmppix, d);
+        develop_linear(pix + i * stride, tmppix, d);
         for (c = 0; c < 3; c++)
             buf[i * 3 + c] = d->gammaCurve[tmppix[c]];
     }
@@ -893,6 +1190,19 @@ void develop(void *po, guint16 pix[4], developer_data *d, int mode, int count)
     }
 }
 
+void develop(void *po, guint16 pix[4], developer_data *d, int mode, int count)
+{
+    develop_pixels(po, pix, d, mode, count, 4);
+}
+
+/* Same as develop() for compact 3-channel pixels, which can only hold
+ * images with d->colors <= 3. */
+void develop48(void *po, guint16 pix[3], developer_data *d, int mode,
+               int count)
+{
+    develop_pixels(po, pix, d, mode, count, 3);
+}
+
 void develop_display(void *pout, void *pin, developer_data *d, int count)
 {
     if (d->working2displayTransform == NULL)
@@ -157,13 +157,16 @@ int ufraw_read_embedded(ufraw_data *uf)
             jpeg_finish_decompress(&srcinfo);
             jpeg_destroy_decompress(&srcinfo);
             char *message = ufraw_message(UFRAW_GET_ERROR, NULL);
+            char *warning = ufraw_message(UFRAW_GET_WARNING, NULL);
             if (message != NULL) {
                 ufraw_message(UFRAW_ERROR, _("Error creating file '%s'.\n%s"),
                               uf->conf->outputFilename, message);
                 status = UFRAW_ERROR;
-            } else if (ufraw_message(UFRAW_GET_WARNING, NULL) != NULL) {
+            } else if (warning != NULL) {
                 ufraw_message(UFRAW_REPORT, NULL);
             }
+            g_free(message);
+            g_free(warning);
 #endif /* HAVE_LIBJPEG */
         }
     }
@@ -308,13 +311,16 @@ int ufraw_write_embedded(ufraw_data *uf)
         jpeg_finish_compress(&dstinfo);
         jpeg_destroy_compress(&dstinfo);
         char *message = ufraw_message(UFRAW_GET_ERROR, NULL);
+        char *warning = ufraw_message(UFRAW_GET_WARNING, NULL);
         if (message != NULL) {
             ufraw_message(UFRAW_ERROR, _("Error creating file '%s'.\n%s"),
                           uf->conf->outputFilename, message);
             status = UFRAW_ERROR;
-        } else if (ufraw_message(UFRAW_GET_WARNING, NULL) != NULL) {
+        } else if (warning != NULL) {
             ufraw_message(UFRAW_REPORT, NULL);
         }
+        g_free(message);
+        g_free(warning);
 #endif /*HAVE_LIBJPEG*/
     } else if (uf->conf->type == embedded_png_type) {
 #ifdef HAVE_LIBPNG
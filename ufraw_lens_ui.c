@@ -55,6 +55,7 @@ static void camera_menu_select(GtkMenuItem *menuitem, gpointer user_data)
     preview_data *data = (preview_data *)user_data;
     lfCamera *cam = g_object_get_data(G_OBJECT(menuitem), "lfCamera");
     UFObject *lensfun = ufgroup_element(CFG->ufobject, ufLensfun);
+    render_stop(data);
     ufraw_lensfun_set_camera(lensfun, cam);
     camera_set(data);
 }
@@ -238,9 +239,12 @@ static void lens_set(GtkWidget *lensModel, preview_data *data)
     gtk_widget_show_all(data->LensParamBox);
 }
 
-static void lens_menu_select(GtkMenuItem *menuitem, UFObject *lensfun)
+static void lens_menu_select(GtkMenuItem *menuitem, gpointer user_data)
 {
+    preview_data *data = (preview_data *)user_data;
     lfLens *lens = (lfLens *)g_object_get_data(G_OBJECT(menuitem), "lfLens");
+    UFObject *lensfun = ufgroup_element(CFG->ufobject, ufLensfun);
+    render_stop(data);
     ufraw_lensfun_set_lens(lensfun, lens);
 }
 
@@ -251,7 +255,6 @@ static void lens_menu_fill(preview_data *data, const lfLens *const *lenslist)
         gtk_widget_destroy(data->LensMenu);
         data->LensMenu = NULL;
     }
-    UFObject *lensfun = ufgroup_element(CFG->ufobject, ufLensfun);
 
     /* Count all existing lens makers and create a sorted list */
     GPtrArray *makers = g_ptr_array_new();
@@ -275,7 +278,7 @@ static void lens_menu_fill(preview_data *data, const lfLens *const *lenslist)
         gtk_widget_show(item);
         g_object_set_data(G_OBJECT(item), "lfLens", (void *)lenslist[i]);
         g_signal_connect(G_OBJECT(item), "activate",
-                         G_CALLBACK(lens_menu_select), lensfun);
+                         G_CALLBACK(lens_menu_select), data);
         gtk_menu_shell_append(GTK_MENU_SHELL(submenu), item);
     }
 
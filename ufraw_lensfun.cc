@@ -19,6 +19,8 @@
 #include <string.h>
 #include <assert.h>
 #include <math.h>
+#include <glib/gstdio.h>
+#include <sys/stat.h>
 
 #ifdef HAVE_LENSFUN
 #include <lensfun.h>
@@ -45,6 +47,8 @@ public:
     double FocalLengthValue;
     double ApertureValue;
     double DistanceValue;
+    // The database 'Camera' was found in, NULL for the full LensDB.
+    lfDatabase *CameraDB;
     Lensfun();
 #ifdef UFRAW_VALGRIND // Can be useful for valgrind --leak-check=full
     ~Lensfun() {
@@ -63,13 +67,11 @@ public:
             return static_cast<Lensfun &>(object.Parent());
         return Lensfun::Parent(object.Parent());
     }
-    static lfDatabase *LensDB() {
-        /* Load lens database only once */
-        if (_LensDB == NULL) {
-            _LensDB = lfDatabase::Create();
-            _LensDB->Load();
-        }
-        return _LensDB;
+    static lfDatabase *LensDB();
+    // A database with only the files needed for the given camera.
+    static lfDatabase *LensDB(const char *make, const char *model);
+    lfDatabase *DB() {
+        return CameraDB != NULL ? CameraDB : LensDB();
     }
     void SetCamera(const lfCamera &camera) {
         Camera = camera;
@@ -651,7 +653,7 @@ extern "C" {
     UFName ufLensfun = "Lensfun";
 }
 Lensfun::Lensfun() : UFGroup(ufLensfun), FocalLengthValue(0.0),
-    ApertureValue(0.0), DistanceValue(0.0)
+    ApertureValue(0.0), DistanceValue(0.0), CameraDB(NULL)
 {
     *this
             << new CameraModel
@@ -686,7 +688,7 @@ void Lensfun::SetLensInterpolation()
         cropLens.Type = lfLensType(LensGeometry.Index());
         Interpolation = cropLens;
     } else {
-        const lfLens **lensList = LensDB()->FindLenses(&Camera,
+        const lfLens **lensList = DB()->FindLenses(&Camera,
                                   make, model, LF_SEARCH_LOOSE);
         if (lensList == NULL || lensList[0] == NULL) {
             lfLens emptyLens;
@@ -734,7 +736,428 @@ void Lensfun::Interpolate()
     static_cast<Distortion &>((*this)[ufDistortion]).Interpolate();
 }
 
+/* lfDatabase::Load() parses all the lensfun XML files, although a single
+ * image needs only the few files with its camera and the lenses that fit
+ * it. These files are listed for every camera in an index, which is kept
+ * in the user's cache directory and is valid as long as the XML files keep
+ * their names, sizes and modification times. The index is plain text,
+ * a header listing the files followed by one line per camera:
+ *   C <tab> make <tab> model <tab> file,file,...
+ * It is searched in place in the mapped file. */
+
+#define LENSFUN_INDEX_HEADER "UFRaw lensfun index 2\n"
+
+#if !GLIB_CHECK_VERSION(2,22,0)
+#define g_mapped_file_unref g_mapped_file_free
+#endif
+
+G_LOCK_DEFINE_STATIC(lensfun_db);
+
 lfDatabase *Lensfun::_LensDB = NULL;
+// Camera key -> lfDatabase with the files of that camera
+static GHashTable *CameraDBs = NULL;
+
+static int lensfun_path_compare(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void lensfun_add_dir(GPtrArray *files, const char *dir)
+{
+    GDir *d = g_dir_open(dir, 0, NULL);
+    if (d == NULL)
+        return;
+    guint first = files->len;
+    const char *name;
+    while ((name = g_dir_read_name(d)) != NULL)
+        if (g_str_has_suffix(name, ".xml"))
+            g_ptr_array_add(files, g_build_filename(dir, name, NULL));
+    g_dir_close(d);
+    qsort(files->pdata + first, files->len - first, sizeof(gpointer),
+          lensfun_path_compare);
+}
+
+static gboolean lensfun_dir_has_db(const char *dir)
+{
+    GDir *d = g_dir_open(dir, 0, NULL);
+    gboolean found = FALSE;
+    const char *name;
+    if (d == NULL)
+        return FALSE;
+    while (!found && (name = g_dir_read_name(d)) != NULL)
+        found = g_str_has_suffix(name, ".xml");
+    g_dir_close(d);
+    return found;
+}
+
+// The timestamp lensfun compares the databases by, -1 if there is none.
+static long lensfun_db_timestamp(const char *dir)
+{
+    char *path = g_build_filename(dir, "timestamp.txt", NULL);
+    char *text = NULL;
+    long stamp = -1;
+    if (g_file_get_contents(path, &text, NULL, NULL))
+        stamp = strtol(text, NULL, 10);
+    g_free(text);
+    g_free(path);
+    return stamp;
+}
+
+// The XML files in the order lfDatabase::Load() reads them: the newest of
+// the system database and its updates, by their timestamps, followed by the
+// user's own files. If the choice is not clear the list is left empty, and
+// the search is left to lensfun.
+static GPtrArray *lensfun_db_files()
+{
+    GPtrArray *files = g_ptr_array_new();
+    const char *const *sysDirs = g_get_system_data_dirs();
+    char *system = NULL;
+    gboolean ambiguous = FALSE;
+    int i, j;
+
+    // There must be exactly one system database
+    for (i = 0; sysDirs[i] != NULL; i++) {
+        char *dirs[2] = {
+            g_build_filename(sysDirs[i], "lensfun", "version_1", NULL),
+            g_build_filename(sysDirs[i], "lensfun", NULL)
+        };
+        for (j = 0; j < 2; j++) {
+            if (lensfun_dir_has_db(dirs[j])) {
+                ambiguous |= system != NULL;
+                if (system == NULL) {
+                    system = dirs[j];
+                    dirs[j] = NULL;
+                }
+            }
+            g_free(dirs[j]);
+        }
+    }
+    if (system == NULL || ambiguous) {
+        g_free(system);
+        return files;
+    }
+    // An update is used if it is newer than the system database and the
+    // updates checked before it, the user's updates come last.
+    char *updates[2] = {
+        g_strdup("/var/lib/lensfun-updates/version_1"),
+        g_build_filename(g_get_user_data_dir(), "lensfun", "updates",
+                         "version_1", NULL)
+    };
+    const char *newest = system;
+    long systemStamp = lensfun_db_timestamp(system);
+    long newestStamp = systemStamp;
+    for (i = 0; i < 2; i++) {
+        gboolean found = lensfun_dir_has_db(updates[i]);
+        long stamp = lensfun_db_timestamp(updates[i]);
+        if (!found && stamp < 0)
+            continue;
+        if (!found || stamp < 0 || systemStamp < 0)
+            ambiguous = TRUE;
+        else if (stamp > newestStamp) {
+            newest = updates[i];
+            newestStamp = stamp;
+        }
+    }
+    if (!ambiguous) {
+        lensfun_add_dir(files, newest);
+        char *dir = g_build_filename(g_get_user_data_dir(), "lensfun", NULL);
+        lensfun_add_dir(files, dir);
+        g_free(dir);
+    }
+    g_free(updates[0]);
+    g_free(updates[1]);
+    g_free(system);
+    return files;
+}
+
+static void lensfun_db_files_free(GPtrArray *files)
+{
+    guint i;
+    for (i = 0; i < files->len; i++)
+        g_free(g_ptr_array_index(files, i));
+    g_ptr_array_free(files, TRUE);
+}
+
+// The index header, which must match for the cached index to be valid.
+static GString *lensfun_index_header(GPtrArray *files)
+{
+    GString *header = g_string_new(LENSFUN_INDEX_HEADER);
+    guint i;
+    for (i = 0; i < files->len; i++) {
+        const char *path = (char *)g_ptr_array_index(files, i);
+        struct stat st;
+        if (g_stat(path, &st) != 0)
+            st.st_mtime = st.st_size = 0;
+        g_string_append_printf(header, "F\t%ld\t%ld\t%s\n",
+                               (long)st.st_mtime, (long)st.st_size, path);
+    }
+    return header;
+}
+
+static char *lensfun_index_path()
+{
+    return g_build_filename(g_get_user_cache_dir(), "ufraw", "lensfun-index",
+                            NULL);
+}
+
+static GMappedFile *lensfun_index_map(const GString *header)
+{
+    char *path = lensfun_index_path();
+    GMappedFile *index = g_mapped_file_new(path, FALSE, NULL);
+    g_free(path);
+    if (index == NULL)
+        return NULL;
+    if (g_mapped_file_get_length(index) < header->len ||
+            memcmp(g_mapped_file_get_contents(index), header->str,
+                   header->len) != 0) {
+        g_mapped_file_unref(index);
+        return NULL;
+    }
+    return index;
+}
+
+// Camera names are compared ignoring case and repeated white space.
+static void lensfun_key_append(GString *key, const char *name)
+{
+    gboolean space = FALSE;
+    if (name == NULL)
+        return;
+    for (; *name != '\0'; name++) {
+        if (g_ascii_isspace(*name)) {
+            space = TRUE;
+            continue;
+        }
+        if (space && key->len > 0 && key->str[key->len - 1] != '\t')
+            g_string_append_c(key, ' ');
+        space = FALSE;
+        g_string_append_c(key, g_ascii_tolower(*name));
+    }
+}
+
+static char *lensfun_camera_key(const char *make, const char *model)
+{
+    GString *key = g_string_new("");
+    lensfun_key_append(key, make);
+    g_string_append_c(key, '\t');
+    lensfun_key_append(key, model);
+    return g_string_free(key, FALSE);
+}
+
+// The comma separated file list of the camera, or NULL if not indexed.
+static char *lensfun_index_lookup(GMappedFile *index, const char *key)
+{
+    const char *data = g_mapped_file_get_contents(index);
+    gsize length = g_mapped_file_get_length(index);
+    char *needle = g_strdup_printf("\nC\t%s\t", key);
+    const char *found = g_strstr_len(data, length, needle);
+    char *list = NULL;
+    if (found != NULL) {
+        const char *start = found + strlen(needle);
+        const char *end = (const char *)memchr(start, '\n',
+                                               data + length - start);
+        if (end != NULL)
+            list = g_strndup(start, end - start);
+    }
+    g_free(needle);
+    return list;
+}
+
+template <class T>
+static void lensfun_db_mark(GHashTable *origin, const T *const *list,
+                            guint file)
+{
+    for (; list != NULL && *list != NULL; list++)
+        if (g_hash_table_lookup(origin, *list) == NULL)
+            g_hash_table_insert(origin, (gpointer)*list,
+                                GUINT_TO_POINTER(file + 1));
+}
+
+static char *lensfun_mount_files(GHashTable *mountFiles, const char *mount,
+                                 guint count)
+{
+    char *files = (char *)g_hash_table_lookup(mountFiles, mount);
+    if (files == NULL) {
+        files = g_new0(char, count);
+        g_hash_table_insert(mountFiles, (gpointer)mount, files);
+    }
+    return files;
+}
+
+static void lensfun_files_add(char *files, GHashTable *mountFiles,
+                              const char *mount, guint count)
+{
+    const char *add = (char *)g_hash_table_lookup(mountFiles, mount);
+    guint f;
+    for (f = 0; add != NULL && f < count; f++)
+        files[f] |= add[f];
+}
+
+typedef struct {
+    GString *index;
+    guint count;
+} lensfun_index_data;
+
+static void lensfun_index_append(gpointer key, gpointer value, gpointer data)
+{
+    lensfun_index_data *d = (lensfun_index_data *)data;
+    const char *files = (const char *)value;
+    const char *sep = "";
+    guint f;
+    g_string_append_printf(d->index, "C\t%s\t", (char *)key);
+    for (f = 0; f < d->count; f++)
+        if (files[f]) {
+            g_string_append_printf(d->index, "%s%u", sep, f);
+            sep = ",";
+        }
+    g_string_append_c(d->index, '\n');
+}
+
+// Load the files one by one, to know which file each entry comes from,
+// and append the cameras to the index.
+static lfDatabase *lensfun_db_load(GPtrArray *files, GString *index)
+{
+    lfDatabase *db = lfDatabase::Create();
+    GHashTable *origin = g_hash_table_new(NULL, NULL);
+    guint f, count = files->len;
+    int i;
+
+    for (f = 0; f < count; f++) {
+        db->Load((char *)g_ptr_array_index(files, f));
+        lensfun_db_mark(origin, db->GetCameras(), f);
+        lensfun_db_mark(origin, db->GetLenses(), f);
+        lensfun_db_mark(origin, db->GetMounts(), f);
+    }
+    // Mount name -> the files with its definition or lenses for it
+    GHashTable *mountFiles = g_hash_table_new_full(g_str_hash, g_str_equal,
+                             NULL, g_free);
+    const lfLens *const *lenses = db->GetLenses();
+    for (i = 0; lenses != NULL && lenses[i] != NULL; i++) {
+        f = GPOINTER_TO_UINT(g_hash_table_lookup(origin, lenses[i])) - 1;
+        for (char **m = lenses[i]->Mounts; m != NULL && *m != NULL; m++)
+            lensfun_mount_files(mountFiles, *m, count)[f] = 1;
+    }
+    const lfMount *const *mounts = db->GetMounts();
+    for (i = 0; mounts != NULL && mounts[i] != NULL; i++) {
+        const char *name = lf_mlstr_get(mounts[i]->Name);
+        if (name == NULL)
+            continue;
+        f = GPOINTER_TO_UINT(g_hash_table_lookup(origin, mounts[i])) - 1;
+        lensfun_mount_files(mountFiles, name, count)[f] = 1;
+    }
+    // A camera needs the lenses of its mount and of the compatible mounts
+    GHashTable *cameraFiles = g_hash_table_new_full(g_str_hash, g_str_equal,
+                              g_free, g_free);
+    const lfCamera *const *cameras = db->GetCameras();
+    for (i = 0; cameras != NULL && cameras[i] != NULL; i++) {
+        const lfCamera *cam = cameras[i];
+        // FindCameras() matches the EXIF names against the default
+        // strings, lf_mlstr_get() would give the translated ones.
+        char *key = lensfun_camera_key((const char *)cam->Maker,
+                                       (const char *)cam->Model);
+        char *camFiles = (char *)g_hash_table_lookup(cameraFiles, key);
+        if (camFiles == NULL) {
+            camFiles = g_new0(char, count);
+            g_hash_table_insert(cameraFiles, key, camFiles);
+        } else {
+            g_free(key);
+        }
+        camFiles[GPOINTER_TO_UINT(g_hash_table_lookup(origin, cam)) - 1] = 1;
+        if (cam->Mount == NULL)
+            continue;
+        lensfun_files_add(camFiles, mountFiles, cam->Mount, count);
+        for (int j = 0; mounts != NULL && mounts[j] != NULL; j++) {
+            const char *name = lf_mlstr_get(mounts[j]->Name);
+            if (name == NULL)
+                continue;
+            gboolean own = strcmp(name, cam->Mount) == 0;
+            for (char **c = mounts[j]->Compat; c != NULL && *c != NULL; c++) {
+                if (own)
+                    lensfun_files_add(camFiles, mountFiles, *c, count);
+                else if (strcmp(*c, cam->Mount) == 0)
+                    lensfun_files_add(camFiles, mountFiles, name, count);
+            }
+        }
+    }
+    lensfun_index_data data = { index, count };
+    g_hash_table_foreach(cameraFiles, lensfun_index_append, &data);
+    g_hash_table_destroy(cameraFiles);
+    g_hash_table_destroy(mountFiles);
+    g_hash_table_destroy(origin);
+    return db;
+}
+
+lfDatabase *Lensfun::LensDB()
+{
+    G_LOCK(lensfun_db);
+    /* Load lens database only once */
+    if (_LensDB == NULL) {
+        GPtrArray *files = lensfun_db_files();
+        if (files->len == 0) {
+            _LensDB = lfDatabase::Create();
+            _LensDB->Load();
+        } else {
+            GString *index = lensfun_index_header(files);
+            GMappedFile *cached = lensfun_index_map(index);
+            _LensDB = lensfun_db_load(files, index);
+            // The index is only a cache, failing to write it is harmless
+            if (cached != NULL) {
+                g_mapped_file_unref(cached);
+            } else {
+                char *path = lensfun_index_path();
+                char *dir = g_path_get_dirname(path);
+                if (g_mkdir_with_parents(dir, 0755) == 0)
+                    g_file_set_contents(path, index->str, index->len, NULL);
+                g_free(dir);
+                g_free(path);
+            }
+            g_string_free(index, TRUE);
+        }
+        lensfun_db_files_free(files);
+    }
+    G_UNLOCK(lensfun_db);
+    return _LensDB;
+}
+
+lfDatabase *Lensfun::LensDB(const char *make, const char *model)
+{
+    lfDatabase *db = NULL;
+    G_LOCK(lensfun_db);
+    // Once everything is loaded there is nothing to save
+    if (_LensDB == NULL) {
+        char *key = lensfun_camera_key(make, model);
+        if (CameraDBs == NULL)
+            CameraDBs = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              g_free, NULL);
+        db = (lfDatabase *)g_hash_table_lookup(CameraDBs, key);
+        if (db == NULL) {
+            GPtrArray *files = lensfun_db_files();
+            GString *header = lensfun_index_header(files);
+            GMappedFile *index = files->len > 0 ?
+                                 lensfun_index_map(header) : NULL;
+            char *list = index != NULL ? lensfun_index_lookup(index, key) : NULL;
+            if (list != NULL) {
+                db = lfDatabase::Create();
+                char **ids = g_strsplit(list, ",", -1);
+                for (int i = 0; ids[i] != NULL; i++) {
+                    guint f = strtoul(ids[i], NULL, 10);
+                    if (f < files->len)
+                        db->Load((char *)g_ptr_array_index(files, f));
+                }
+                g_strfreev(ids);
+                g_free(list);
+                g_hash_table_insert(CameraDBs, key, db);
+                key = NULL;
+            }
+            if (index != NULL)
+                g_mapped_file_unref(index);
+            g_string_free(header, TRUE);
+            lensfun_db_files_free(files);
+        }
+        g_free(key);
+    }
+    G_UNLOCK(lensfun_db);
+    return db != NULL ? db : LensDB();
+}
 
 void Lensfun::Init(bool reset)
 {
@@ -745,9 +1168,15 @@ void Lensfun::Init(bool reset)
 
     /* Set lens and camera from EXIF info, if possible */
     if (uf->conf->real_make[0] || uf->conf->real_model[0]) {
-        const lfCamera **cams = LensDB()->FindCameras(
+        lfDatabase *db = LensDB(uf->conf->real_make, uf->conf->real_model);
+        const lfCamera **cams = db->FindCameras(
                                     uf->conf->real_make, uf->conf->real_model);
+        if (cams == NULL && db != _LensDB) {
+            db = LensDB();
+            cams = db->FindCameras(uf->conf->real_make, uf->conf->real_model);
+        }
         if (cams != NULL) {
+            CameraDB = db != _LensDB ? db : NULL;
             SetCamera(*cams[0]);
             lf_free(cams);
         }
@@ -775,7 +1204,7 @@ void Lensfun::Init(bool reset)
     UFString &LensfunAuto = Image[ufLensfunAuto];
     if (LensfunAuto.IsEqual("yes")) {
         if (strlen(uf->conf->lensText) > 0) {
-            const lfLens **lenses = LensDB()->FindLenses(&Camera,
+            const lfLens **lenses = DB()->FindLenses(&Camera,
                                     NULL, uf->conf->lensText, LF_SEARCH_LOOSE);
             if (!CameraModel.IsEqual("") && lenses != NULL) {
                 SetLensModel(*lenses[0]);
@@ -791,7 +1220,7 @@ void Lensfun::Init(bool reset)
             }
         }
         // Try using the "standard" lens of compact cameras.
-        const lfLens **lenses = LensDB()->FindLenses(&Camera,
+        const lfLens **lenses = DB()->FindLenses(&Camera,
                                 NULL, "Standard", LF_SEARCH_LOOSE);
         if (!CameraModel.IsEqual("") && lenses != NULL) {
             SetLensModel(*lenses[0]);
@@ -880,6 +1309,8 @@ extern "C" {
 
     void ufraw_lensfun_set_camera(UFObject *lensfun, const struct lfCamera *camera)
     {
+        // The camera comes from the full database
+        static_cast<UFRaw::Lensfun *>(lensfun)->CameraDB = NULL;
         static_cast<UFRaw::Lensfun *>(lensfun)->SetCamera(*camera);
     }
 
@@ -890,6 +1321,7 @@ extern "C" {
 
     void ufraw_lensfun_set_lens(UFObject *lensfun, const struct lfLens *lens)
     {
+        dynamic_cast<UFRaw::Lensfun &>(*lensfun).CameraDB = NULL;
         dynamic_cast<UFRaw::Lensfun &>(*lensfun).SetLensModel(*lens);
     }
 
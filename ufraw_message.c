@@ -128,15 +128,77 @@ void ufraw_batch_messenger(char *message)
     g_printerr("%s%c", message, message[strlen(message) - 1] != '\n' ? '\n' : 0);
 }
 
+/* The log and warning buffers. Threads share the global buffers, unless
+ * they take their own with ufraw_message_private_buffers(), as the jobs
+ * of 'ufraw-batch --serve' do. The lock guards the global buffers, which
+ * are only handed out as copies. */
+typedef struct {
+    char *logBuffer;
+    char *errorBuffer;
+    gboolean errorFlag;
+} message_buffers;
+
+static message_buffers SharedBuffers;
+G_LOCK_DEFINE_STATIC(message_buffers);
+
+#if GLIB_CHECK_VERSION(2,32,0)
+static void message_buffers_free(gpointer data)
+{
+    message_buffers *buffers = data;
+    g_free(buffers->logBuffer);
+    g_free(buffers->errorBuffer);
+    g_free(buffers);
+}
+
+static GPrivate PrivateBuffers = G_PRIVATE_INIT(message_buffers_free);
+#define private_buffers_get() g_private_get(&PrivateBuffers)
+#define private_buffers_set(b) g_private_set(&PrivateBuffers, b)
+#else
+static gpointer private_buffers_new(gpointer data)
+{
+    (void)data;
+    return g_private_new(NULL);
+}
+
+static GPrivate *private_buffers_key(void)
+{
+    static GOnce once = G_ONCE_INIT;
+    return g_once(&once, private_buffers_new, NULL);
+}
+#define private_buffers_get() g_private_get(private_buffers_key())
+#define private_buffers_set(b) g_private_set(private_buffers_key(), b)
+#endif
+
+static message_buffers *message_buffers_get(void)
+{
+    message_buffers *buffers = private_buffers_get();
+    return buffers != NULL ? buffers : &SharedBuffers;
+}
+
+/* Give the calling thread buffers of its own, or return it to the global
+ * buffers. */
+void ufraw_message_private_buffers(gboolean private)
+{
+    message_buffers *buffers = private_buffers_get();
+    if (private && buffers == NULL) {
+        private_buffers_set(g_new0(message_buffers, 1));
+    } else if (!private && buffers != NULL) {
+        g_free(buffers->logBuffer);
+        g_free(buffers->errorBuffer);
+        g_free(buffers);
+        private_buffers_set(NULL);
+    }
+}
+
+/* The UFRAW_GET_* codes return a copy of the buffer, to be freed with
+ * g_free(). */
 char *ufraw_message(int code, const char *format, ...)
 {
-    // TODO: The following static variables are not thread-safe
-    static char *logBuffer = NULL;
-    static char *errorBuffer = NULL;
-    static gboolean errorFlag = FALSE;
+    // TODO: parentWindow is not thread-safe
     static void *parentWindow = NULL;
     char *message = NULL;
     void *saveParentWindow;
+    message_buffers *buffers;
 
     if (code == UFRAW_SET_PARENT) {
         saveParentWindow = parentWindow;
@@ -151,27 +213,44 @@ char *ufraw_message(int code, const char *format, ...)
     }
     switch (code) {
         case UFRAW_SET_ERROR:
-            errorFlag = TRUE;
         case UFRAW_SET_WARNING:
-            errorBuffer = ufraw_message_buffer(errorBuffer, message);
         case UFRAW_SET_LOG:
         case UFRAW_DCRAW_SET_LOG:
-            logBuffer = ufraw_message_buffer(logBuffer, message);
+            G_LOCK(message_buffers);
+            buffers = message_buffers_get();
+            if (code == UFRAW_SET_ERROR)
+                buffers->errorFlag = TRUE;
+            if (code == UFRAW_SET_ERROR || code == UFRAW_SET_WARNING)
+                buffers->errorBuffer =
+                    ufraw_message_buffer(buffers->errorBuffer, message);
+            buffers->logBuffer = ufraw_message_buffer(buffers->logBuffer,
+                                 message);
+            G_UNLOCK(message_buffers);
             g_free(message);
             return NULL;
         case UFRAW_GET_ERROR:
-            if (!errorFlag) return NULL;
         case UFRAW_GET_WARNING:
-            return errorBuffer;
         case UFRAW_GET_LOG:
-            return logBuffer;
+            G_LOCK(message_buffers);
+            buffers = message_buffers_get();
+            if (code == UFRAW_GET_LOG)
+                message = g_strdup(buffers->logBuffer);
+            else if (code == UFRAW_GET_WARNING || buffers->errorFlag)
+                message = g_strdup(buffers->errorBuffer);
+            G_UNLOCK(message_buffers);
+            return message;
         case UFRAW_CLEAN:
-            g_free(logBuffer);
-            logBuffer = NULL;
         case UFRAW_RESET:
-            g_free(errorBuffer);
-            errorBuffer = NULL;
-            errorFlag = FALSE;
+            G_LOCK(message_buffers);
+            buffers = message_buffers_get();
+            if (code == UFRAW_CLEAN) {
+                g_free(buffers->logBuffer);
+                buffers->logBuffer = NULL;
+            }
+            g_free(buffers->errorBuffer);
+            buffers->errorBuffer = NULL;
+            buffers->errorFlag = FALSE;
+            G_UNLOCK(message_buffers);
             return NULL;
         case UFRAW_BATCH_MESSAGE:
             if (parentWindow == NULL)
@@ -184,7 +263,11 @@ char *ufraw_message(int code, const char *format, ...)
             g_free(message);
             return NULL;
         case UFRAW_REPORT:
-            ufraw_messenger(errorBuffer, parentWindow);
+            G_LOCK(message_buffers);
+            message = g_strdup(message_buffers_get()->errorBuffer);
+            G_UNLOCK(message_buffers);
+            ufraw_messenger(message, parentWindow);
+            g_free(message);
             return NULL;
         default:
             ufraw_messenger(message, parentWindow);
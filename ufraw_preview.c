@@ -28,15 +28,6 @@
 #include <math.h>
 #include <errno.h>
 
-#ifdef _OPENMP
-#include <omp.h>
-#define uf_omp_get_thread_num() omp_get_thread_num()
-#define uf_omp_get_max_threads() omp_get_max_threads()
-#else
-#define uf_omp_get_thread_num() 0
-#define uf_omp_get_max_threads() 1
-#endif
-
 #ifdef _WIN32	/* GDK threads are not supported on the Windows platform. */
 #define gdk_threads_add_timeout g_timeout_add
 #define gdk_threads_add_idle_full g_idle_add_full
@@ -57,6 +48,8 @@ void ufraw_chooser_toggle(GtkToggleButton *button, GtkFileChooser *filechooser);
 static void update_crop_ranges(preview_data *data, gboolean render);
 static void adjustment_update(GtkAdjustment *adj, double *valuep);
 static void button_update(GtkWidget *button, gpointer user_data);
+static ufraw_image_data *preview_get_image(preview_data *data,
+        UFRawPhase phase, gboolean bufferok);
 
 extern GtkFileChooser *ufraw_raw_chooser(conf_data *conf, const char *defPath,
         const gchar *label, GtkWindow *toplevel, const gchar *cancel,
@@ -126,10 +119,42 @@ void ufraw_focus(void *window, gboolean focus)
     }
 }
 
+/* The thread running the GTK+ main loop. Messages of other threads, like
+ * the background rendering, are shown from the main loop. */
+static GThread *MessengerThread = NULL;
+
+typedef struct {
+    char *message;
+    gpointer parentWindow;
+} messenger_call;
+
+static gboolean messenger_idle(messenger_call *call)
+{
+    // The window might have been destroyed meanwhile
+    if (call->parentWindow != NULL)
+        g_object_remove_weak_pointer(G_OBJECT(call->parentWindow),
+                                     &call->parentWindow);
+    ufraw_messenger(call->message, call->parentWindow);
+    g_free(call->message);
+    g_free(call);
+    return FALSE;
+}
+
 void ufraw_messenger(char *message,  void *parentWindow)
 {
     GtkDialog *dialog;
 
+    if (parentWindow != NULL && MessengerThread != NULL &&
+            g_thread_self() != MessengerThread) {
+        messenger_call *call = g_new(messenger_call, 1);
+        call->message = g_strdup(message);
+        call->parentWindow = parentWindow;
+        g_object_add_weak_pointer(G_OBJECT(parentWindow),
+                                  &call->parentWindow);
+        gdk_threads_add_idle_full(G_PRIORITY_DEFAULT_IDLE,
+                                  (GSourceFunc)(messenger_idle), call, NULL);
+        return;
+    }
     if (parentWindow == NULL) {
         ufraw_batch_messenger(message);
     } else {
@@ -531,14 +556,104 @@ static int zoom_to_scale(double zoom)
         return 0;
 }
 
+/* The overlays of the preview are classified per row and per column.
+ * preview_overlay_axis() sets the class of each coordinate along one axis,
+ * and the class of a pixel is looked up from the two. */
+enum {
+    overlay_shade,	/* cropped out */
+    overlay_frame,	/* the white crop frame */
+    overlay_dark,	/* the dark half of an alignment line */
+    overlay_light,	/* the light half of an alignment line */
+    overlay_plain,	/* inside the crop area */
+    overlay_edge,	/* inside the crop area, too close to its edge for lines */
+    overlay_num
+};
+
+/* Pixel values for each overlay class */
+static guint8 OverlayLUT[overlay_num][256];
+
+static void preview_overlay_init(void)
+{
+    int v;
+    if (OverlayLUT[overlay_frame][0] == 255)
+        return; // Already initialized
+    for (v = 0; v < 256; v++) {
+        OverlayLUT[overlay_shade][v] = v / 4;
+        OverlayLUT[overlay_frame][v] = 255;
+        OverlayLUT[overlay_dark][v] = v / 2;
+        OverlayLUT[overlay_light][v] = 255 - (255 - v) / 2;
+        OverlayLUT[overlay_plain][v] = v;
+        OverlayLUT[overlay_edge][v] = v;
+    }
+}
+
+/* Classify the coordinates start <= i < start + size along an axis where
+ * the crop area is cropStart <= i < cropStart + cropSize. */
+static void preview_overlay_axis(guint8 *cls, int start, int size,
+                                 int cropStart, int cropSize, int drawLines)
+{
+    int i;
+    int cropEnd = cropStart + cropSize;
+    for (i = start; i < start + size; i++) {
+        guint8 c;
+        if (i == cropStart - 1 || i == cropEnd)
+            c = overlay_frame;
+        else if (i < cropStart || i > cropEnd)
+            c = overlay_shade;
+        else if (drawLines == 0 || i <= cropStart + 1 || i >= cropEnd - 2)
+            c = overlay_edge;
+        else {
+            int d = (i - cropStart) * drawLines % cropSize / drawLines;
+            c = d == 0 ? overlay_dark : d == 1 ? overlay_light : overlay_plain;
+        }
+        cls[i - start] = c;
+    }
+}
+
+/* Map the column classes to pixel classes for a row of class 'row'. */
+static void preview_overlay_row(guint8 map[overlay_num], guint8 row)
+{
+    int c;
+    for (c = 0; c < overlay_num; c++) {
+        if (row == overlay_shade || c == overlay_shade)
+            map[c] = overlay_shade;
+        else if (row == overlay_frame || c == overlay_frame)
+            map[c] = overlay_frame;
+        else if (row == overlay_edge || c == overlay_edge)
+            map[c] = overlay_plain;
+        else
+            map[c] = MIN(row, c);
+    }
+}
+
+/* Bits of the exposure mask */
+#define EXPOSURE_OVER 1
+#define EXPOSURE_UNDER 2
+
+static void preview_spot_pixel(preview_data *data, guint8 *pixies,
+                               int rowstride, int x, int xx, int yy)
+{
+    guint8 *p = pixies + yy * rowstride + (xx - x) * 3;
+    if (((xx + yy) & 7) >= 4)
+        p[0] = p[1] = p[2] = 0;
+    else
+        p[0] = p[1] = p[2] = 255;
+    // The spot frame does not blink
+    data->ExposureMask[yy * data->ExposureMaskWidth + xx] = 0;
+}
+
 /* Modify the preview image to mark crop and spot areas.
  * Note that all coordinate intervals are semi-inclusive, e.g.
  * X1 <= pixels < X2 and Y1 <= pixels < Y2
  * This approach makes computing width/height just a matter of
  * substracting X1 from X2 or Y1 from Y2.
+ *
+ * The rows are composed in parallel. Over- and underexposed pixels are
+ * recorded in data->ExposureMask, so that with 'blinkOnly' only those
+ * pixels are redrawn when the highlights blink.
  */
-static void preview_draw_area(preview_data *data,
-                              int x, int y, int width, int height)
+static void preview_compose_area(preview_data *data,
+                                 int x, int y, int width, int height, gboolean blinkOnly)
 {
     int pixbufHeight = gdk_pixbuf_get_height(data->PreviewPixbuf);
     if (y < 0 || y >= pixbufHeight)
@@ -565,9 +680,8 @@ static void preview_draw_area(preview_data *data,
 
     UFRectangle Crop;
     ufraw_get_scaled_crop(data->UF, &Crop);
-    int CropX2 = Crop.x + Crop.width;
-    int CropY2 = Crop.y + Crop.height;
-    int drawLines = CFG->drawLines + 1;
+    int drawLines = data->RenderMode == render_default && CFG->drawLines ?
+                    CFG->drawLines + 1 : 0;
 
     /* Scale spot image coordinates to pixbuf coordinates */
     float scale_x = ((float)pixbufWidth) / data->UF->rotatedWidth;
@@ -577,81 +691,122 @@ static void preview_draw_area(preview_data *data,
     int SpotX1 = floor(MIN(data->SpotX1, data->SpotX2) * scale_x);
     int SpotX2 =  ceil(MAX(data->SpotX1, data->SpotX2) * scale_x);
 
+    if (data->ExposureMaskWidth != pixbufWidth ||
+            data->ExposureMaskHeight != pixbufHeight) {
+        g_free(data->ExposureMask);
+        data->ExposureMask = g_new0(guint8, pixbufWidth * pixbufHeight);
+        data->ExposureMaskWidth = pixbufWidth;
+        data->ExposureMaskHeight = pixbufHeight;
+        blinkOnly = FALSE;
+    }
+    preview_overlay_init();
+    guint8 colClass[width], rowClass[height];
+    preview_overlay_axis(colClass, x, width, Crop.x, Crop.width, drawLines);
+    preview_overlay_axis(rowClass, y, height, Crop.y, Crop.height, drawLines);
+
     int rowstride = gdk_pixbuf_get_rowstride(data->PreviewPixbuf);
     guint8 *pixies = gdk_pixbuf_get_pixels(data->PreviewPixbuf) + x * 3;
+    guint8 *mask = data->ExposureMask + x;
     /* This is bad. `img' should have been a parameter because we
      * cannot request an up to date buffer but it must be up to
      * date to some extend. In theory we could get the wrong buffer */
-    ufraw_image_data *displayImage = ufraw_get_image(data->UF, ufraw_display_phase, FALSE);
+    ufraw_image_data *displayImage = preview_get_image(data, ufraw_display_phase, FALSE);
     guint8 *displayPixies = displayImage->buffer + x * displayImage->depth;
-    ufraw_image_data *workingImage = ufraw_get_image(data->UF,
+    ufraw_image_data *workingImage = preview_get_image(data,
                                      ufraw_develop_phase, FALSE);
     guint8 *workingPixies = workingImage->buffer + x * workingImage->depth;
+    int channel = data->ChannelSelect;
+    int mode = data->RenderMode;
 
-    int xx, yy, c;
+    int yy;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) default(none) \
+    shared(x,y,width,height,rowstride,pixies,mask,pixbufWidth,displayImage, \
+           displayPixies,workingImage,workingPixies,colClass,rowClass, \
+           channel,mode,blinkOnly,blinkOver,blinkUnder,OverlayLUT)
+#endif
     for (yy = y; yy < y + height; yy++) {
+        guint8 map[overlay_num];
         guint8 *p8 = pixies + yy * rowstride;
-        memcpy(p8, displayPixies + yy * displayImage->rowstride,
-               width * displayImage->depth);
-        if (data->ChannelSelect >= 0) {
-            guint8 *p = p8;
-            for (xx = 0; xx < width; xx++, p += 3) {
-                guint8 px = p[data->ChannelSelect];
-                p[0] = p[1] = p[2] = px;
+        guint8 *m8 = mask + yy * pixbufWidth;
+        guint8 *d8 = displayPixies + yy * displayImage->rowstride;
+        guint8 *w8 = workingPixies + yy * workingImage->rowstride;
+        const int depth = workingImage->depth;
+        int xx, c;
+        preview_overlay_row(map, rowClass[yy - y]);
+        if (blinkOnly) {
+            /* Only the masked pixels change, recompose just those. */
+            for (xx = 0; xx < width; xx++) {
+                if (m8[xx] == 0)
+                    continue;
+                guint8 *p = p8 + xx * 3, *d = d8 + xx * 3;
+                const guint8 *lut = OverlayLUT[map[colClass[xx]]];
+                for (c = 0; c < 3; c++)
+                    p[c] = lut[d[channel < 0 ? c : channel]];
+                if (blinkOver && (m8[xx] & EXPOSURE_OVER))
+                    p[0] = p[1] = p[2] = 0;
+                else if (blinkUnder && (m8[xx] & EXPOSURE_UNDER))
+                    p[0] = p[1] = p[2] = 255;
             }
+            continue;
         }
-        guint8 *p8working = workingPixies + yy * workingImage->rowstride;
-        for (xx = x; xx < x + width; xx++, p8 += 3, p8working += workingImage->depth) {
-            if (data->SpotDraw &&
-                    (((yy == SpotY1 - 1 || yy == SpotY2) && xx >= SpotX1 - 1 && xx <= SpotX2)
-                     ||
-                     ((xx == SpotX1 - 1 || xx == SpotX2) && yy >= SpotY1 - 1 && yy <= SpotY2)
-                    )
-               ) {
-                if (((xx + yy) & 7) >= 4)
-                    p8[0] = p8[1] = p8[2] = 0;
-                else
-                    p8[0] = p8[1] = p8[2] = 255;
-                continue;
-            }
-            /* Draw white frame around crop area */
-            if (((yy == Crop.y - 1 || yy == CropY2) && xx >= Crop.x - 1 && xx <= CropX2) ||
-                    ((xx == Crop.x - 1 || xx == CropX2) && yy >= Crop.y - 1 && yy <= CropY2)) {
-                p8[0] = p8[1] = p8[2] = 255;
-                continue;
-            }
-            /* Shade the cropped out area */
-            else if (yy < Crop.y || yy >= CropY2 || xx < Crop.x || xx >= CropX2) {
-                for (c = 0; c < 3; c++) p8[c] = p8[c] / 4;
-                continue;
+        memcpy(p8, d8, width * 3);
+        if (channel >= 0) {
+            guint8 *p = p8;
+            for (xx = 0; xx < width; xx++, p += 3)
+                p[0] = p[1] = p[2] = p[channel];
+        }
+        /* Crop frame, shading and alignment lines */
+        for (xx = 0; xx < width; xx++) {
+            const guint8 *lut = OverlayLUT[map[colClass[xx]]];
+            p8[3 * xx] = lut[p8[3 * xx]];
+            p8[3 * xx + 1] = lut[p8[3 * xx + 1]];
+            p8[3 * xx + 2] = lut[p8[3 * xx + 2]];
+        }
+        /* Exposure inside the crop area */
+        for (xx = 0; xx < width; xx++) {
+            const guint8 *w = w8 + xx * depth;
+            guint8 inside = map[colClass[xx]] >= overlay_dark;
+            guint8 over = (w[0] == 255) | (w[1] == 255) | (w[2] == 255);
+            guint8 under = (w[0] == 0) | (w[1] == 0) | (w[2] == 0);
+            m8[xx] = inside * (over * EXPOSURE_OVER + under * EXPOSURE_UNDER);
+        }
+        if (mode == render_default) {
+            /* Blink the overexposed/underexposed spots */
+            for (xx = 0; xx < width; xx++) {
+                guint8 *p = p8 + xx * 3;
+                if (blinkOver && (m8[xx] & EXPOSURE_OVER))
+                    p[0] = p[1] = p[2] = 0;
+                else if (blinkUnder && (m8[xx] & EXPOSURE_UNDER))
+                    p[0] = p[1] = p[2] = 255;
             }
-            if (data->RenderMode == render_default) {
-                /* Shade out the alignment lines */
-                if (CFG->drawLines &&
-                        yy > Crop.y + 1 && yy < CropY2 - 2 &&
-                        xx > Crop.x + 1 && xx < CropX2 - 2) {
-                    int dx = (xx - Crop.x) * drawLines % Crop.width / drawLines;
-                    int dy = (yy - Crop.y) * drawLines % Crop.height / drawLines;
-                    if (dx == 0 || dy == 0) {
-                        p8[0] /= 2;
-                        p8[1] /= 2;
-                        p8[2] /= 2;
-                    } else if (dx == 1 || dy == 1) {
-                        p8[0] = 255 - (255 - p8[0]) / 2;
-                        p8[1] = 255 - (255 - p8[1]) / 2;
-                        p8[2] = 255 - (255 - p8[2]) / 2;
-                    }
-                }
-                /* Blink the overexposed/underexposed spots */
-                if (blinkOver && (p8working[0] == 255 || p8working[1] == 255 || p8working[2] == 255))
-                    p8[0] = p8[1] = p8[2] = 0;
-                else if (blinkUnder && (p8working[0] == 0 || p8working[1] == 0 || p8working[2] == 0))
-                    p8[0] = p8[1] = p8[2] = 255;
-            } else if (data->RenderMode == render_overexposed) {
-                for (c = 0; c < 3; c++) if (p8working[c] != 255) p8[c] = 0;
-            } else if (data->RenderMode == render_underexposed) {
-                for (c = 0; c < 3; c++) if (p8working[c] != 0) p8[c] = 255;
+        } else {
+            for (xx = 0; xx < width; xx++) {
+                const guint8 *w = w8 + xx * depth;
+                guint8 *p = p8 + xx * 3;
+                if (map[colClass[xx]] < overlay_dark)
+                    continue;
+                for (c = 0; c < 3; c++)
+                    if (mode == render_overexposed && w[c] != 255)
+                        p[c] = 0;
+                    else if (mode == render_underexposed && w[c] != 0)
+                        p[c] = 255;
             }
+            // No blinking in the special modes
+            memset(m8, 0, width);
+        }
+    }
+    /* Draw the spot frame on top of everything */
+    if (data->SpotDraw) {
+        int sx[2] = { SpotX1 - 1, SpotX2 }, sy[2] = { SpotY1 - 1, SpotY2 };
+        int i, xx;
+        for (i = 0; i < 2; i++) {
+            if (sy[i] >= y && sy[i] < y + height)
+                for (xx = MAX(x, SpotX1 - 1); xx <= MIN(x + width - 1, SpotX2); xx++)
+                    preview_spot_pixel(data, pixies, rowstride, x, xx, sy[i]);
+            if (sx[i] >= x && sx[i] < x + width)
+                for (yy = MAX(y, SpotY1 - 1); yy <= MIN(y + height - 1, SpotY2); yy++)
+                    preview_spot_pixel(data, pixies, rowstride, x, sx[i], yy);
         }
     }
     /* Redraw the changed areas */
@@ -672,6 +827,12 @@ static void preview_draw_area(preview_data *data,
 #endif
 }
 
+static void preview_draw_area(preview_data *data,
+                              int x, int y, int width, int height)
+{
+    preview_compose_area(data, x, y, width, height, FALSE);
+}
+
 static gboolean preview_draw_crop(preview_data *data)
 {
     UFRectangle Crop;
@@ -706,7 +867,7 @@ static gboolean switch_highlights(gpointer ptr)
         int height = MIN(Crop.height, viewRect.height);
 
         data->OverUnderTicker++;
-        preview_draw_area(data, x1, y1, width, height);
+        preview_compose_area(data, x1, y1, width, height, TRUE);
     }
     /* If no blinking is needed, disable this timeout function. */
     if (!CFG->blinkOverUnder || (!CFG->overExp && !CFG->underExp)) {
@@ -815,38 +976,14 @@ static void render_init(preview_data *data)
 
 static GtkProgressBar *ProgressBar;
 static GTimer *ProgressTimer;
-static void preview_progress(int what, int ticks)
-{
-    static int last_what, todo, done;
-    gboolean update = FALSE;
-
-#ifdef _OPENMP
-    #pragma omp master
-#endif
-    update = TRUE;
-#ifdef _OPENMP
-    #pragma omp critical(preview_progress)
-    {
-#endif
-        if (ticks < 0) {
-            todo = -ticks;
-            done = 0;
-            last_what = what;
-        } else {
-            if (last_what == what)
-                done += ticks;
-            else
-                update = FALSE;
-        }
-#ifdef _OPENMP
-    }
-#endif
-    if (!update)
-        return;		// wrong thread for GTK or "what" mismatch
-    if (g_timer_elapsed(ProgressTimer, NULL) < 0.07 && ticks >= 0)
-        return;		// avoid progress bar rendering hog
-    g_timer_start(ProgressTimer);
+/* Only the thread that enabled the progress bar may update it. Other
+ * threads only count the ticks, which render_progress_timeout() shows. */
+static GThread *ProgressThread;
+static int ProgressWhat, ProgressTodo, ProgressDone;
+G_LOCK_DEFINE_STATIC(preview_progress);
 
+static void preview_progress_draw(int what, gboolean setText, gboolean pump)
+{
     gboolean events = TRUE;
     double start = 0.0, stop = 1.0, fraction = 0.0;
     char *text = NULL;
@@ -871,22 +1008,57 @@ static void preview_progress(int what, int ticks)
         case PROGRESS_SAVE:
             text = _("Saving image");
     }
-    if (ticks < 0 && text)
+    if (setText && text)
         gtk_progress_bar_set_text(ProgressBar, text);
     if (!events)
         return;
-    fraction = todo ? start + (stop - start) * done / todo : 0;
+    fraction = ProgressTodo ?
+               start + (stop - start) * ProgressDone / ProgressTodo : 0;
     if (fraction > stop)
         fraction = stop;
     gtk_progress_bar_set_fraction(ProgressBar, fraction);
+    if (!pump)
+        return;
     while (gtk_events_pending())
         gtk_main_iteration();
 }
 
+static void preview_progress(int what, int ticks)
+{
+    gboolean update = FALSE;
+
+#ifdef _OPENMP
+    #pragma omp master
+#endif
+    update = TRUE;
+    /* The ticks also come from the workers of parallel_for() */
+    G_LOCK(preview_progress);
+    if (ticks < 0) {
+        ProgressTodo = -ticks;
+        ProgressDone = 0;
+        ProgressWhat = what;
+    } else {
+        if (ProgressWhat == what)
+            ProgressDone += ticks;
+        else
+            update = FALSE;
+    }
+    G_UNLOCK(preview_progress);
+    if (!update)
+        return;		// wrong thread for GTK or "what" mismatch
+    if (g_thread_self() != ProgressThread)
+        return;		// background rendering
+    if (g_timer_elapsed(ProgressTimer, NULL) < 0.07 && ticks >= 0)
+        return;		// avoid progress bar rendering hog
+    g_timer_start(ProgressTimer);
+    preview_progress_draw(what, ticks < 0, TRUE);
+}
+
 static void preview_progress_enable(preview_data *data)
 {
     ProgressBar = data->ProgressBar;
     ProgressTimer = g_timer_new();
+    ProgressThread = g_thread_self();
     ufraw_progress = preview_progress;
 }
 
@@ -900,6 +1072,92 @@ static void preview_progress_disable(preview_data *data)
 
 void resize_canvas(preview_data *data);
 
+/*
+ * The untiled phases (raw and first) can take seconds, so they are rendered
+ * by a background thread while the dialog stays responsive. Any change
+ * that invalidates a phase increments uf->generation, which makes the
+ * long running loops give up (see cancelled()) and the results be thrown
+ * away. render_preview() stops the thread before a new rendering starts,
+ * and preview_get_image() stops it before the main thread touches buffers
+ * the thread may be working on. The tiled phases are rendered afterwards
+ * in idle callbacks by render_preview_image().
+ */
+static preview_data *RenderData;
+
+static int render_cancelled(void)
+{
+    return g_atomic_int_get(&RenderData->UF->generation) !=
+           RenderData->RenderGeneration;
+}
+
+static void render_join(preview_data *data)
+{
+    g_thread_join(data->RenderThread);
+    data->RenderThread = NULL;
+    g_source_remove(data->RenderProgressTimer);
+    ufraw_cancelled = NULL;
+}
+
+/* Stop the background rendering, if any, and discard its results. */
+void render_stop(preview_data *data)
+{
+    if (data->RenderThread == NULL)
+        return;
+    g_atomic_int_inc(&data->UF->generation);
+    render_join(data);
+}
+
+static ufraw_image_data *preview_get_image(preview_data *data,
+        UFRawPhase phase, gboolean bufferok)
+{
+    if (data->RenderThread != NULL &&
+            (bufferok || data->UF->Images[phase].invalidate_event)) {
+        // Preparing or finishing the image could touch the buffers of
+        // the background rendering. Restart it afterwards.
+        render_preview(data);
+    }
+    return ufraw_get_image(data->UF, phase, bufferok);
+}
+
+static void render_preview_tiles(preview_data *data)
+{
+    ufraw_image_data *img = ufraw_get_image(data->UF,
+                                            ufraw_display_phase, FALSE);
+    preview_progress(PROGRESS_RENDER, -ufraw_image_get_subarea_count(img));
+    // Since we are already inside an idle callback, we should not use
+    // gdk_threads_add_idle_full().
+    g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
+                    (GSourceFunc)(render_preview_image), data, NULL);
+}
+
+static gboolean render_untiled_done(preview_data *data)
+{
+    if (data->RenderThread == NULL)
+        return FALSE; // The rendering was stopped meanwhile
+    render_join(data);
+    if (g_atomic_int_get(&data->UF->generation) != data->RenderGeneration) {
+        render_preview(data);
+        return FALSE;
+    }
+    render_preview_tiles(data);
+    return FALSE;
+}
+
+static gpointer render_untiled_thread(preview_data *data)
+{
+    ufraw_convert_image_area(data->UF, 0, ufraw_first_phase);
+    gdk_threads_add_idle_full(G_PRIORITY_DEFAULT_IDLE,
+                              (GSourceFunc)(render_untiled_done), data, NULL);
+    return NULL;
+}
+
+static gboolean render_progress_timeout(preview_data *data)
+{
+    (void)data;
+    preview_progress_draw(ProgressWhat, TRUE, FALSE);
+    return TRUE;
+}
+
 static gboolean render_preview_now(preview_data *data)
 {
     if (data->FreezeDialog)
@@ -961,27 +1219,33 @@ static gboolean render_preview_now(preview_data *data)
     ufraw_developer_prepare(data->UF, display_developer);
     data->FreezeDialog = FALSE;
     render_init(data);
-
-    /* This will trigger the untiled phases if necessary. The progress bar
-     * updates require gtk_main_iteration() calls which can only be
-     * done when there are no pending idle tasks which could recurse
-     * into ufraw_convert_image_area(). */
     preview_progress_enable(data);
-    data->FreezeDialog = TRUE;
-    ufraw_convert_image_area(data->UF, 0, ufraw_first_phase);
-    data->FreezeDialog = FALSE;
-
-    preview_progress(PROGRESS_RENDER, -32);
-    // Since we are already inside an idle callback, we should not use
-    // gdk_threads_add_idle_full().
-    g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
-                    (GSourceFunc)(render_preview_image), data, NULL);
 
+    /* All buffers are prepared here, so that the main thread can access
+     * them while the untiled phases are rendered in the background. */
+    ufraw_get_image(data->UF, ufraw_display_phase, FALSE);
+    if (ufraw_image_subarea_is_valid(&data->UF->Images[ufraw_first_phase], 0)) {
+        render_preview_tiles(data);
+        return FALSE;
+    }
+    data->RenderGeneration = g_atomic_int_get(&data->UF->generation);
+    RenderData = data;
+    ufraw_cancelled = render_cancelled;
+#if GLIB_CHECK_VERSION(2,32,0)
+    data->RenderThread = g_thread_new("render",
+                                      (GThreadFunc)render_untiled_thread, data);
+#else
+    data->RenderThread = g_thread_create(
+                             (GThreadFunc)render_untiled_thread, data, TRUE, NULL);
+#endif
+    data->RenderProgressTimer = g_timeout_add(100,
+                                (GSourceFunc)render_progress_timeout, data);
     return FALSE;
 }
 
 void render_preview(preview_data *data)
 {
+    render_stop(data);
     while (g_idle_remove_by_data(data))
         ;
     gdk_threads_add_idle_full(G_PRIORITY_DEFAULT_IDLE,
@@ -1085,112 +1349,114 @@ static gboolean render_raw_histogram(preview_data *data)
     return FALSE;
 }
 
-static int choose_subarea(preview_data *data, int *chosen)
+static int choose_subarea(preview_data *data, guint32 *chosen)
 {
     int subarea = -1;
     int max_area = -1;
+    gint64 min_dist = 0;
 
-    /* First of all, find the maximally visible yet unrendered subarea.
-     * Refreshing visible subareas in the first place improves visual
-     * feedback and overall user experience.
+    /* Find the maximally visible yet unrendered subarea. Among equally
+     * visible subareas take the one closest to the center of the viewport.
+     * Refreshing visible subareas in the first place, from the center
+     * outwards, improves visual feedback and overall user experience.
      */
     ufraw_image_data *img = ufraw_get_image(data->UF,
                                             ufraw_display_phase, FALSE);
     GdkRectangle viewport;
     gtk_image_view_get_viewport(
         GTK_IMAGE_VIEW(data->PreviewWidget), &viewport);
+    int cx = viewport.x + viewport.width / 2;
+    int cy = viewport.y + viewport.height / 2;
 
-    int i;
-    for (i = 0; i < 32; i++) {
+    int i, count = ufraw_image_get_subarea_count(img);
+    for (i = 0; i < count; i++) {
         /* Skip valid subareas */
-        if (img->valid & (1 << i))
+        if (ufraw_image_subarea_is_valid(img, i))
             continue;
         /* Skip areas chosen by other threads */
-        if (*chosen & (1 << i))
+        if (chosen[i / 32] & (1U << (i % 32)))
             continue;
 
-
         UFRectangle rec = ufraw_image_get_subarea_rectangle(img, i);
+        gint64 dx = rec.x + rec.width / 2 - cx;
+        gint64 dy = rec.y + rec.height / 2 - cy;
+        gint64 dist = dx * dx + dy * dy;
 
-        gboolean noclip = TRUE;
         if (rec.x < viewport.x) {
             rec.width -= (viewport.x - rec.x);
             rec.x = viewport.x;
-            noclip = FALSE;
         }
-        if (rec.x + rec.width > viewport.x + viewport.width) {
+        if (rec.x + rec.width > viewport.x + viewport.width)
             rec.width = viewport.x + viewport.width - rec.x;
-            noclip = FALSE;
-        }
         if (rec.y < viewport.y) {
             rec.height -= (viewport.y - rec.y);
             rec.y = viewport.y;
-            noclip = FALSE;
         }
-        if (rec.y + rec.height > viewport.y + viewport.height) {
+        if (rec.y + rec.height > viewport.y + viewport.height)
             rec.height = viewport.y + viewport.height - rec.y;
-            noclip = FALSE;
-        }
 
         /* Compute the visible area of the subarea */
         int area = (rec.width > 0 && rec.height > 0) ? rec.width * rec.height : 0;
-        if (area > max_area) {
+        if (area > max_area || (area == max_area && dist < min_dist)) {
             max_area = area;
+            min_dist = dist;
             subarea = i;
-            /* If this area is fully visible, stop searching */
-            if (noclip)
-                break;
         }
     }
     if (subarea >= 0)
-        *chosen |= 1 << subarea;
+        chosen[subarea / 32] |= 1U << (subarea % 32);
     return subarea;
 }
 
+/* Number of subareas every thread renders in one render_preview_image() call
+ * before the results are drawn. */
+#define RENDER_SUBAREAS_PER_THREAD 4
+
+typedef struct {
+    ufraw_data *uf;
+    int *subarea;
+} render_subareas;
+
+static void render_subarea_task(int index, void *user_data)
+{
+    render_subareas *job = user_data;
+    ufraw_convert_image_area(job->uf, job->subarea[index],
+                             ufraw_phases_num - 1);
+}
+
 /*
  * render_preview_image() is called after all non-tiled phases are rendered.
  *
- * OpenMP notes:
- *
- * Unfortunately ufraw_convert_image_area() still has some OpenMP awareness
- * which is related to OpenMP here. That should not be necessary.
+ * The subareas are chosen here, since choose_subarea() asks GTK+ for the
+ * viewport, and are then rendered by parallel_for().
  */
 static gboolean render_preview_image(preview_data *data)
 {
     gboolean again = FALSE;
-    int chosen = 0;
+    guint32 chosen[UFRAW_MAX_SUBAREAS / 32];
 
     if (data->FreezeDialog) return FALSE;
-    int subarea[uf_omp_get_max_threads()];
-    int i;
-    for (i = 0; i < uf_omp_get_max_threads(); i++)
-        subarea[i] = -1;
-#ifdef _OPENMP
-    #pragma omp parallel shared(chosen,data) reduction(||:again)
-    {
-        #pragma omp critical
-#endif
-        subarea[uf_omp_get_thread_num()] = choose_subarea(data, &chosen);
-        if (subarea[uf_omp_get_thread_num()] < 0) {
+    memset(chosen, 0, sizeof(chosen));
+    const int max_subareas = parallel_get_max_threads() * RENDER_SUBAREAS_PER_THREAD;
+    int subarea[max_subareas];
+    int i, subareas = 0;
+    while (subareas < max_subareas) {
+        int sa = choose_subarea(data, chosen);
+        if (sa < 0) {
             data->RenderSubArea = -1;
-        } else {
-            ufraw_convert_image_area(data->UF,
-                                     subarea[uf_omp_get_thread_num()], ufraw_phases_num - 1);
-            again = TRUE;
+            break;
         }
-
-#ifdef _OPENMP
+        subarea[subareas++] = sa;
     }
-#endif
+    render_subareas job = { data->UF, subarea };
+    parallel_for(render_subarea_task, subareas, &job);
+    again = subareas > 0;
     ufraw_image_data *img = ufraw_get_image(data->UF,
                                             ufraw_display_phase, FALSE);
-    for (i = 0; i < uf_omp_get_max_threads(); i++) {
-        if (subarea[i] >= 0) {
-            UFRectangle area = ufraw_image_get_subarea_rectangle(img,
-                               subarea[i]);
-            preview_draw_area(data, area.x, area.y, area.width, area.height);
-            progress(PROGRESS_RENDER, 1);
-        }
+    for (i = 0; i < subareas; i++) {
+        UFRectangle area = ufraw_image_get_subarea_rectangle(img, subarea[i]);
+        preview_draw_area(data, area.x, area.y, area.width, area.height);
+        progress(PROGRESS_RENDER, 1);
     }
     if (!again) {
         preview_progress_disable(data);
@@ -1208,9 +1474,8 @@ static gboolean render_live_histogram(preview_data *data)
 {
     if (data->FreezeDialog) return FALSE;
 
-    int x, y, c, min, max;
-    ufraw_image_data *img = ufraw_get_image(data->UF,
-                                            ufraw_develop_phase, TRUE);
+    int x, y, c;
+    ufraw_get_image(data->UF, ufraw_develop_phase, TRUE);
 
     UFRectangle Crop;
     ufraw_get_scaled_crop(data->UF, &Crop);
@@ -1218,24 +1483,16 @@ static gboolean render_live_histogram(preview_data *data)
     double rgb[3];
     guint64 sum[3], sqr[3];
     int live_his[live_his_size][4];
-    memset(live_his, 0, sizeof(live_his));
-    for (y = Crop.y; y < Crop.y + Crop.height; y++)
-        for (x = Crop.x; x < Crop.x + Crop.width; x++) {
-            guint8 *p8 = img->buffer + y * img->rowstride + x * img->depth;
-            for (c = 0, max = 0, min = 0x100; c < 3; c++) {
-                max = MAX(max, p8[c]);
-                min = MIN(min, p8[c]);
-                live_his[p8[c]][c]++;
-            }
-            if (CFG->histogram == luminosity_histogram)
-                live_his[(int)(0.3 * p8[0] + 0.59 * p8[1] + 0.11 * p8[2])][3]++;
-            if (CFG->histogram == value_histogram)
-                live_his[max][3]++;
-            if (CFG->histogram == saturation_histogram) {
-                if (max == 0) live_his[0][3]++;
-                else live_his[255 * (max - min) / max][3]++;
-            }
-        }
+    ufraw_histogram his;
+    ufraw_develop_histogram(data->UF, &his);
+    int channel = CFG->histogram == luminosity_histogram ? ufraw_his_luminosity :
+                  CFG->histogram == value_histogram ? ufraw_his_value :
+                  CFG->histogram == saturation_histogram ? ufraw_his_saturation : -1;
+    for (x = 0; x < live_his_size; x++) {
+        for (c = 0; c < 3; c++)
+            live_his[x][c] = his.count[x][c];
+        live_his[x][3] = channel < 0 ? 0 : his.count[x][channel];
+    }
     int hisHeight = MIN(data->LiveHisto->allocation.height - 2, his_max_height);
     hisHeight = MAX(hisHeight, data->HisMinHeight);
 
@@ -1361,13 +1618,13 @@ static gboolean render_spot(preview_data *data)
     if (data->SpotX1 < 0) return FALSE;
     if (data->SpotX1 >= data->UF->rotatedWidth ||
             data->SpotY1 >= data->UF->rotatedHeight) return FALSE;
-    ufraw_image_data *img = ufraw_get_image(data->UF,
+    ufraw_image_data *img = preview_get_image(data,
                                             ufraw_develop_phase, TRUE);
     int width = img->width;
     int height = img->height;
     int outDepth = img->depth;
     void *outBuffer = img->buffer;
-    img = ufraw_get_image(data->UF, ufraw_transform_phase, TRUE);
+    img = preview_get_image(data, ufraw_transform_phase, TRUE);
     int rawDepth = img->depth;
     void *rawBuffer = img->buffer;
 
@@ -1650,7 +1907,7 @@ static void spot_wb_event(GtkWidget *widget, gpointer user_data)
     height = gdk_pixbuf_get_height(data->PreviewPixbuf);
     /* Scale image coordinates to pixbuf coordinates */
     calculate_spot(data, &spot, width, height);
-    ufraw_image_data *image = ufraw_get_image(data->UF,
+    ufraw_image_data *image = preview_get_image(data,
                               ufraw_transform_phase, TRUE);
 
     for (c = 0; c < 4; c++) rgb[c] = 0;
@@ -1691,7 +1948,7 @@ static void remove_hue_event(GtkWidget *widget, gpointer user_data)
 
 static void calculate_hue(preview_data *data, int i)
 {
-    ufraw_image_data *img = ufraw_get_image(data->UF,
+    ufraw_image_data *img = preview_get_image(data,
                                             ufraw_transform_phase, FALSE);
     int width = img->width;
     int height = img->height;
@@ -1707,7 +1964,7 @@ static void calculate_hue(preview_data *data, int i)
     for (c = 0; c < 3; c++) rawSum[c] = 0;
     for (y = spot.StartY; y < spot.EndY; y++) {
         guint16 *rawPixie = rawBuffer + (y * width + spot.StartX) * rawDepth;
-        for (x = spot.StartX; x < spot.EndX; x++, rawPixie += rawDepth) {
+        for (x = spot.StartX; x < spot.EndX; x++, rawPixie += rawDepth / 2) {
             for (c = 0; c < data->UF->colors; c++)
                 rawSum[c] += rawPixie[c];
         }
@@ -1724,7 +1981,7 @@ static void calculate_hue(preview_data *data, int i)
     double sum = 0;
     for (y = spot.StartY; y < spot.EndY; y++) {
         guint16 *rawPixie = rawBuffer + (y * width + spot.StartX) * rawDepth;
-        for (x = spot.StartX; x < spot.EndX; x++, rawPixie += rawDepth) {
+        for (x = spot.StartX; x < spot.EndX; x++, rawPixie += rawDepth / 2) {
             uf_raw_to_cielch(Developer, rawPixie, lch);
             double diff = fabs(hue - lch[2]);
             if (diff > 180.0)
@@ -2547,6 +2804,7 @@ static void load_darkframe(GtkWidget *widget, void *unused)
         char *filename = gtk_file_chooser_get_filename(fileChooser);
         g_strlcpy(CFG->darkframeFile, filename, max_path);
         g_free(filename);
+        render_stop(data);
         ufraw_load_darkframe(data->UF);
         set_darkframe(data);
     }
@@ -2562,6 +2820,7 @@ static void reset_darkframe(GtkWidget *widget, void *unused)
     if (data->FreezeDialog) return;
     if (CFG->darkframe == NULL) return;
 
+    render_stop(data);
     ufraw_close_darkframe(CFG);
 
     set_darkframe(data);
@@ -3629,6 +3888,7 @@ static void options_dialog(preview_data *data)
         char *utf8_log = g_filename_display_name(log);
         gtk_text_buffer_set_text(buffer, utf8_log, -1);
         g_free(utf8_log);
+        g_free(log);
     }
     label = gtk_label_new(_("About"));
     box = gtk_vbox_new(FALSE, 0);
@@ -3962,6 +4222,9 @@ static void control_button_event(GtkWidget *widget, long type)
     preview_data *data = get_preview_data(widget);
     if (data->FreezeDialog == TRUE) return;
     data->FreezeDialog = TRUE;
+    // Saving converts the image in this thread
+    gboolean rendering = data->RenderThread != NULL;
+    render_stop(data);
     GtkWindow *window = GTK_WINDOW(gtk_widget_get_toplevel(widget));
     gtk_widget_set_sensitive(data->Controls, FALSE);
     uf_long response = UFRAW_NO_RESPONSE;
@@ -4024,6 +4287,8 @@ static void control_button_event(GtkWidget *widget, long type)
     if (status != UFRAW_SUCCESS || CFG->noExit) {
         ufraw_invalidate_layer(data->UF, ufraw_raw_phase);
         render_preview(data);
+    } else if (rendering && response == UFRAW_NO_RESPONSE) {
+        render_preview(data);
     }
 }
 
@@ -5343,6 +5608,10 @@ static void save_fill_interface(preview_data *data,
     gtk_box_pack_start(GTK_BOX(vBox), button, FALSE, FALSE, 0);
 #endif // HAVE_LIBJPEG
 
+    button = uf_check_button_new(_("Multi-threaded output encoding"),
+                                 &CFG->parallelSave);
+    gtk_box_pack_start(GTK_BOX(vBox), button, FALSE, FALSE, 0);
+
 #if defined(HAVE_LIBTIFF) && defined(HAVE_LIBZ)
     button = uf_check_button_new(_("TIFF lossless Compress"),
                                  &CFG->losslessCompress);
@@ -5488,6 +5757,7 @@ int ufraw_preview(ufraw_data *uf, conf_data *rc, int plugin,
 
     /* Fill the whole structure with zeros, to avoid surprises */
     memset(&PreviewData, 0, sizeof(PreviewData));
+    MessengerThread = g_thread_self();
 
     data->UF = uf;
     data->SaveFunc = save_func;
@@ -5892,20 +6162,42 @@ int ufraw_preview(ufraw_data *uf, conf_data *rc, int plugin,
     render_preview_now(data);
     update_crop_ranges(data, FALSE);
 
+    /* The raw histogram needs the untiled phases, wait for them. */
+    while (data->RenderThread != NULL)
+        gtk_main_iteration();
+
     /* Collect raw histogram data */
-    ufraw_image_data *image = ufraw_get_image(data->UF,
+    ufraw_image_data *image = preview_get_image(data,
                               ufraw_first_phase, TRUE);
-    for (i = 0; i < image->height * image->width; i++) {
-        guint16 *buf = (guint16*)(image->buffer + i * image->depth);
-        for (c = 0; c < data->UF->colors; c++)
-            data->raw_his[MIN(buf[c] *
-                              (raw_his_size - 1) / data->UF->rgbMax,
-                              raw_his_size - 1)][c]++;
+#ifdef _OPENMP
+    #pragma omp parallel default(none) shared(data,image) private(i,c)
+#endif
+    {
+        int raw_his[raw_his_size][4];
+        memset(raw_his, 0, sizeof(raw_his));
+#ifdef _OPENMP
+        #pragma omp for schedule(static)
+#endif
+        for (i = 0; i < image->height * image->width; i++) {
+            guint16 *buf = (guint16*)(image->buffer + i * image->depth);
+            for (c = 0; c < data->UF->colors; c++)
+                raw_his[MIN(buf[c] *
+                            (raw_his_size - 1) / data->UF->rgbMax,
+                            raw_his_size - 1)][c]++;
+        }
+#ifdef _OPENMP
+        #pragma omp critical
+#endif
+        for (i = 0; i < raw_his_size; i++)
+            for (c = 0; c < 4; c++)
+                data->raw_his[i][c] += raw_his[i][c];
     }
 
     data->OverUnderTicker = 0;
 
     gtk_main();
+    render_stop(data);
+    g_free(data->ExposureMask);
     status = (uf_long)g_object_get_data(G_OBJECT(previewWindow),
                                         "WindowResponse");
     gtk_container_foreach(GTK_CONTAINER(previewVBox),
@@ -605,3 +605,90 @@ void ptr_array_insert_index(
     memmove(root + index + 1, root + index, (length - index) * sizeof(void *));
     root [index] = item;
 }
+
+/*
+ * A small pool of image buffers. In batch mode every file allocates the
+ * same set of phase buffers, usually of identical sizes, so keeping the
+ * buffers of the previous file around saves both the allocation and the
+ * page faults of touching fresh memory.
+ * Buffers are plain g_malloc() blocks, so they can still be handed to
+ * code that g_realloc()s or g_free()s them.
+ */
+#define UFRAW_POOL_MAX_BUFFERS 16
+/* A pooled buffer is reused only if it wastes less than 1/UFRAW_POOL_SLACK
+ * of its size. */
+#define UFRAW_POOL_SLACK 4
+
+struct _ufraw_buffer_pool {
+    int count;
+    void *buffer[UFRAW_POOL_MAX_BUFFERS];
+    gsize size[UFRAW_POOL_MAX_BUFFERS];
+};
+
+ufraw_buffer_pool *ufraw_buffer_pool_new(void)
+{
+    return g_new0(ufraw_buffer_pool, 1);
+}
+
+void ufraw_buffer_pool_destroy(ufraw_buffer_pool *pool)
+{
+    if (pool == NULL)
+        return;
+    int i;
+    for (i = 0; i < pool->count; i++)
+        g_free(pool->buffer[i]);
+    g_free(pool);
+}
+
+static void ufraw_buffer_pool_take(ufraw_buffer_pool *pool, int i)
+{
+    pool->count--;
+    pool->buffer[i] = pool->buffer[pool->count];
+    pool->size[i] = pool->size[pool->count];
+}
+
+void *ufraw_buffer_pool_alloc(ufraw_buffer_pool *pool, gsize size)
+{
+    if (pool == NULL || size == 0)
+        return g_malloc(size);
+    int i, best = -1;
+    for (i = 0; i < pool->count; i++) {
+        if (pool->size[i] < size ||
+                pool->size[i] - size > pool->size[i] / UFRAW_POOL_SLACK)
+            continue;
+        if (best < 0 || pool->size[i] < pool->size[best])
+            best = i;
+    }
+    if (best < 0)
+        return g_malloc(size);
+    void *buffer = pool->buffer[best];
+    ufraw_buffer_pool_take(pool, best);
+    return buffer;
+}
+
+void ufraw_buffer_pool_release(ufraw_buffer_pool *pool, void *buffer,
+                               gsize size)
+{
+    if (buffer == NULL)
+        return;
+    if (pool == NULL || size == 0) {
+        g_free(buffer);
+        return;
+    }
+    if (pool->count == UFRAW_POOL_MAX_BUFFERS) {
+        // Evict the smallest buffer, unless the new one is even smaller
+        int i, smallest = 0;
+        for (i = 1; i < pool->count; i++)
+            if (pool->size[i] < pool->size[smallest])
+                smallest = i;
+        if (pool->size[smallest] >= size) {
+            g_free(buffer);
+            return;
+        }
+        g_free(pool->buffer[smallest]);
+        ufraw_buffer_pool_take(pool, smallest);
+    }
+    pool->buffer[pool->count] = buffer;
+    pool->size[pool->count] = size;
+    pool->count++;
+}
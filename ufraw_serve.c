@@ -0,0 +1,600 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * ufraw_serve.c - 'ufraw-batch --serve', conversion jobs over a local socket.
+ * Copyright 2004-2016 by Udi Fuchs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "ufraw.h"
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <locale.h>
+#include <glib/gi18n.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef G_OS_UNIX
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Every line sent to the socket is one job, a JSON object such as
+ *   {"id":7, "input":"a.nef", "output":"a.jpg", "options":["--shrink=2"]}
+ * and is answered by one JSON line once the job is done. Jobs from all
+ * connections share a queue and are converted by a few worker threads.
+ * The setup of a job (option parsing, ufraw_open, ufraw_config) and its
+ * closing are serialized, since they use getopt, the lensfun database and
+ * the global message buffers. Loading and saving run concurrently.
+ */
+
+typedef struct {
+    int fd;
+    volatile gint refs;
+} serve_client;
+
+typedef struct {
+    serve_client *client;
+    char *id; /* The JSON text of the job id, echoed back as is */
+    char *input, *output, *conf;
+    GPtrArray *options;
+    GTimer *timer;
+} serve_job;
+
+static conf_data *ServeRc;
+static int ServeOptc;
+static char **ServeOptv;
+static GAsyncQueue *ServeQueue;
+static int ServeOmpThreads;
+static char ServeSocket[max_path];
+
+G_LOCK_DEFINE_STATIC(serve_setup);
+G_LOCK_DEFINE_STATIC(serve_reply);
+
+static void serve_thread_new(const char *name, GThreadFunc func, gpointer data)
+{
+#if GLIB_CHECK_VERSION(2,32,0)
+    g_thread_unref(g_thread_new(name, func, data));
+#else
+    (void)name;
+    g_thread_create(func, data, FALSE, NULL);
+#endif
+}
+
+static void serve_client_unref(serve_client *client)
+{
+    if (!g_atomic_int_dec_and_test(&client->refs))
+        return;
+    close(client->fd);
+    g_free(client);
+}
+
+static void serve_strings_free(GPtrArray *array)
+{
+    guint i;
+    for (i = 0; i < array->len; i++)
+        g_free(g_ptr_array_index(array, i));
+    g_ptr_array_free(array, TRUE);
+}
+
+static void serve_job_free(serve_job *job)
+{
+    serve_client_unref(job->client);
+    g_free(job->id);
+    g_free(job->input);
+    g_free(job->output);
+    g_free(job->conf);
+    serve_strings_free(job->options);
+    g_timer_destroy(job->timer);
+    g_free(job);
+}
+
+/* A minimal JSON reader, enough for the flat job objects. */
+
+static void json_skip_space(const char **p)
+{
+    while (**p == ' ' || **p == '\t' || **p == '\r' || **p == '\n')
+        (*p)++;
+}
+
+static int json_hex(const char **p)
+{
+    int i, u = 0;
+    for (i = 0; i < 4; i++) {
+        int h = g_ascii_xdigit_value((*p)[i]);
+        if (h < 0) return -1;
+        u = u * 16 + h;
+    }
+    *p += 4;
+    return u;
+}
+
+/* Returns a newly allocated UTF-8 string, or NULL on a syntax error. */
+static char *json_string(const char **p)
+{
+    if (**p != '"') return NULL;
+    GString *str = g_string_new("");
+    const char *s = *p + 1;
+    while (*s != '"') {
+        if (*s == '\0' || (guchar)*s < 0x20) {
+            g_string_free(str, TRUE);
+            return NULL;
+        }
+        if (*s != '\\') {
+            g_string_append_c(str, *s++);
+            continue;
+        }
+        s++;
+        switch (*s++) {
+            case '"': g_string_append_c(str, '"'); break;
+            case '\\': g_string_append_c(str, '\\'); break;
+            case '/': g_string_append_c(str, '/'); break;
+            case 'b': g_string_append_c(str, '\b'); break;
+            case 'f': g_string_append_c(str, '\f'); break;
+            case 'n': g_string_append_c(str, '\n'); break;
+            case 'r': g_string_append_c(str, '\r'); break;
+            case 't': g_string_append_c(str, '\t'); break;
+            case 'u': {
+                int u = json_hex(&s);
+                // Combine UTF-16 surrogate pairs
+                if (u >= 0xD800 && u < 0xDC00 && s[0] == '\\' && s[1] == 'u') {
+                    s += 2;
+                    int l = json_hex(&s);
+                    u = l >= 0xDC00 && l < 0xE000 ?
+                        0x10000 + ((u - 0xD800) << 10) + (l - 0xDC00) : -1;
+                }
+                if (u > 0 && (u < 0xD800 || u >= 0xE000)) {
+                    g_string_append_unichar(str, u);
+                    break;
+                }
+            }
+            // Fall through
+            default:
+                g_string_free(str, TRUE);
+                return NULL;
+        }
+    }
+    *p = s + 1;
+    return g_string_free(str, FALSE);
+}
+
+static gboolean json_skip_value(const char **p)
+{
+    json_skip_space(p);
+    if (**p == '"') {
+        char *str = json_string(p);
+        g_free(str);
+        return str != NULL;
+    }
+    if (**p == '[' || **p == '{') {
+        char close = **p == '[' ? ']' : '}';
+        (*p)++;
+        json_skip_space(p);
+        if (**p == close) {
+            (*p)++;
+            return TRUE;
+        }
+        while (TRUE) {
+            if (close == '}') {
+                char *key = json_string(p);
+                if (key == NULL) return FALSE;
+                g_free(key);
+                json_skip_space(p);
+                if (*(*p)++ != ':') return FALSE;
+            }
+            if (!json_skip_value(p)) return FALSE;
+            json_skip_space(p);
+            if (**p == close) {
+                (*p)++;
+                return TRUE;
+            }
+            if (*(*p)++ != ',') return FALSE;
+            json_skip_space(p);
+        }
+    }
+    // Numbers, true, false and null
+    const char *start = *p;
+    while (g_ascii_isalnum(**p) || **p == '-' || **p == '+' || **p == '.')
+        (*p)++;
+    return *p > start;
+}
+
+static gboolean json_string_array(const char **p, GPtrArray *array)
+{
+    if (*(*p)++ != '[') return FALSE;
+    json_skip_space(p);
+    if (**p == ']') {
+        (*p)++;
+        return TRUE;
+    }
+    while (TRUE) {
+        char *str = json_string(p);
+        if (str == NULL) return FALSE;
+        g_ptr_array_add(array, str);
+        json_skip_space(p);
+        if (**p == ']') {
+            (*p)++;
+            return TRUE;
+        }
+        if (*(*p)++ != ',') return FALSE;
+        json_skip_space(p);
+    }
+}
+
+static gboolean serve_job_parse(serve_job *job, const char *line)
+{
+    const char *p = line;
+    json_skip_space(&p);
+    if (*p++ != '{') return FALSE;
+    json_skip_space(&p);
+    if (*p == '}') return FALSE;
+    while (TRUE) {
+        char *key = json_string(&p);
+        if (key == NULL) return FALSE;
+        json_skip_space(&p);
+        if (*p++ != ':') {
+            g_free(key);
+            return FALSE;
+        }
+        json_skip_space(&p);
+        gboolean ok;
+        char **field = NULL;
+        if (!strcmp(key, "input")) field = &job->input;
+        else if (!strcmp(key, "output")) field = &job->output;
+        else if (!strcmp(key, "conf")) field = &job->conf;
+        if (field != NULL) {
+            g_free(*field);
+            *field = json_string(&p);
+            ok = *field != NULL;
+        } else if (!strcmp(key, "options")) {
+            ok = json_string_array(&p, job->options);
+        } else {
+            const char *start = p;
+            ok = json_skip_value(&p);
+            if (ok && !strcmp(key, "id")) {
+                g_free(job->id);
+                job->id = g_strndup(start, p - start);
+            }
+        }
+        g_free(key);
+        if (!ok) return FALSE;
+        json_skip_space(&p);
+        if (*p == '}') break;
+        if (*p++ != ',') return FALSE;
+        json_skip_space(&p);
+    }
+    p++;
+    json_skip_space(&p);
+    return *p == '\0';
+}
+
+static void json_append_string(GString *str, const char *key, const char *value)
+{
+    const char *s;
+    g_string_append_printf(str, ", \"%s\": \"", key);
+    for (s = value != NULL ? value : ""; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\')
+            g_string_append_printf(str, "\\%c", *s);
+        else if (*s == '\n')
+            g_string_append(str, "\\n");
+        else if ((guchar)*s < 0x20)
+            g_string_append_printf(str, "\\u%04x", *s);
+        else
+            g_string_append_c(str, *s);
+    }
+    g_string_append_c(str, '"');
+}
+
+/* Independent of the numeric locale */
+static void json_append_number(GString *str, const char *key, double value)
+{
+    char buf[G_ASCII_DTOSTR_BUF_SIZE];
+    g_string_append_printf(str, ", \"%s\": %s", key,
+                           g_ascii_formatd(buf, sizeof(buf), "%.3f", value));
+}
+
+static void serve_reply(serve_job *job, int status, const char *output,
+                        const char *message, double wait, double load,
+                        double save)
+{
+    GString *str = g_string_new("");
+    g_string_append_printf(str, "{\"id\": %s",
+                           job->id != NULL ? job->id : "null");
+    json_append_string(str, "status", status == UFRAW_SUCCESS ? "ok" :
+                       status == UFRAW_WARNING ? "warning" : "error");
+    json_append_string(str, "output", output);
+    // Trailing newlines are noise in a one line reply
+    char *msg = g_strdup(message != NULL ? message : "");
+    json_append_string(str, "message", g_strchomp(msg));
+    g_free(msg);
+    json_append_number(str, "wait", wait);
+    json_append_number(str, "load", load);
+    json_append_number(str, "save", save);
+    json_append_number(str, "total", wait + g_timer_elapsed(job->timer, NULL));
+    g_string_append(str, "}\n");
+
+    G_LOCK(serve_reply);
+    gsize done = 0;
+    while (done < str->len) {
+        gssize n = write(job->client->fd, str->str + done, str->len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break; // The client is gone
+        done += n;
+    }
+    G_UNLOCK(serve_reply);
+    g_string_free(str, TRUE);
+}
+
+/* Parse the options of the daemon followed by the options of the job,
+ * the last one wins. Should be called with serve_setup locked. */
+static gboolean serve_process_args(serve_job *job, conf_data *cmd,
+                                   conf_data *rc)
+{
+    GPtrArray *args = g_ptr_array_new();
+    GPtrArray *owned = g_ptr_array_new();
+    guint i;
+
+    g_ptr_array_add(args, ufraw_binary);
+    for (i = 0; i < (guint)ServeOptc; i++)
+        g_ptr_array_add(args, ServeOptv[i]);
+    for (i = 0; i < job->options->len; i++)
+        g_ptr_array_add(args, g_ptr_array_index(job->options, i));
+    if (job->output != NULL)
+        g_ptr_array_add(owned, g_strconcat("--output=", job->output, NULL));
+    if (job->conf != NULL)
+        g_ptr_array_add(owned, g_strconcat("--conf=", job->conf, NULL));
+    for (i = 0; i < owned->len; i++)
+        g_ptr_array_add(args, g_ptr_array_index(owned, i));
+    g_ptr_array_add(args, NULL);
+
+    int argc = args->len - 1;
+    char **argv = (char **)args->pdata;
+    optind = 0; // Restart getopt
+    int optInd = ufraw_process_args(&argc, &argv, cmd, rc);
+
+    serve_strings_free(owned);
+    g_ptr_array_free(args, TRUE);
+    return optInd > 0 && optInd == argc;
+}
+
+static void serve_job_run(serve_job *job, ufraw_buffer_pool *pool)
+{
+    conf_data *rc = g_new(conf_data, 1);
+    conf_data *cmd = g_new(conf_data, 1);
+    conf_data *conf = g_new(conf_data, 1);
+    ufraw_data *uf = NULL;
+    char *message = NULL;
+    char output[max_path] = "";
+    int status = UFRAW_ERROR;
+    double wait = g_timer_elapsed(job->timer, NULL), load = 0, save = 0;
+
+    g_timer_start(job->timer);
+    conf->ufobject = NULL;
+    G_LOCK(serve_setup);
+    *rc = *ServeRc;
+    *cmd = *ServeRc;
+    ufraw_message(UFRAW_RESET, NULL);
+    if (!serve_process_args(job, cmd, rc)) {
+        message = g_strdup(_("Invalid job options"));
+    } else if (strlen(cmd->serveSocket) > 0 || !strcmp(cmd->outputFilename, "-") ||
+               cmd->createID == also_id || cmd->createID == only_id) {
+        // conf_save() switches the locale and embeds the global message log
+        message = g_strdup(_("Option not supported by the conversion service"));
+    } else {
+        char filename[max_path];
+        conf_file_load(conf, cmd->inputFilename);
+        g_strlcpy(filename, job->input, max_path);
+        uf = ufraw_open(filename);
+        if (uf == NULL) {
+            message = ufraw_message(UFRAW_GET_WARNING, NULL);
+            if (message == NULL)
+                message = g_strdup(_("Can not open the input file"));
+        } else {
+            uf->pool = pool;
+            status = ufraw_config(uf, rc, conf, cmd);
+            // ID files set by the rc or conf files are not written either
+            if (uf->conf != NULL)
+                uf->conf->createID = no_id;
+            if (status == UFRAW_ERROR)
+                message = g_strdup(_("Invalid job configuration"));
+        }
+    }
+    ufobject_delete(cmd->ufobject);
+    G_UNLOCK(serve_setup);
+
+    if (uf != NULL && message == NULL) {
+        g_strlcpy(output, uf->conf->outputFilename, max_path);
+        status = UFRAW_ERROR;
+        if (!uf->conf->overwrite && uf->conf->createID != only_id &&
+                g_file_test(output, G_FILE_TEST_EXISTS)) {
+            message = g_strdup_printf(_("%s already exists"), output);
+        } else if (ufraw_load_raw(uf) != UFRAW_SUCCESS) {
+            message = g_strdup(ufraw_get_message(uf));
+        } else {
+            load = g_timer_elapsed(job->timer, NULL);
+            status = ufraw_batch_saver(uf);
+            save = g_timer_elapsed(job->timer, NULL) - load;
+            message = g_strdup(ufraw_get_message(uf));
+            g_strlcpy(output, uf->conf->outputFilename, max_path);
+        }
+    }
+    if (uf != NULL) {
+        G_LOCK(serve_setup);
+        ufraw_close_darkframe(uf->conf);
+        ufraw_close(uf);
+        G_UNLOCK(serve_setup);
+        g_free(uf);
+    }
+    ufobject_delete(conf->ufobject);
+    if (status != UFRAW_SUCCESS && status != UFRAW_WARNING)
+        status = UFRAW_ERROR;
+    serve_reply(job, status, output, message, wait, load, save);
+    g_free(message);
+    g_free(conf);
+    g_free(cmd);
+    g_free(rc);
+    serve_job_free(job);
+}
+
+static gpointer serve_worker(gpointer data)
+{
+    /* Image buffers are recycled from one job to the next */
+    ufraw_buffer_pool *pool = ufraw_buffer_pool_new();
+    (void)data;
+    /* Keep the messages of our jobs apart from the other workers' */
+    ufraw_message_private_buffers(TRUE);
+#ifdef _OPENMP
+    omp_set_num_threads(ServeOmpThreads);
+#endif
+    while (TRUE)
+        serve_job_run(g_async_queue_pop(ServeQueue), pool);
+    return NULL;
+}
+
+static gpointer serve_client_reader(gpointer data)
+{
+    serve_client *client = data;
+    int fd = dup(client->fd);
+    FILE *in = fd < 0 ? NULL : fdopen(fd, "r");
+    GString *line = g_string_new("");
+    char buf[max_path];
+
+    while (in != NULL && fgets(buf, max_path, in) != NULL) {
+        g_string_append(line, buf);
+        if (line->str[line->len - 1] != '\n' && !feof(in))
+            continue;
+        serve_job *job = g_new0(serve_job, 1);
+        job->client = client;
+        job->options = g_ptr_array_new();
+        job->timer = g_timer_new();
+        g_atomic_int_inc(&client->refs);
+        if (strspn(line->str, " \t\r\n") == line->len) {
+            serve_job_free(job);
+        } else if (!serve_job_parse(job, line->str) || job->input == NULL) {
+            serve_reply(job, UFRAW_ERROR, NULL, _("Invalid job request"),
+                        0, 0, 0);
+            serve_job_free(job);
+        } else {
+            g_async_queue_push(ServeQueue, job);
+        }
+        g_string_truncate(line, 0);
+    }
+    if (in != NULL)
+        fclose(in);
+    else if (fd >= 0)
+        close(fd);
+    g_string_free(line, TRUE);
+    serve_client_unref(client);
+    return NULL;
+}
+
+static void serve_signal(int sig)
+{
+    unlink(ServeSocket);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+int ufraw_serve(const char *socketPath, conf_data *rc, int optc, char **optv)
+{
+    struct sockaddr_un addr;
+    int i;
+
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        ufraw_message(UFRAW_ERROR, _("Socket path '%s' is too long"),
+                      socketPath);
+        return UFRAW_ERROR;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    g_strlcpy(addr.sun_path, socketPath, sizeof(addr.sun_path));
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        ufraw_message(UFRAW_ERROR, _("Can not create socket: %s"),
+                      g_strerror(errno));
+        return UFRAW_ERROR;
+    }
+    // Remove a socket left behind by a previous run
+    struct stat s;
+    if (g_lstat(socketPath, &s) == 0 && S_ISSOCK(s.st_mode))
+        g_unlink(socketPath);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(fd, 16) < 0) {
+        ufraw_message(UFRAW_ERROR, _("Can not listen on '%s': %s"),
+                      socketPath, g_strerror(errno));
+        close(fd);
+        return UFRAW_ERROR;
+    }
+    g_strlcpy(ServeSocket, socketPath, max_path);
+    signal(SIGINT, serve_signal);
+    signal(SIGTERM, serve_signal);
+    // A client closing its connection early should not kill the service
+    signal(SIGPIPE, SIG_IGN);
+
+    /* setlocale() is process wide and not thread safe. With the numeric
+     * locale set to "C" once here, uf_set_locale_C() finds nothing to
+     * change when the jobs parse and write their configuration. */
+    setlocale(LC_NUMERIC, "C");
+
+    ServeRc = rc;
+    ServeOptc = optc;
+    ServeOptv = optv;
+    ServeQueue = g_async_queue_new();
+    /* Half the processors run jobs, so that one job can be loading while
+     * another one is being converted. The OpenMP kernels of each job share
+     * the processors between them. */
+    int threads = parallel_get_max_threads();
+    int workers = MAX(threads / 2, 2);
+    ServeOmpThreads = MAX(threads / workers, 1);
+    for (i = 0; i < workers; i++)
+        serve_thread_new("serve", serve_worker, NULL);
+    ufraw_message(UFRAW_BATCH_MESSAGE,
+                  _("Listening on %s with %d workers"), socketPath, workers);
+
+    while (TRUE) {
+        int client_fd = accept(fd, NULL, NULL);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            ufraw_message(UFRAW_ERROR, _("Can not accept connection: %s"),
+                          g_strerror(errno));
+            break;
+        }
+        serve_client *client = g_new0(serve_client, 1);
+        client->fd = client_fd;
+        client->refs = 1;
+        serve_thread_new("client", serve_client_reader, client);
+    }
+    close(fd);
+    g_unlink(socketPath);
+    return UFRAW_ERROR;
+}
+
+#else
+
+int ufraw_serve(const char *socketPath, conf_data *rc, int optc, char **optv)
+{
+    (void)socketPath;
+    (void)rc;
+    (void)optc;
+    (void)optv;
+    ufraw_message(UFRAW_ERROR,
+                  _("The --serve option is not supported on this platform"));
+    return UFRAW_ERROR;
+}
+
+#endif /*G_OS_UNIX*/
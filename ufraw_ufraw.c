@@ -31,6 +31,7 @@
 #endif
 
 void (*ufraw_progress)(int what, int ticks) = NULL;
+int (*ufraw_cancelled)(void) = NULL;
 
 #ifdef HAVE_LENSFUN
 #define UF_LF_TRANSFORM ( \
@@ -44,15 +45,17 @@ void ufraw_prepare_tca(ufraw_data *uf);
 #endif
 static void ufraw_image_format(int *colors, int *bytes, ufraw_image_data *img,
                                const char *formats, const char *caller);
-static void ufraw_convert_image_raw(ufraw_data *uf, UFRawPhase phase);
+static void ufraw_convert_image_raw(ufraw_data *uf, UFRawPhase phase,
+                                    int level);
 static void ufraw_convert_image_first(ufraw_data *uf, UFRawPhase phase);
 static void ufraw_convert_image_transform(ufraw_data *uf, ufraw_image_data *img,
         ufraw_image_data *outimg, UFRectangle *area);
 static void ufraw_convert_prepare_first_buffer(ufraw_data *uf,
         ufraw_image_data *img);
 static void ufraw_convert_prepare_transform_buffer(ufraw_data *uf,
-        ufraw_image_data *img, int width, int height);
+        ufraw_image_data *img, int width, int height, int depth);
 static void ufraw_convert_reverse_wb(ufraw_data *uf, UFRawPhase phase);
+static void ufraw_stage_cache_destroy(ufraw_data *uf);
 static void ufraw_convert_import_buffer(ufraw_data *uf, UFRawPhase phase,
                                         dcraw_image_data *dcimg);
 
@@ -248,10 +251,11 @@ ufraw_data *ufraw_open(char *filename)
         uf->Images[i].buffer = NULL;
         uf->Images[i].width = 0;
         uf->Images[i].height = 0;
-        uf->Images[i].valid = 0;
+        ufraw_image_set_valid(&uf->Images[i], FALSE);
         uf->Images[i].invalidate_event = TRUE;
     }
     uf->thumb.buffer = NULL;
+    uf->proxyLevel = 1;
     uf->raw = raw;
     uf->colors = raw->colors;
     uf->raw_color = raw->raw_color;
@@ -760,9 +764,21 @@ void ufraw_close(ufraw_data *uf)
     g_free(uf->inputExifBuf);
     g_free(uf->outputExifBuf);
     int i;
-    for (i = ufraw_raw_phase; i < ufraw_phases_num; i++)
-        g_free(uf->Images[i].buffer);
+    for (i = ufraw_raw_phase; i < ufraw_phases_num; i++) {
+        ufraw_image_data *img = &uf->Images[i];
+        // The first phase buffer is resized by dcraw behind our back,
+        // so its dimensions cannot be trusted to describe the allocation.
+        if (i == ufraw_first_phase)
+            g_free(img->buffer);
+        else
+            ufraw_buffer_pool_release(uf->pool, img->buffer,
+                                      (gsize)img->height * img->rowstride);
+    }
     g_free(uf->thumb.buffer);
+    for (i = 0; i < UFRAW_PROXY_LEVELS; i++)
+        g_free(uf->rawProxy[i]);
+    ufraw_stage_cache_destroy(uf);
+    g_free(uf->tileHistogram);
     developer_destroy(uf->developer);
     developer_destroy(uf->AutoDeveloper);
     g_free(uf->displayProfile);
@@ -777,21 +793,50 @@ void ufraw_close(ufraw_data *uf)
     ufraw_message(UFRAW_CLEAN, NULL);
 }
 
+/* Subareas are shrunk for small images until there are at least this many,
+ * which keeps all cores busy in the preview. */
+#define UFRAW_MIN_SUBAREAS 64
+
+static int ufraw_subarea_count(int width, int height, int size)
+{
+    return ((width + size - 1) / size) * ((height + size - 1) / size);
+}
+
+/* Return the side length of the square subareas of the image.
+ * It depends only on the image dimensions, so phases of equal size
+ * share the same subarea layout.
+ */
+int ufraw_image_get_subarea_size(ufraw_image_data *img)
+{
+    int size = UFRAW_SUBAREA_SIZE;
+    while (size > UFRAW_MIN_SUBAREA_SIZE &&
+            ufraw_subarea_count(img->width, img->height, size) < UFRAW_MIN_SUBAREAS)
+        size /= 2;
+    while (ufraw_subarea_count(img->width, img->height, size) > UFRAW_MAX_SUBAREAS)
+        size *= 2;
+    return size;
+}
+
+int ufraw_image_get_subarea_count(ufraw_image_data *img)
+{
+    return ufraw_subarea_count(img->width, img->height,
+                               ufraw_image_get_subarea_size(img));
+}
+
 /* Return the coordinates and the size of given image subarea.
- * There are always 32 subareas, numbered 0 to 31, ordered in a 4x8 matrix.
+ * Subareas are numbered row by row, starting at the top left corner.
+ * The subareas of the last row and column may be smaller.
  */
 UFRectangle ufraw_image_get_subarea_rectangle(ufraw_image_data *img,
         unsigned saidx)
 {
-    int saw = (img->width + 3) / 4;
-    int sah = (img->height + 7) / 8;
-    int sax = saidx % 4;
-    int say = saidx / 4;
+    int size = ufraw_image_get_subarea_size(img);
+    int cols = (img->width + size - 1) / size;
     UFRectangle area;
-    area.x = saw * sax;
-    area.y = sah * say;
-    area.width = (sax < 3) ? saw : (img->width - saw * 3);
-    area.height = (say < 7) ? sah : (img->height - sah * 7);
+    area.x = size * (saidx % cols);
+    area.y = size * (saidx / cols);
+    area.width = MIN(size, img->width - area.x);
+    area.height = MIN(size, img->height - area.y);
     return area;
 }
 
@@ -799,9 +844,205 @@ UFRectangle ufraw_image_get_subarea_rectangle(ufraw_image_data *img,
  */
 unsigned ufraw_img_get_subarea_idx(ufraw_image_data *img, int x, int y)
 {
-    int saw = (img->width + 3) / 4;
-    int sah = (img->height + 7) / 8;
-    return (x / saw) + (y / sah) * 4;
+    int size = ufraw_image_get_subarea_size(img);
+    int cols = (img->width + size - 1) / size;
+    return (x / size) + (y / size) * cols;
+}
+
+gboolean ufraw_image_subarea_is_valid(ufraw_image_data *img, unsigned saidx)
+{
+    return (img->valid[saidx / 32] & (1U << (saidx % 32))) != 0;
+}
+
+#if !GLIB_CHECK_VERSION(2,30,0)
+G_LOCK_DEFINE_STATIC(subarea_bitmap);
+#endif
+
+/* Set or clear the bit of a subarea. The subareas are rendered by
+ * the workers of parallel_for(), which OpenMP does not synchronize. */
+static void ufraw_subarea_bitmap_set(guint32 *bitmap, unsigned saidx,
+                                     gboolean set)
+{
+    guint32 bit = 1U << (saidx % 32);
+#if GLIB_CHECK_VERSION(2,30,0)
+    if (set)
+        g_atomic_int_or((volatile guint *)&bitmap[saidx / 32], bit);
+    else
+        g_atomic_int_and((volatile guint *)&bitmap[saidx / 32], ~bit);
+#else
+    G_LOCK(subarea_bitmap);
+    if (set)
+        bitmap[saidx / 32] |= bit;
+    else
+        bitmap[saidx / 32] &= ~bit;
+    G_UNLOCK(subarea_bitmap);
+#endif
+}
+
+static gboolean ufraw_image_is_valid(ufraw_image_data *img)
+{
+    int i, count = ufraw_image_get_subarea_count(img);
+    for (i = 0; i < count; i++)
+        if (!ufraw_image_subarea_is_valid(img, i))
+            return FALSE;
+    return TRUE;
+}
+
+/* Mark all subareas of the image as valid or invalid. */
+void ufraw_image_set_valid(ufraw_image_data *img, gboolean valid)
+{
+    memset(img->valid, valid ? 0xff : 0, sizeof(img->valid));
+}
+
+void ufraw_histogram_add(ufraw_histogram *his, const guint8 *buffer,
+                         int rowstride, int depth, int width, int height)
+{
+    int x, y, c, min, max;
+    for (y = 0; y < height; y++) {
+        const guint8 *p8 = buffer + y * rowstride;
+        for (x = 0; x < width; x++, p8 += depth) {
+            for (c = 0, max = 0, min = 0x100; c < 3; c++) {
+                max = MAX(max, p8[c]);
+                min = MIN(min, p8[c]);
+                his->count[p8[c]][c]++;
+            }
+            his->count[(int)(0.3 * p8[0] + 0.59 * p8[1] + 0.11 * p8[2])]
+            [ufraw_his_luminosity]++;
+            his->count[max][ufraw_his_value]++;
+            if (max == 0) his->count[0][ufraw_his_saturation]++;
+            else his->count[255 * (max - min) / max][ufraw_his_saturation]++;
+        }
+    }
+}
+
+void ufraw_histogram_merge(ufraw_histogram *dst, const ufraw_histogram *src)
+{
+    int x, c;
+    for (x = 0; x < 256; x++)
+        for (c = 0; c < ufraw_his_channels; c++)
+            dst->count[x][c] += src->count[x][c];
+}
+
+/* Compute the histogram of a freshly developed subarea. */
+static void ufraw_tile_histogram(ufraw_data *uf, unsigned saidx)
+{
+    ufraw_image_data *img = &uf->Images[ufraw_develop_phase];
+    UFRectangle area = ufraw_image_get_subarea_rectangle(img, saidx);
+    ufraw_histogram *his = &uf->tileHistogram[saidx];
+
+    memset(his, 0, sizeof(*his));
+    ufraw_histogram_add(his, img->buffer + area.y * img->rowstride +
+                        area.x * img->depth, img->rowstride, img->depth,
+                        area.width, area.height);
+    ufraw_subarea_bitmap_set(uf->tileHistogramValid, saidx, TRUE);
+}
+
+/* The histograms are summed in bands by parallel_for(), and the bands
+ * are then merged. */
+typedef struct {
+    ufraw_data *uf;
+    UFRectangle Crop;
+    int count;
+    int bands;
+    ufraw_histogram *sum;
+} histogram_job;
+
+static void histogram_job_init(histogram_job *job, ufraw_data *uf, int count)
+{
+    job->uf = uf;
+    ufraw_get_scaled_crop(uf, &job->Crop);
+    job->count = count;
+    job->bands = MIN(2 * parallel_get_max_threads(), count);
+    job->sum = g_new0(ufraw_histogram, MAX(job->bands, 1));
+}
+
+static void histogram_job_merge(histogram_job *job, ufraw_histogram *his)
+{
+    int band;
+    for (band = 0; band < job->bands; band++)
+        ufraw_histogram_merge(his, &job->sum[band]);
+    g_free(job->sum);
+}
+
+static void develop_histogram_task(int band, void *data)
+{
+    histogram_job *job = data;
+    ufraw_data *uf = job->uf;
+    ufraw_image_data *img = &uf->Images[ufraw_develop_phase];
+    UFRectangle Crop = job->Crop;
+    int last = (band + 1) * job->count / job->bands;
+    int i;
+
+    for (i = band * job->count / job->bands; i < last; i++) {
+        UFRectangle area = ufraw_image_get_subarea_rectangle(img, i);
+        int x1 = MAX(area.x, Crop.x);
+        int x2 = MIN(area.x + area.width, Crop.x + Crop.width);
+        int y1 = MAX(area.y, Crop.y);
+        int y2 = MIN(area.y + area.height, Crop.y + Crop.height);
+        if (x1 >= x2 || y1 >= y2)
+            continue;
+        gboolean inside = x2 - x1 == area.width && y2 - y1 == area.height;
+        if (inside && uf->tileHistogram != NULL &&
+                ufraw_image_subarea_is_valid(img, i)) {
+            if ((uf->tileHistogramValid[i / 32] & (1U << (i % 32))) == 0)
+                ufraw_tile_histogram(uf, i);
+            ufraw_histogram_merge(&job->sum[band], &uf->tileHistogram[i]);
+        } else {
+            ufraw_histogram_add(&job->sum[band], img->buffer +
+                                y1 * img->rowstride + x1 * img->depth,
+                                img->rowstride, img->depth, x2 - x1, y2 - y1);
+        }
+    }
+}
+
+/*
+ * The histogram is merged from the subarea histograms. Only subareas that
+ * were developed without their histogram, and those on the crop border,
+ * have to be scanned.
+ */
+void ufraw_develop_histogram(ufraw_data *uf, ufraw_histogram *his)
+{
+    ufraw_image_data *img = &uf->Images[ufraw_develop_phase];
+    histogram_job job;
+
+    memset(his, 0, sizeof(*his));
+    if (img->buffer == NULL)
+        return;
+    histogram_job_init(&job, uf, ufraw_image_get_subarea_count(img));
+    parallel_for(develop_histogram_task, job.bands, &job);
+    histogram_job_merge(&job, his);
+}
+
+static void final_histogram_task(int band, void *data)
+{
+    histogram_job *job = data;
+    ufraw_data *uf = job->uf;
+    int rowStride = uf->Images[ufraw_first_phase].width;
+    ufraw_image_type *rawImage =
+        (ufraw_image_type *)uf->Images[ufraw_first_phase].buffer;
+    UFRectangle Crop = job->Crop;
+    guint8 *rowbuf = g_new(guint8, Crop.width * 3);
+    int last = (band + 1) * job->count / job->bands;
+    int row;
+
+    for (row = band * job->count / job->bands; row < last; row++) {
+        develop(rowbuf, rawImage[(Crop.y + row) * rowStride + Crop.x],
+                uf->developer, 8, Crop.width);
+        ufraw_histogram_add(&job->sum[band], rowbuf, 0, 3, Crop.width, 1);
+    }
+    g_free(rowbuf);
+}
+
+void ufraw_final_histogram(ufraw_data *uf, ufraw_histogram *his)
+{
+    UFRectangle Crop;
+    histogram_job job;
+
+    memset(his, 0, sizeof(*his));
+    ufraw_get_scaled_crop(uf, &Crop);
+    histogram_job_init(&job, uf, Crop.height);
+    parallel_for(final_histogram_task, job.bands, &job);
+    histogram_job_merge(&job, his);
 }
 
 void ufraw_developer_prepare(ufraw_data *uf, DeveloperMode mode)
@@ -835,7 +1076,10 @@ int ufraw_convert_image(ufraw_data *uf)
 {
     uf->mark_hotpixels = FALSE;
     ufraw_developer_prepare(uf, file_developer);
-    ufraw_convert_image_raw(uf, ufraw_raw_phase);
+    // The buffers no longer match the preview stage keys
+    uf->Images[ufraw_raw_phase].key = 0;
+    uf->Images[ufraw_first_phase].key = 0;
+    ufraw_convert_image_raw(uf, ufraw_raw_phase, 1);
 
     ufraw_image_data *img = &uf->Images[ufraw_first_phase];
     ufraw_convert_prepare_first_buffer(uf, img);
@@ -844,7 +1088,8 @@ int ufraw_convert_image(ufraw_data *uf)
     UFRectangle area = { 0, 0, img->width, img->height };
     // prepare_transform has to be called before applying vignetting
     ufraw_image_data *img2 = &uf->Images[ufraw_transform_phase];
-    ufraw_convert_prepare_transform_buffer(uf, img2, img->width, img->height);
+    ufraw_convert_prepare_transform_buffer(uf, img2, img->width, img->height,
+                                           sizeof(ufraw_image_type));
 #ifdef HAVE_LENSFUN
     if (uf->modifier != NULL) {
         ufraw_convert_image_vignetting(uf, img, &area);
@@ -886,6 +1131,8 @@ static void ufraw_convert_image_vignetting(ufraw_data *uf,
 	ufraw_interpolate_pixel_linearly()
 	Interpolate a new pixel value, for one or all colors, from a 2x2 pixel
 	patch around coordinates x and y in the image, and write it to dst.
+	The source image may be in the 8 or in the compact 6 bytes format,
+	dst is a single pixel of the destination format.
 */
 /*
 	Because integer arithmetic is faster than floating point operations,
@@ -894,12 +1141,14 @@ static void ufraw_convert_image_vignetting(ufraw_data *uf,
 */
 #define SCALAR 256
 
-static inline void ufraw_interpolate_pixel_linearly(ufraw_image_data *image, float x, float y, ufraw_image_type *dst, int color)
+static inline void ufraw_interpolate_pixel_linearly(ufraw_image_data *image, float x, float y, guint16 *dst, int color)
 {
 
     int i, j, c, cmax, xx, yy;
     unsigned int dx, dy, v, weights[2][2];
-    ufraw_image_type *src;
+    const int pd = image->depth / 2;
+    const int rd = image->rowstride / 2;
+    guint16 *src;
 
     /*
     	When casting a float to an integer it will be rounded toward zero,
@@ -928,7 +1177,7 @@ static inline void ufraw_interpolate_pixel_linearly(ufraw_image_data *image, flo
     xx -= 2;
     yy -= 2;
 
-    src = (ufraw_image_type *)image->buffer + yy * image->width + xx;
+    src = (guint16 *)image->buffer + yy * rd + xx * pd;
 
     /* If an existing color number is given, then only that color will be interpolated, else all will be. */
     if (color < 0 || color >= (3 + (image->rgbg == TRUE)))
@@ -945,9 +1194,9 @@ static inline void ufraw_interpolate_pixel_linearly(ufraw_image_data *image, flo
 
             for (i = 0 ; i < 2 ; i++)
                 for (j = 0 ; j < 2 ; j++)
-                    v += weights[i][j] * src[i * image->width + j][c];
+                    v += weights[i][j] * src[i * rd + j * pd + c];
 
-            dst[0][c] =  v / (SCALAR * SCALAR);
+            dst[c] =  v / (SCALAR * SCALAR);
         }
 
     } else { /* Near a border. */
@@ -960,9 +1209,9 @@ static inline void ufraw_interpolate_pixel_linearly(ufraw_image_data *image, flo
                 for (j = 0 ; j < 2 ; j++)
                     /* Check if the source pixel lies inside the image */
                     if (xx + j >= 0 && yy + i >= 0 && xx + j < image->width && yy + i < image->height)
-                        v += weights[i][j] * src[i * image->width + j][c];
+                        v += weights[i][j] * src[i * rd + j * pd + c];
 
-            dst[0][c] =  v / (SCALAR * SCALAR);
+            dst[c] =  v / (SCALAR * SCALAR);
         }
     }
 }
@@ -1007,7 +1256,7 @@ static void ufraw_convert_image_transform(ufraw_data *uf, ufraw_image_data *img,
                 srcY = buff[1];
             }
 #endif
-            ufraw_interpolate_pixel_linearly(img, srcX, srcY, (ufraw_image_type *)cur, -1);
+            ufraw_interpolate_pixel_linearly(img, srcX, srcY, cur, -1);
         }
     }
 }
@@ -1019,33 +1268,34 @@ static void ufraw_convert_image_transform(ufraw_data *uf, ufraw_image_data *img,
  *
  * Reasonable values for uf->conf->hotpixel are in the range 0.5-10.
  *
- * Note that the algorithm uses pixel values from previous (processed) and
- * next (unprocessed) row and whether or not pixels are marked may make a
- * difference for the hot pixel count.
+ * The hot pixels are first found in the untouched image and only then
+ * replaced, so the result does not depend on the order of the rows.
+ * With --hotpixel-map the pixels found are kept in a file, and later
+ * images of the same camera only replace them without searching again.
  *
  * Cleanup issue:
  * -	change prototype to void x(ufraw_data *uf, UFRawPhase phase)
  * -	use ufraw_image_format()
  * -	use uf->rgbMax (check, must be about 64k)
  */
-static void ufraw_shave_hotpixels(ufraw_data *uf, dcraw_image_type *img,
-                                  int width, int height, int colors,
-                                  unsigned rgbMax)
+typedef struct {
+    int x, y, color;
+} ufraw_hotpixel;
+
+static GArray *ufraw_find_hotpixels(dcraw_image_type *img, int width,
+                                    int height, int colors, unsigned delta)
 {
-    int w, h, c, i, count;
-    unsigned delta, t, v, hi;
+    GArray **rows = g_new0(GArray *, height);
+    GArray *pixels = g_array_new(FALSE, FALSE, sizeof(ufraw_hotpixel));
+    ufraw_hotpixel hot;
+    int w, h, c;
+    unsigned t;
     dcraw_image_type *p;
 
-    uf->hotpixels = 0;
-    if (uf->conf->hotpixel <= 0.0)
-        return;
-    delta = rgbMax / (uf->conf->hotpixel + 1.0);
-    count = 0;
 #ifdef _OPENMP
     #pragma omp parallel for schedule(static) default(none) \
-    shared(uf,img,width,height,colors,rgbMax,delta) \
-reduction(+:count) \
-    private(h,p,w,c,t,v,hi,i)
+    shared(img,width,height,colors,delta,rows) \
+    private(h,p,w,c,t,hot)
 #endif
     for (h = 1; h < height - 1; ++h) {
         p = img + 1 + h * width;
@@ -1055,38 +1305,239 @@ reduction(+:count) \
                 if (t <= delta)
                     continue;
                 t -= delta;
-                v = p[-1][c];
-                if (v > t)
+                if (p[-1][c] > t || p[1][c] > t ||
+                        p[-width][c] > t || p[width][c] > t)
                     continue;
-                hi = v;
-                v = p[1][c];
-                if (v > t)
-                    continue;
-                if (v > hi)
-                    hi = v;
-                v = p[-width][c];
-                if (v > t)
-                    continue;
-                if (v > hi)
-                    hi = v;
-                v = p[width][c];
-                if (v > t)
-                    continue;
-                if (v > hi)
-                    hi = v;
-                /* mark the pixel using the original hot value */
-                if (uf->mark_hotpixels) {
-                    for (i = -10; i >= -20 && w + i >= 0; --i)
-                        memcpy(p[i], p[0], sizeof(p[i]));
-                    for (i = 10; i <= 20 && w + i < width; ++i)
-                        memcpy(p[i], p[0], sizeof(p[i]));
-                }
-                p[0][c] = hi;
-                ++count;
+                if (rows[h] == NULL)
+                    rows[h] = g_array_new(FALSE, FALSE, sizeof(ufraw_hotpixel));
+                hot.x = w;
+                hot.y = h;
+                hot.color = c;
+                g_array_append_val(rows[h], hot);
             }
         }
     }
-    uf->hotpixels = count;
+    for (h = 0; h < height; ++h) {
+        if (rows[h] == NULL)
+            continue;
+        g_array_append_vals(pixels, rows[h]->data, rows[h]->len);
+        g_array_free(rows[h], TRUE);
+    }
+    g_free(rows);
+    return pixels;
+}
+
+static void ufraw_patch_hotpixels(ufraw_data *uf, dcraw_image_type *img,
+                                  int width, GArray *pixels)
+{
+    unsigned hi;
+    guint n;
+    int i, c;
+    dcraw_image_type *p;
+
+    for (n = 0; n < pixels->len; ++n) {
+        ufraw_hotpixel *hot = &g_array_index(pixels, ufraw_hotpixel, n);
+        p = img + hot->y * width + hot->x;
+        c = hot->color;
+        hi = MAX(MAX(p[-1][c], p[1][c]), MAX(p[-width][c], p[width][c]));
+        /* mark the pixel using the original hot value */
+        if (uf->mark_hotpixels) {
+            for (i = -10; i >= -20 && hot->x + i >= 0; --i)
+                memcpy(p[i], p[0], sizeof(p[i]));
+            for (i = 10; i <= 20 && hot->x + i < width; ++i)
+                memcpy(p[i], p[0], sizeof(p[i]));
+        }
+        p[0][c] = hi;
+    }
+}
+
+/* The last hot pixel map used, shared by all the images of a batch. */
+typedef struct {
+    char *path;
+    char *camera;
+    int width, height, colors;
+    double sensitivity;
+    GArray *pixels;
+} ufraw_hotpixel_map;
+
+static ufraw_hotpixel_map HotpixelMap = { NULL, NULL, 0, 0, 0, 0.0, NULL };
+G_LOCK_DEFINE_STATIC(hotpixel_map);
+
+static void ufraw_hotpixel_map_clear(ufraw_hotpixel_map *map)
+{
+    g_free(map->path);
+    g_free(map->camera);
+    if (map->pixels != NULL)
+        g_array_free(map->pixels, TRUE);
+    memset(map, 0, sizeof(*map));
+}
+
+static gboolean ufraw_hotpixel_map_read(ufraw_hotpixel_map *map,
+                                        const char *path)
+{
+    GKeyFile *keyFile = g_key_file_new();
+    GError *err = NULL;
+    gint *list = NULL;
+    gsize length = 0, i;
+
+    if (!g_key_file_load_from_file(keyFile, path, G_KEY_FILE_NONE, &err)) {
+        /* A missing map is created by the first image */
+        if (!g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            ufraw_message(UFRAW_WARNING, _("Error reading hot pixel map '%s'\n%s"),
+                          path, err->message);
+        g_error_free(err);
+        g_key_file_free(keyFile);
+        return FALSE;
+    }
+    map->camera = g_key_file_get_string(keyFile, "Hotpixels", "Camera", &err);
+    if (err == NULL)
+        map->width = g_key_file_get_integer(keyFile, "Hotpixels", "Width", &err);
+    if (err == NULL)
+        map->height = g_key_file_get_integer(keyFile, "Hotpixels", "Height", &err);
+    if (err == NULL)
+        map->colors = g_key_file_get_integer(keyFile, "Hotpixels", "Colors", &err);
+    if (err == NULL)
+        map->sensitivity = g_key_file_get_double(keyFile, "Hotpixels",
+                           "Sensitivity", &err);
+    if (err == NULL && g_key_file_has_key(keyFile, "Hotpixels", "Pixels", NULL))
+        list = g_key_file_get_integer_list(keyFile, "Hotpixels", "Pixels",
+                                           &length, &err);
+    g_key_file_free(keyFile);
+    if (err != NULL || length % 3 != 0) {
+        ufraw_message(UFRAW_WARNING, _("Error parsing hot pixel map '%s'\n%s"),
+                      path, err != NULL ? err->message :
+                      _("The pixels are not x,y,color triples"));
+        if (err != NULL)
+            g_error_free(err);
+        g_free(list);
+        ufraw_hotpixel_map_clear(map);
+        return FALSE;
+    }
+    map->path = g_strdup(path);
+    map->pixels = g_array_new(FALSE, FALSE, sizeof(ufraw_hotpixel));
+    for (i = 0; i < length; i += 3) {
+        ufraw_hotpixel hot = { list[i], list[i + 1], list[i + 2] };
+        /* Border pixels are never hot */
+        if (hot.x < 1 || hot.x >= map->width - 1 ||
+                hot.y < 1 || hot.y >= map->height - 1 ||
+                hot.color < 0 || hot.color >= map->colors)
+            continue;
+        g_array_append_val(map->pixels, hot);
+    }
+    g_free(list);
+    return TRUE;
+}
+
+static void ufraw_hotpixel_map_write(const ufraw_hotpixel_map *map)
+{
+    GKeyFile *keyFile = g_key_file_new();
+    GError *err = NULL;
+    gint *list = g_new(gint, 3 * map->pixels->len + 1);
+    guint n;
+    gchar *data;
+    gsize length;
+
+    for (n = 0; n < map->pixels->len; ++n) {
+        ufraw_hotpixel *hot = &g_array_index(map->pixels, ufraw_hotpixel, n);
+        list[3 * n] = hot->x;
+        list[3 * n + 1] = hot->y;
+        list[3 * n + 2] = hot->color;
+    }
+    g_key_file_set_comment(keyFile, NULL, NULL,
+                           " UFRaw hot pixel map, the pixels are x,y,color", NULL);
+    g_key_file_set_string(keyFile, "Hotpixels", "Camera", map->camera);
+    g_key_file_set_integer(keyFile, "Hotpixels", "Width", map->width);
+    g_key_file_set_integer(keyFile, "Hotpixels", "Height", map->height);
+    g_key_file_set_integer(keyFile, "Hotpixels", "Colors", map->colors);
+    g_key_file_set_double(keyFile, "Hotpixels", "Sensitivity", map->sensitivity);
+    g_key_file_set_integer_list(keyFile, "Hotpixels", "Pixels", list,
+                                3 * map->pixels->len);
+    g_free(list);
+    data = g_key_file_to_data(keyFile, &length, NULL);
+    g_key_file_free(keyFile);
+    if (!g_file_set_contents(map->path, data, length, &err)) {
+        ufraw_message(UFRAW_WARNING, _("Error writing hot pixel map '%s'\n%s"),
+                      map->path, err->message);
+        g_error_free(err);
+    }
+    g_free(data);
+}
+
+static gboolean ufraw_hotpixel_map_matches(const ufraw_hotpixel_map *map,
+        const char *path, const char *camera, int width, int height,
+        int colors, double sensitivity)
+{
+    return map->path != NULL && strcmp(map->path, path) == 0 &&
+           strcmp(map->camera, camera) == 0 &&
+           map->width == width && map->height == height &&
+           map->colors == colors && map->sensitivity == sensitivity;
+}
+
+/* Return a copy of the hot pixels of a matching map, or NULL */
+static GArray *ufraw_hotpixel_map_lookup(ufraw_data *uf, int width,
+        int height, int colors)
+{
+    const char *path = uf->conf->hotpixelMap;
+    char *camera = g_strdup_printf("%s %s", uf->conf->make, uf->conf->model);
+    GArray *pixels = NULL;
+
+    G_LOCK(hotpixel_map);
+    if (HotpixelMap.path == NULL || strcmp(HotpixelMap.path, path) != 0) {
+        ufraw_hotpixel_map_clear(&HotpixelMap);
+        ufraw_hotpixel_map_read(&HotpixelMap, path);
+    }
+    if (ufraw_hotpixel_map_matches(&HotpixelMap, path, camera, width, height,
+                                   colors, uf->conf->hotpixel)) {
+        pixels = g_array_sized_new(FALSE, FALSE, sizeof(ufraw_hotpixel),
+                                   HotpixelMap.pixels->len);
+        g_array_append_vals(pixels, HotpixelMap.pixels->data,
+                            HotpixelMap.pixels->len);
+    }
+    G_UNLOCK(hotpixel_map);
+    g_free(camera);
+    return pixels;
+}
+
+static void ufraw_hotpixel_map_store(ufraw_data *uf, int width, int height,
+                                     int colors, GArray *pixels)
+{
+    G_LOCK(hotpixel_map);
+    ufraw_hotpixel_map_clear(&HotpixelMap);
+    HotpixelMap.path = g_strdup(uf->conf->hotpixelMap);
+    HotpixelMap.camera = g_strdup_printf("%s %s", uf->conf->make,
+                                         uf->conf->model);
+    HotpixelMap.width = width;
+    HotpixelMap.height = height;
+    HotpixelMap.colors = colors;
+    HotpixelMap.sensitivity = uf->conf->hotpixel;
+    HotpixelMap.pixels = g_array_sized_new(FALSE, FALSE,
+                                           sizeof(ufraw_hotpixel), pixels->len);
+    g_array_append_vals(HotpixelMap.pixels, pixels->data, pixels->len);
+    ufraw_hotpixel_map_write(&HotpixelMap);
+    G_UNLOCK(hotpixel_map);
+}
+
+static void ufraw_shave_hotpixels(ufraw_data *uf, dcraw_image_type *img,
+                                  int width, int height, int colors,
+                                  unsigned rgbMax)
+{
+    gboolean useMap = strlen(uf->conf->hotpixelMap) > 0;
+    GArray *pixels = NULL;
+
+    uf->hotpixels = 0;
+    if (uf->conf->hotpixel <= 0.0)
+        return;
+    if (useMap)
+        pixels = ufraw_hotpixel_map_lookup(uf, width, height, colors);
+    if (pixels == NULL) {
+        unsigned delta = rgbMax / (uf->conf->hotpixel + 1.0);
+        pixels = ufraw_find_hotpixels(img, width, height, colors, delta);
+        if (useMap)
+            ufraw_hotpixel_map_store(uf, width, height, colors, pixels);
+    }
+    ufraw_patch_hotpixels(uf, img, width, pixels);
+    uf->hotpixels = pixels->len;
+    g_array_free(pixels, TRUE);
 }
 
 static void ufraw_despeckle_line(guint16 *base, int step, int size, int window,
@@ -1167,6 +1618,8 @@ void ufraw_despeckle(ufraw_data *uf, UFRawPhase phase)
     for (pass = maxpass - 1; pass >= 0; --pass) {
         for (c = 0; c < colors; ++c) {
             progress(PROGRESS_DESPECKLE, 1);
+            if (cancelled())
+                return;
             if (pass >= passes[c])
                 continue;
 #ifdef _OPENMP
@@ -1232,26 +1685,14 @@ static int ufraw_calculate_scale(ufraw_data *uf)
     return scale;
 }
 
-// Any change to ufraw_convertshrink() that might change the final image
-// dimensions should also be applied to ufraw_convert_prepare_first_buffer().
-static void ufraw_convertshrink(ufraw_data *uf, dcraw_image_data *final)
+/* The size that the shrunk and stretched image, whose larger dimension
+ * is maxDim, should be resized to. */
+static int ufraw_convertshrink_size(ufraw_data *uf, int scale, int maxDim)
 {
-    dcraw_data *raw = uf->raw;
-    int scale = ufraw_calculate_scale(uf);
-
-    if (uf->HaveFilters && scale == 1)
-        dcraw_finalize_interpolate(final, raw, uf->conf->interpolation,
-                                   uf->conf->smoothing);
-    else
-        dcraw_finalize_shrink(final, raw, scale);
-
-    dcraw_image_stretch(final, raw->pixel_aspect);
-    if (uf->conf->size == 0 && uf->conf->shrink > 1) {
-        dcraw_image_resize(final,
-                           scale * MAX(final->height, final->width) / uf->conf->shrink);
-    }
+    if (uf->conf->size == 0 && uf->conf->shrink > 1)
+        return scale * maxDim / uf->conf->shrink;
     if (uf->conf->size > 0) {
-        int finalSize = scale * MAX(final->height, final->width);
+        int finalSize = scale * maxDim;
         int cropSize;
         if (uf->conf->CropX1 == -1) {
             cropSize = finalSize;
@@ -1269,9 +1710,115 @@ static void ufraw_convertshrink(ufraw_data *uf, dcraw_image_data *final)
             /* uf->conf->size holds the size of the cropped image.
              * We need to calculate from it the desired size of
              * the uncropped image. */
-            dcraw_image_resize(final, uf->conf->size * finalSize / cropSize);
+            return uf->conf->size * finalSize / cropSize;
+        }
+    }
+    return maxDim;
+}
+
+// Any change to ufraw_convertshrink() that might change the final image
+// dimensions should also be applied to ufraw_convert_prepare_first_buffer().
+// 'raw' is either uf->raw or a proxy binned by 'level', see ufraw_proxy_raw().
+// The final image is also flipped to the configured orientation.
+static void ufraw_convertshrink(ufraw_data *uf, dcraw_image_data *final,
+                                dcraw_data *raw, int level)
+{
+    int scale = ufraw_calculate_scale(uf);
+    gboolean interpolate = uf->HaveFilters && scale == 1;
+    int height, width, size;
+
+    dcraw_image_dimensions(raw, 0, interpolate ? 1 : scale / level,
+                           &height, &width);
+    size = ufraw_convertshrink_size(uf, scale, MAX(height, width));
+
+    // Without interpolation or resizing, a single pass does it all
+    if (!interpolate && size == MAX(height, width)) {
+        dcraw_finalize_shrink_flip(final, raw, scale / level,
+                                   uf->conf->orientation);
+        return;
+    }
+    if (interpolate)
+        dcraw_finalize_interpolate(final, raw, uf->conf->interpolation,
+                                   uf->conf->smoothing);
+    else
+        dcraw_finalize_shrink(final, raw, scale / level);
+
+    dcraw_image_stretch(final, raw->pixel_aspect);
+    if (size != MAX(height, width))
+        dcraw_image_resize(final, size);
+    dcraw_flip_image(final, uf->conf->orientation);
+}
+
+/*
+ * The preview shrinks Bayer images by box averaging the half-size raw image
+ * (see dcraw_finalize_shrink()). When the shrink factor allows it, the
+ * raw phase can therefore work on a binned copy of the raw image and
+ * produce practically the same first phase image at a fraction of the cost.
+ * Return the binning factor to use for the current settings, or 1 if the
+ * raw phase must run at full resolution.
+ */
+static int ufraw_proxy_level(ufraw_data *uf)
+{
+    dcraw_data *raw = uf->raw;
+
+    // Hot pixels, dark frames and despeckling work on single raw pixels
+    if (!uf->HaveFilters || uf->IsXTrans || raw->filters <= 1000 ||
+            raw->fuji_width != 0 || uf->conf->darkframe != NULL ||
+            uf->conf->hotpixel > 0.0 || ufraw_despeckle_active(uf))
+        return 1;
+    int scale = ufraw_calculate_scale(uf);
+    int level;
+    for (level = 1 << UFRAW_PROXY_LEVELS; level > 1; level /= 2)
+        if (scale % (2 * level) == 0)
+            return level;
+    return 1;
+}
+
+static dcraw_image_type *ufraw_bin_raw(dcraw_image_data *raw, int level)
+{
+    int width = (raw->width + level - 1) / level;
+    int height = (raw->height + level - 1) / level;
+    dcraw_image_type *image = g_new(dcraw_image_type, width * height);
+    int row;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) default(none) \
+    shared(raw,level,width,height,image)
+#endif
+    for (row = 0; row < height; row++) {
+        int col, r, c, cl;
+        int rowEnd = MIN((row + 1) * level, raw->height);
+        for (col = 0; col < width; col++) {
+            int colEnd = MIN((col + 1) * level, raw->width);
+            guint32 sum[4] = { 0, 0, 0, 0 };
+            int count = (rowEnd - row * level) * (colEnd - col * level);
+            for (r = row * level; r < rowEnd; r++)
+                for (c = col * level; c < colEnd; c++)
+                    for (cl = 0; cl < 4; cl++)
+                        sum[cl] += raw->image[r * raw->width + c][cl];
+            for (cl = 0; cl < 4; cl++)
+                image[row * width + col][cl] = (sum[cl] + count / 2) / count;
         }
     }
+    return image;
+}
+
+/* Set up 'proxy' as a copy of the raw data binned by 'level'. The binned
+ * images are built on first use and kept until ufraw_close(). */
+static void ufraw_proxy_raw(ufraw_data *uf, int level, dcraw_data *proxy)
+{
+    dcraw_data *raw = uf->raw;
+    int i = g_bit_storage(level) - 2;
+
+    *proxy = *raw;
+    if (uf->rawProxy[i] == NULL)
+        uf->rawProxy[i] = ufraw_bin_raw(&raw->raw, level);
+    proxy->raw.image = uf->rawProxy[i];
+    proxy->raw.width = (raw->raw.width + level - 1) / level;
+    proxy->raw.height = (raw->raw.height + level - 1) / level;
+    // The sensor dimensions matching the binned image. They are chosen so
+    // that dcraw_finalize_shrink() produces the usual output dimensions.
+    proxy->width = raw->width / level;
+    proxy->height = raw->height / level;
 }
 
 /*
@@ -1279,21 +1826,29 @@ static void ufraw_convertshrink(ufraw_data *uf, dcraw_image_data *final)
  * dcraw_wavelet_denoise() too should change to accept a phase argument and
  * no longer require type casts.
  */
-static void ufraw_convert_image_raw(ufraw_data *uf, UFRawPhase phase)
+static void ufraw_convert_image_raw(ufraw_data *uf, UFRawPhase phase,
+                                    int level)
 {
     ufraw_image_data *img = &uf->Images[phase];
     dcraw_data *dark = uf->conf->darkframe ? uf->conf->darkframe->raw : NULL;
     dcraw_data *raw = uf->raw;
+    dcraw_data proxy;
     dcraw_image_type *rawimage;
 
+    if (level > 1) {
+        ufraw_proxy_raw(uf, level, &proxy);
+        raw = &proxy;
+    }
+    uf->proxyLevel = level;
     ufraw_convert_import_buffer(uf, phase, &raw->raw);
     img->rgbg = raw->raw.colors == 4;
     ufraw_shave_hotpixels(uf, (dcraw_image_type *)(img->buffer), img->width,
                           img->height, raw->raw.colors, raw->rgbMax);
     rawimage = raw->raw.image;
     raw->raw.image = (dcraw_image_type *)img->buffer;
-    /* The threshold is scaled for compatibility */
-    if (!uf->IsXTrans) dcraw_wavelet_denoise(raw, uf->conf->threshold * sqrt(uf->raw_multiplier));
+    /* The threshold is scaled for compatibility.
+     * Binning already reduced the noise by the binning factor. */
+    if (!uf->IsXTrans) dcraw_wavelet_denoise(raw, uf->conf->threshold * sqrt(uf->raw_multiplier) / level);
     dcraw_finalize_raw(raw, dark, uf->developer->rgbWB);
     raw->raw.image = rawimage;
     ufraw_despeckle(uf, phase);
@@ -1301,16 +1856,17 @@ static void ufraw_convert_image_raw(ufraw_data *uf, UFRawPhase phase)
     ufraw_prepare_tca(uf);
     if (uf->TCAmodifier != NULL) {
         ufraw_image_data inImg = *img;
-        img->buffer = g_malloc(img->height * img->rowstride);
+        gsize size = (gsize)img->height * img->rowstride;
+        img->buffer = ufraw_buffer_pool_alloc(uf->pool, size);
         UFRectangle area = {0, 0, img->width, img->height };
         ufraw_convert_image_tca(uf, &inImg, img, &area);
-        g_free(inImg.buffer);
+        ufraw_buffer_pool_release(uf->pool, inImg.buffer, size);
     }
 #endif
 }
 
 /*
- * Interface of ufraw_convertshrink() and dcraw_flip_image() should change
+ * Interface of ufraw_convertshrink() should change
  * to accept a phase argument and no longer require type casts.
  */
 static void ufraw_convert_image_first(ufraw_data *uf, UFRawPhase phase)
@@ -1318,15 +1874,19 @@ static void ufraw_convert_image_first(ufraw_data *uf, UFRawPhase phase)
     ufraw_image_data *in = &uf->Images[phase - 1];
     ufraw_image_data *out = &uf->Images[phase];
     dcraw_data *raw = uf->raw;
+    dcraw_data proxy;
 
+    if (uf->proxyLevel > 1) {
+        ufraw_proxy_raw(uf, uf->proxyLevel, &proxy);
+        raw = &proxy;
+    }
     dcraw_image_data final;
     final.image = (ufraw_image_type *)out->buffer;
 
     dcraw_image_type *rawimage = raw->raw.image;
     raw->raw.image = (dcraw_image_type *)in->buffer;
-    ufraw_convertshrink(uf, &final);
+    ufraw_convertshrink(uf, &final, raw, uf->proxyLevel);
     raw->raw.image = rawimage;
-    dcraw_flip_image(&final, uf->conf->orientation);
     /* The threshold is scaled for compatibility */
     if (uf->IsXTrans) dcraw_wavelet_denoise_shrinked(&final, uf->conf->threshold * sqrt(uf->raw_multiplier));
 
@@ -1407,7 +1967,7 @@ static void ufraw_convert_image_tca(ufraw_data *uf, ufraw_image_data *img,
             int c;
             // Only red and blue channels get corrected
             for (c = 0; c <= 2; c += 2, modcoord += 4)
-                ufraw_interpolate_pixel_linearly(img, modcoord[0], modcoord[1], (ufraw_image_type *)dst, c);
+                ufraw_interpolate_pixel_linearly(img, modcoord[0], modcoord[1], dst, c);
 
             modcoord -= 2;
             // Green channels are intact
@@ -1423,27 +1983,33 @@ static void ufraw_convert_import_buffer(ufraw_data *uf, UFRawPhase phase,
 {
     ufraw_image_data *img = &uf->Images[phase];
 
+    ufraw_buffer_pool_release(uf->pool, img->buffer,
+                              (gsize)img->height * img->rowstride);
     img->height = dcimg->height;
     img->width = dcimg->width;
     img->depth = sizeof(dcraw_image_type);
     img->rowstride = img->width * img->depth;
-    g_free(img->buffer);
-    img->buffer = g_memdup(dcimg->image, img->height * img->rowstride);
+    gsize size = (gsize)img->height * img->rowstride;
+    img->buffer = ufraw_buffer_pool_alloc(uf->pool, size);
+    memcpy(img->buffer, dcimg->image, size);
 }
 
-static void ufraw_image_init(ufraw_image_data *img,
+static void ufraw_image_init(ufraw_data *uf, ufraw_image_data *img,
                              int width, int height, int bitdepth)
 {
     if (img->height == height && img->width == width &&
             img->depth == bitdepth && img->buffer != NULL)
         return;
 
-    img->valid = 0;
+    ufraw_buffer_pool_release(uf->pool, img->buffer,
+                              (gsize)img->height * img->rowstride);
+    ufraw_image_set_valid(img, FALSE);
     img->height = height;
     img->width = width;
     img->depth = bitdepth;
     img->rowstride = img->width * img->depth;
-    img->buffer = g_realloc(img->buffer, img->height * img->rowstride);
+    img->buffer = ufraw_buffer_pool_alloc(uf->pool,
+                                          (gsize)img->height * img->rowstride);
 }
 
 static void ufraw_convert_prepare_first_buffer(ufraw_data *uf,
@@ -1493,8 +2059,14 @@ void ufraw_convert_prepare_transform(ufraw_data *uf,
                                      float scale);
 #endif
 
+/*
+ * The transform phase only feeds the develop phase in the preview, so
+ * there it uses the compact 3 channel format when the fourth channel is
+ * unused. The saved image keeps the 8 bytes format of the first phase,
+ * which the writers expect.
+ */
 static void ufraw_convert_prepare_transform_buffer(ufraw_data *uf,
-        ufraw_image_data *img, int width, int height)
+        ufraw_image_data *img, int width, int height, int depth)
 {
     const int iWidth = uf->initialWidth;
     const int iHeight = uf->initialHeight;
@@ -1511,7 +2083,8 @@ static void ufraw_convert_prepare_transform_buffer(ufraw_data *uf,
 #else
     if (uf->conf->rotationAngle == 0) {
 #endif
-        g_free(img->buffer);
+        ufraw_buffer_pool_release(uf->pool, img->buffer,
+                                  (gsize)img->height * img->rowstride);
         img->buffer = NULL;
         img->width = width;
         img->height = height;
@@ -1592,7 +2165,7 @@ static void ufraw_convert_prepare_transform_buffer(ufraw_data *uf,
 
     int newWidth = uf->rotatedWidth * width / iWidth;
     int newHeight = uf->rotatedHeight * height / iHeight;
-    ufraw_image_init(img, newWidth, newHeight, 8);
+    ufraw_image_init(uf, img, newWidth, newHeight, depth);
 #ifdef HAVE_LENSFUN
     ufraw_convert_prepare_transform(uf, width, height, FALSE, scale);
 #endif
@@ -1622,19 +2195,24 @@ static void ufraw_convert_prepare_buffers(ufraw_data *uf, UFRawPhase phase)
             ufraw_convert_prepare_first_buffer(uf, img);
             return;
         case ufraw_transform_phase:
-            ufraw_convert_prepare_transform_buffer(uf, img, width, height);
+            ufraw_convert_prepare_transform_buffer(uf, img, width, height,
+                                                   uf->colors <= 3 ? 6 : 8);
             return;
         case ufraw_develop_phase:
-            ufraw_image_init(img, width, height, 3);
+            ufraw_image_init(uf, img, width, height, 3);
+            uf->tileHistogram = g_renew(ufraw_histogram, uf->tileHistogram,
+                                        ufraw_image_get_subarea_count(img));
+            memset(uf->tileHistogramValid, 0, sizeof(uf->tileHistogramValid));
             return;
         case ufraw_display_phase:
             if (uf->developer->working2displayTransform == NULL) {
-                g_free(img->buffer);
+                ufraw_buffer_pool_release(uf->pool, img->buffer,
+                                          (gsize)img->height * img->rowstride);
                 img->buffer = NULL;
                 img->width = width;
                 img->height = height;
             } else {
-                ufraw_image_init(img, width, height, 3);
+                ufraw_image_init(uf, img, width, height, 3);
             }
             return;
         default:
@@ -1682,6 +2260,209 @@ static void ufraw_image_format(int *colors, int *bytes, ufraw_image_data *img,
         *bytes = b;
 }
 
+/*
+ * The untiled phases are expensive, so each of them is tagged with a hash
+ * of all the parameters it reads. Together these hashes form the
+ * dependency graph of the phases: the first phase key includes the raw
+ * phase key, which includes the raw parameters. An invalidated phase
+ * whose key did not change keeps its buffer, and recently computed
+ * results are kept in a small LRU cache, so that toggling a setting back
+ * and forth does not recompute anything.
+ */
+#define UFRAW_STAGE_CACHE_SIZE 6
+/* Memory limit of the stage cache in MB */
+#define UFRAW_STAGE_CACHE_LIMIT 512
+
+typedef struct {
+    guint64 key;
+    guint8 *buffer;
+    int height, width, depth, rowstride;
+    gboolean rgbg;
+    int proxyLevel, hotpixels;
+    guint64 used;
+} ufraw_stage;
+
+struct _ufraw_stage_cache {
+    ufraw_stage stage[UFRAW_STAGE_CACHE_SIZE];
+    guint64 clock;
+};
+
+static guint64 ufraw_hash(guint64 hash, const void *data, gsize size)
+{
+    // 64 bit FNV-1a
+    const guint8 *p = data;
+    gsize i;
+    for (i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= G_GUINT64_CONSTANT(0x100000001b3);
+    }
+    return hash;
+}
+#define UFRAW_HASH(hash, value) ufraw_hash(hash, &(value), sizeof(value))
+
+static guint64 ufraw_stage_key(ufraw_data *uf, UFRawPhase phase, int level)
+{
+    conf_data *conf = uf->conf;
+    guint64 key = G_GUINT64_CONSTANT(0xcbf29ce484222325);
+    gboolean dark = conf->darkframe != NULL;
+
+    /* Raw phase parameters */
+    key = UFRAW_HASH(key, level);
+    key = UFRAW_HASH(key, uf->developer->rgbWB);
+    key = UFRAW_HASH(key, conf->threshold);
+    key = UFRAW_HASH(key, conf->hotpixel);
+    key = UFRAW_HASH(key, uf->mark_hotpixels);
+    key = UFRAW_HASH(key, dark);
+    if (dark)
+        key = ufraw_hash(key, conf->darkframeFile, strlen(conf->darkframeFile));
+    key = UFRAW_HASH(key, conf->despeckleWindow);
+    key = UFRAW_HASH(key, conf->despeckleDecay);
+    key = UFRAW_HASH(key, conf->despecklePasses);
+#ifdef HAVE_LENSFUN
+    // TCA in the raw phase, vignetting in the first phase
+    char *xml = ufobject_xml(ufgroup_element(conf->ufobject, ufLensfun), "");
+    key = ufraw_hash(key, xml, strlen(xml));
+    g_free(xml);
+#endif
+    if (phase == ufraw_raw_phase)
+        return key != 0 ? key : 1;
+
+    /* First phase parameters */
+    int scale = ufraw_calculate_scale(uf);
+    key = UFRAW_HASH(key, scale);
+    key = UFRAW_HASH(key, conf->interpolation);
+    key = UFRAW_HASH(key, conf->smoothing);
+    key = UFRAW_HASH(key, conf->orientation);
+    key = UFRAW_HASH(key, conf->shrink);
+    key = UFRAW_HASH(key, conf->size);
+    if (conf->size > 0) {
+        key = UFRAW_HASH(key, conf->CropX1);
+        key = UFRAW_HASH(key, conf->CropX2);
+        key = UFRAW_HASH(key, conf->CropY1);
+        key = UFRAW_HASH(key, conf->CropY2);
+    }
+    return key != 0 ? key : 1;
+}
+
+static void ufraw_stage_cache_destroy(ufraw_data *uf)
+{
+    if (uf->stageCache == NULL)
+        return;
+    int i;
+    for (i = 0; i < UFRAW_STAGE_CACHE_SIZE; i++)
+        g_free(uf->stageCache->stage[i].buffer);
+    g_free(uf->stageCache);
+    uf->stageCache = NULL;
+}
+
+/* Keep a copy of the freshly computed phase image in the stage cache. */
+static void ufraw_stage_store(ufraw_data *uf, UFRawPhase phase, guint64 key)
+{
+    ufraw_image_data *img = &uf->Images[phase];
+    gsize size = (gsize)img->height * img->rowstride;
+    gsize total = size;
+    ufraw_stage *victim = NULL;
+    int i;
+
+    img->key = key;
+    if (size > (gsize)UFRAW_STAGE_CACHE_LIMIT << 20)
+        return;
+    if (uf->stageCache == NULL)
+        uf->stageCache = g_new0(struct _ufraw_stage_cache, 1);
+    ufraw_stage *stage = uf->stageCache->stage;
+    for (i = 0; i < UFRAW_STAGE_CACHE_SIZE; i++) {
+        if (stage[i].key == key)
+            return; // Already cached
+        total += (gsize)stage[i].height * stage[i].rowstride;
+        if (victim == NULL || stage[i].used < victim->used)
+            victim = &stage[i];
+    }
+    // Evict the least recently used entries until the new one fits
+    while (victim->buffer != NULL) {
+        total -= (gsize)victim->height * victim->rowstride;
+        g_free(victim->buffer);
+        victim->buffer = NULL;
+        victim->key = 0;
+        victim->height = victim->rowstride = 0;
+        if (total <= (gsize)UFRAW_STAGE_CACHE_LIMIT << 20)
+            break;
+        for (i = 0; i < UFRAW_STAGE_CACHE_SIZE; i++)
+            if (stage[i].buffer != NULL &&
+                    (victim->buffer == NULL || stage[i].used < victim->used))
+                victim = &stage[i];
+    }
+    victim->key = key;
+    victim->buffer = g_malloc(size);
+    memcpy(victim->buffer, img->buffer, size);
+    victim->height = img->height;
+    victim->width = img->width;
+    victim->depth = img->depth;
+    victim->rowstride = img->rowstride;
+    victim->rgbg = img->rgbg;
+    victim->proxyLevel = uf->proxyLevel;
+    victim->hotpixels = uf->hotpixels;
+    victim->used = ++uf->stageCache->clock;
+}
+
+/*
+ * Make the phase image hold the result for 'key' without computing it,
+ * if possible. Return FALSE if the phase has to be computed.
+ */
+static gboolean ufraw_stage_restore(ufraw_data *uf, UFRawPhase phase,
+                                    guint64 key)
+{
+    ufraw_image_data *img = &uf->Images[phase];
+    ufraw_stage *stage = NULL;
+    int i;
+
+    if (img->key == key && img->buffer != NULL)
+        return TRUE; // Invalidated, but nothing changed
+    if (uf->stageCache == NULL)
+        return FALSE;
+    for (i = 0; i < UFRAW_STAGE_CACHE_SIZE; i++)
+        if (uf->stageCache->stage[i].key == key)
+            stage = &uf->stageCache->stage[i];
+    if (stage == NULL)
+        return FALSE;
+    gsize size = (gsize)stage->height * stage->rowstride;
+    if (phase == ufraw_first_phase) {
+        // See ufraw_close()
+        g_free(img->buffer);
+        img->buffer = g_malloc(size);
+    } else {
+        ufraw_buffer_pool_release(uf->pool, img->buffer,
+                                  (gsize)img->height * img->rowstride);
+        img->buffer = ufraw_buffer_pool_alloc(uf->pool, size);
+    }
+    memcpy(img->buffer, stage->buffer, size);
+    img->height = stage->height;
+    img->width = stage->width;
+    img->depth = stage->depth;
+    img->rowstride = stage->rowstride;
+    img->rgbg = stage->rgbg;
+    img->key = key;
+    if (phase == ufraw_raw_phase) {
+        uf->proxyLevel = stage->proxyLevel;
+        uf->hotpixels = stage->hotpixels;
+    }
+    stage->used = ++uf->stageCache->clock;
+    return TRUE;
+}
+
+/* Bring the raw phase image up to date with the current parameters. */
+static void ufraw_convert_stage_raw(ufraw_data *uf, gint generation)
+{
+    int level = ufraw_proxy_level(uf);
+    guint64 key = ufraw_stage_key(uf, ufraw_raw_phase, level);
+
+    if (ufraw_stage_restore(uf, ufraw_raw_phase, key))
+        return;
+    uf->Images[ufraw_raw_phase].key = 0;
+    ufraw_convert_image_raw(uf, ufraw_raw_phase, level);
+    if (generation == g_atomic_int_get(&uf->generation) && !cancelled())
+        ufraw_stage_store(uf, ufraw_raw_phase, key);
+}
+
 ufraw_image_data *ufraw_get_image(ufraw_data *uf, UFRawPhase phase,
                                   gboolean bufferok)
 {
@@ -1697,11 +2478,12 @@ ufraw_image_data *ufraw_get_image(ufraw_data *uf, UFRawPhase phase,
          * pixbuf. That can be fixed but is suboptimal anyway. The best
          * we can do is print a warning in case we need to finish the
          * conversion and finish it here. */
-        if (uf->Images[phase].valid != 0xffffffff) {
+        ufraw_image_data *img = &uf->Images[phase];
+        if (!ufraw_image_is_valid(img)) {
             g_warning("%s: fixing unfinished conversion for phase %d.\n",
                       G_STRFUNC, phase);
-            int i;
-            for (i = 0; i < 32; ++i)
+            int i, count = ufraw_image_get_subarea_count(img);
+            for (i = 0; i < count; ++i)
                 ufraw_convert_image_area(uf, i, phase);
         }
     }
@@ -1714,8 +2496,10 @@ ufraw_image_data *ufraw_convert_image_area(ufraw_data *uf, unsigned saidx,
     int yy;
     ufraw_image_data *out = &uf->Images[phase];
 
-    if (out->valid & (1 << saidx))
+    if (ufraw_image_subarea_is_valid(out, saidx))
         return out; // the subarea has been already computed
+    // Results computed while the image was invalidated are discarded
+    gint generation = g_atomic_int_get(&uf->generation);
 
     /* Get the subarea image for previous phase */
     ufraw_image_data *in = NULL;
@@ -1736,18 +2520,35 @@ ufraw_image_data *ufraw_convert_image_area(ufraw_data *uf, unsigned saidx,
 
     switch (phase) {
         case ufraw_raw_phase:
-            ufraw_convert_image_raw(uf, phase);
-            out->valid = 0xffffffff;
+            ufraw_convert_stage_raw(uf, generation);
+            ufraw_image_set_valid(out, TRUE);
+            if (generation != g_atomic_int_get(&uf->generation) || cancelled())
+                ufraw_image_set_valid(out, FALSE);
             return out;
 
-        case ufraw_first_phase:
-            ufraw_convert_image_first(uf, phase);
-            out->valid = 0xffffffff;
+        case ufraw_first_phase: {
+            guint64 key = ufraw_stage_key(uf, phase, ufraw_proxy_level(uf));
+            if (!ufraw_stage_restore(uf, phase, key)) {
+                // A zoom change does not invalidate the raw phase,
+                // but it may need a different proxy level.
+                ufraw_convert_stage_raw(uf, generation);
+                out->key = 0;
+                ufraw_convert_image_first(uf, phase);
 #ifdef HAVE_LENSFUN
-            UFRectangle allArea = { 0, 0, out->width, out->height };
-            ufraw_convert_image_vignetting(uf, out, &allArea);
+                UFRectangle allArea = { 0, 0, out->width, out->height };
+                ufraw_convert_image_vignetting(uf, out, &allArea);
 #endif /* HAVE_LENSFUN */
-            return out;
+                if (generation == g_atomic_int_get(&uf->generation) &&
+                        !cancelled())
+                    ufraw_stage_store(uf, phase, key);
+            }
+        }
+        ufraw_image_set_valid(out, TRUE);
+        if (generation != g_atomic_int_get(&uf->generation) || cancelled()) {
+            ufraw_image_set_valid(out, FALSE);
+            ufraw_image_set_valid(&uf->Images[ufraw_raw_phase], FALSE);
+        }
+        return out;
 
         case ufraw_transform_phase: {
             /* Area calculation is not needed at the moment since
@@ -1777,7 +2578,7 @@ ufraw_image_data *ufraw_convert_image_area(ufraw_data *uf, unsigned saidx,
                         for (yy = 0; yy < 8 * 2 * 3; yy += 2)
                         {
                             int idx = ufraw_img_get_subarea_idx (in, buff [yy], buff [yy + 1]);
-                            if (idx <= 31)
+                            if (idx < ufraw_image_get_subarea_count(in))
                                 ufraw_convert_image_area (uf, idx, phase - 1);
                         }
             */
@@ -1788,8 +2589,12 @@ ufraw_image_data *ufraw_convert_image_area(ufraw_data *uf, unsigned saidx,
         case ufraw_develop_phase:
             for (yy = 0; yy < area.height; yy++, dest += out->rowstride,
                     src += in->rowstride) {
-                develop(dest, (void *)src, uf->developer, 8, area.width);
+                if (in->depth == 6)
+                    develop48(dest, (void *)src, uf->developer, 8, area.width);
+                else
+                    develop(dest, (void *)src, uf->developer, 8, area.width);
             }
+            ufraw_tile_histogram(uf, saidx);
             break;
 
         case ufraw_display_phase:
@@ -1804,60 +2609,47 @@ ufraw_image_data *ufraw_convert_image_area(ufraw_data *uf, unsigned saidx,
             return in;
     }
 
-#ifdef _OPENMP
-    #pragma omp critical
-#endif
     // Mark the subarea as valid
-    out->valid |= (1 << saidx);
+    ufraw_subarea_bitmap_set(out->valid, saidx, TRUE);
+    if (generation != g_atomic_int_get(&uf->generation))
+        ufraw_subarea_bitmap_set(out->valid, saidx, FALSE);
 
     return out;
 }
 
-static void ufraw_flip_image_buffer(ufraw_image_data *img, int flip)
+static void ufraw_flip_image_buffer(ufraw_data *uf, UFRawPhase phase,
+                                    int flip)
 {
+    ufraw_image_data *img = &uf->Images[phase];
     if (img->buffer == NULL)
         return;
-    /* Following code was copied from dcraw's flip_image()
-     * and modified to work with any pixel depth. */
-    int base, dest, next, row, col;
-    guint8 *image = img->buffer;
-    int height = img->height;
-    int width = img->width;
-    int depth = img->depth;
-    int size = height * width;
-    guint8 hold[8];
-    unsigned *flag = g_new0(unsigned, (size + 31) >> 5);
-    for (base = 0; base < size; base++) {
-        if (flag[base >> 5] & (1 << (base & 31)))
-            continue;
-        dest = base;
-        memcpy(hold, image + base * depth, depth);
-        while (1) {
-            if (flip & 4) {
-                row = dest % height;
-                col = dest / height;
-            } else {
-                row = dest / width;
-                col = dest % width;
-            }
-            if (flip & 2)
-                row = height - 1 - row;
-            if (flip & 1)
-                col = width - 1 - col;
-            next = row * width + col;
-            if (next == base) break;
-            flag[next >> 5] |= 1 << (next & 31);
-            memcpy(image + dest * depth, image + next * depth, depth);
-            dest = next;
-        }
-        memcpy(image + dest * depth, hold, depth);
-    }
-    g_free(flag);
+    img->key = 0; // The flipped content has no matching key
+    gsize size = (gsize)img->height * img->width * img->depth;
+    guint8 *buffer;
+    /* Flip out of place, the first phase buffer is not pooled,
+     * see ufraw_close(). */
+    if (phase == ufraw_first_phase)
+        buffer = g_malloc(size);
+    else
+        buffer = ufraw_buffer_pool_alloc(uf->pool, size);
+    dcraw_flip_buffer(buffer, img->buffer, img->height, img->width,
+                      img->depth, flip);
+    if (phase == ufraw_first_phase)
+        g_free(img->buffer);
+    else
+        ufraw_buffer_pool_release(uf->pool, img->buffer,
+                                  (gsize)img->height * img->rowstride);
+    img->buffer = buffer;
+    /* The subareas do not follow the pixels they cover,
+     * so only a fully rendered image stays valid. */
+    if (!ufraw_image_is_valid(img))
+        ufraw_image_set_valid(img, FALSE);
     if (flip & 4) {
+        int width = img->width;
+        img->width = img->height;
         img->height = width;
-        img->width = height;
-        img->rowstride = height * depth;
     }
+    img->rowstride = img->width * img->depth;
 }
 
 void ufraw_flip_orientation(ufraw_data *uf, int flip)
@@ -1952,13 +2744,17 @@ void ufraw_flip_image(ufraw_data *uf, int flip)
     }
     UFRawPhase phase;
     for (phase = ufraw_first_phase; phase < ufraw_phases_num; phase++)
-        ufraw_flip_image_buffer(&uf->Images[phase], flip);
+        ufraw_flip_image_buffer(uf, phase, flip);
+    // The subarea histograms no longer match their subareas
+    memset(uf->tileHistogramValid, 0, sizeof(uf->tileHistogramValid));
 }
 
 void ufraw_invalidate_layer(ufraw_data *uf, UFRawPhase phase)
 {
+    // Increment the generation first, see ufraw_convert_image_area()
+    g_atomic_int_inc(&uf->generation);
     for (; phase < ufraw_phases_num; phase++) {
-        uf->Images[phase].valid = 0;
+        ufraw_image_set_valid(&uf->Images[phase], FALSE);
         uf->Images[phase].invalidate_event = TRUE;
     }
 }
@@ -1997,7 +2793,8 @@ void ufraw_invalidate_despeckle_layer(ufraw_data *uf)
 void ufraw_invalidate_whitebalance_layer(ufraw_data *uf)
 {
     ufraw_invalidate_layer(uf, ufraw_develop_phase);
-    uf->Images[ufraw_raw_phase].valid = 0;
+    g_atomic_int_inc(&uf->generation);
+    ufraw_image_set_valid(&uf->Images[ufraw_raw_phase], FALSE);
     uf->Images[ufraw_raw_phase].invalidate_event = TRUE;
 
     /* Despeckling is sensitive for WB changes because it is nonlinear. */
@@ -2123,10 +2920,9 @@ int ufraw_set_wb(ufraw_data *uf, gboolean interactive)
         } else {
             g_strlcpy(model, uf->conf->model, max_name);
         }
-        for (i = 0; i < wb_preset_count; i++) {
-            if (ufarray_is_equal(wb, wb_preset[i].name) &&
-                    !strcasecmp(uf->conf->make, wb_preset[i].make) &&
-                    !strcasecmp(model, wb_preset[i].model)) {
+        int first, count = wb_preset_find(uf->conf->make, model, &first);
+        for (i = first; i < first + count; i++) {
+            if (ufarray_is_equal(wb, wb_preset[i].name)) {
                 if (ufnumber_value(wbTuning) == wb_preset[i].tuning) {
                     double chanMulArray[4] = {1, 1, 1, 1 };
                     for (c = 0; c < uf->colors; c++)
@@ -2169,7 +2965,7 @@ int ufraw_set_wb(ufraw_data *uf, gboolean interactive)
                 break;
             }
         }
-        if (i == wb_preset_count) {
+        if (i == first + count) {
             if (lastTuning != -1) {
                 /* wbTuning was set to a value larger than possible */
                 ufnumber_set(wbTuning, wb_preset[lastTuning].tuning);
@@ -137,8 +137,14 @@ typedef struct {
 #endif /* HAVE_LENSFUN */
     long(*SaveFunc)();
     RenderModeType RenderMode;
-    /* Current subarea index (0-31). If negative, rendering has stopped */
+    /* Non-negative while subareas are being rendered. If negative, rendering
+     * has stopped */
     int RenderSubArea;
+    /* The thread rendering the untiled phases in the background, or NULL.
+     * Its results are only valid if uf->generation still matches. */
+    GThread *RenderThread;
+    gint RenderGeneration;
+    guint RenderProgressTimer;
     /* Some actions update the progress bar while working, but meanwhile we
      * want to freeze all other actions. After we thaw the dialog we must
      * call update_scales() which was also frozen. */
@@ -166,6 +172,9 @@ typedef struct {
     /* Mouse coordinates in previous frame (used when dragging crop area) */
     int OldMouseX, OldMouseY;
     int OverUnderTicker;
+    /* Over- and underexposed pixels of the preview pixbuf, which blink */
+    guint8 *ExposureMask;
+    int ExposureMaskWidth, ExposureMaskHeight;
     /* The event source number when the highlight blink function is enabled. */
     guint BlinkTimer;
     guint DrawCropID;
@@ -183,6 +192,8 @@ typedef struct {
 
 /* Start the render preview refresh thread for invalid layers in background */
 void render_preview(preview_data *data);
+/* Stop the background rendering thread, discarding its results */
+void render_stop(preview_data *data);
 
 void lens_fill_interface(preview_data *data, GtkWidget *page);
 
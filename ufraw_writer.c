@@ -16,6 +16,9 @@
 #include <string.h>
 #include <lcms2.h>
 #include "ufraw_colorspaces.h"
+#ifdef HAVE_LIBZ
+#include <zlib.h>	/* for libpng 1.5.x and parallel TIFF compression */
+#endif
 #ifdef HAVE_LIBTIFF
 #include <tiffio.h>
 #endif
@@ -25,28 +28,33 @@
 #endif
 #ifdef HAVE_LIBPNG
 #include <png.h>
-#ifdef HAVE_LIBZ
-#include <zlib.h>	/* for libpng 1.5.x */
-#endif
 #if PNG_LIBPNG_VER_MAJOR == 1 && (PNG_LIBPNG_VER_MINOR < 5 || \
     (PNG_LIBPNG_VER_MINOR == 5 && PNG_LIBPNG_VER_RELEASE < 1))
 #define png_const_bytep png_charp
 #endif
 #endif
 
-#ifdef _OPENMP
-#include <omp.h>
-#define uf_omp_get_thread_num() omp_get_thread_num()
-#else
-#define uf_omp_get_thread_num() 0
-#endif
-
 #ifdef HAVE_LIBCFITSIO
 #include <fitsio.h>
 #endif
 
 #define DEVELOP_BATCH 64
 
+/*
+ * The strips of the parallel encoders are handed to parallel_for(),
+ * a batch at a time.
+ */
+typedef struct {
+    ufraw_data *uf;
+    const UFRectangle *Crop;
+    int bitDepth;
+    int grayscaleMode;
+    int first;          /* Strip of the first task */
+    int strips;         /* Total number of strips */
+    int rowsPerStrip;
+    void *out;          /* Results of the batch, indexed by task */
+} strip_job;
+
 static void grayscale_buffer(void *graybuf, int width, int bitDepth)
 {
     int i;
@@ -86,14 +94,42 @@ static int ppm_row_writer(ufraw_data *uf, void *volatile out, void *pixbuf,
 }
 
 #ifdef HAVE_LIBTIFF
-// There seem to be no way to get the libtiff message without a static variable
-// Therefore the folloing code is not thread-safe.
-static char ufraw_tiff_message[max_path];
+// There seem to be no way to get the libtiff message without a static variable.
+// The conversion service writes TIFF files concurrently, therefore the message
+// is kept per thread.
+#if !GLIB_CHECK_VERSION(2,32,0)
+static gpointer tiff_message_key_new(gpointer data)
+{
+    (void)data;
+    return g_private_new(g_free);
+}
+#endif
+
+static char *ufraw_tiff_message(void)
+{
+#if GLIB_CHECK_VERSION(2,32,0)
+    static GPrivate key = G_PRIVATE_INIT(g_free);
+    char *message = g_private_get(&key);
+    if (message == NULL) {
+        message = g_new0(char, max_path);
+        g_private_set(&key, message);
+    }
+#else
+    static GOnce once = G_ONCE_INIT;
+    GPrivate *key = g_once(&once, tiff_message_key_new, NULL);
+    char *message = g_private_get(key);
+    if (message == NULL) {
+        message = g_new0(char, max_path);
+        g_private_set(key, message);
+    }
+#endif
+    return message;
+}
 
 static void tiff_messenger(const char *module, const char *fmt, va_list ap)
 {
     (void)module;
-    vsnprintf(ufraw_tiff_message, max_path, fmt, ap);
+    vsnprintf(ufraw_tiff_message(), max_path, fmt, ap);
 }
 
 int tiff_row_writer(ufraw_data *uf, void *volatile out, void *pixbuf,
@@ -106,13 +142,122 @@ int tiff_row_writer(ufraw_data *uf, void *volatile out, void *pixbuf,
         if (TIFFWriteScanline(out, pixbuf + i * rowStride, row + i, 0) < 0) {
             // 'errno' does seem to contain useful information
             ufraw_set_error(uf, _("Error creating file."));
-            ufraw_set_error(uf, ufraw_tiff_message);
-            ufraw_tiff_message[0] = '\0';
+            ufraw_set_error(uf, ufraw_tiff_message());
+            ufraw_tiff_message()[0] = '\0';
             return UFRAW_ERROR;
         }
     }
     return UFRAW_SUCCESS;
 }
+
+/*
+ * Parallel TIFF encoding.
+ * Strips are developed and compressed concurrently, a few at a time,
+ * and written in order with TIFFWriteRawStrip(). For deflate compression
+ * the horizontal differencing predictor is applied here as well, since
+ * libtiff's codecs are bypassed by raw writes.
+ */
+#define TIFF_PARALLEL_STRIP_SIZE 0x40000
+
+typedef struct {
+    guint8 *buffer;
+    gsize length;
+    gboolean failed;
+} tiff_strip;
+
+static void tiff_encode_strip(ufraw_data *uf, const UFRectangle *Crop,
+                              int bitDepth, int grayscaleMode, int row0, int rows, tiff_strip *out)
+{
+    int rowStride = uf->Images[ufraw_first_phase].width;
+    ufraw_image_type *rawImage =
+        (ufraw_image_type *)uf->Images[ufraw_first_phase].buffer;
+    int samples = grayscaleMode ? 1 : 3;
+    int byteDepth = bitDepth > 8 ? 2 : 1;
+    int rowBytes = Crop->width * samples * byteDepth;
+    gsize size = (gsize)rows * rowBytes;
+    /* develop() always writes 3 samples, even in grayscale mode. */
+    guint8 *pixbuf = g_new(guint8, size - rowBytes + Crop->width * 3 * byteDepth);
+    int row;
+
+    for (row = 0; row < rows; row++) {
+        guint8 *rowbuf = pixbuf + row * rowBytes;
+        develop(rowbuf, rawImage[(Crop->y + row0 + row)*rowStride + Crop->x],
+                uf->developer, bitDepth, Crop->width);
+        if (grayscaleMode)
+            grayscale_buffer(rowbuf, Crop->width, bitDepth);
+        progress(PROGRESS_SAVE, 1);
+    }
+    out->failed = FALSE;
+#ifdef HAVE_LIBZ
+    if (uf->conf->losslessCompress) {
+        int count = Crop->width * samples;
+        int i;
+        for (row = 0; row < rows; row++) {
+            if (byteDepth == 2) {
+                guint16 *p = (guint16 *)(pixbuf + row * rowBytes);
+                for (i = count - 1; i >= samples; i--)
+                    p[i] -= p[i - samples];
+            } else {
+                guint8 *p = pixbuf + row * rowBytes;
+                for (i = count - 1; i >= samples; i--)
+                    p[i] -= p[i - samples];
+            }
+        }
+        uLongf length = compressBound(size);
+        out->buffer = g_new(guint8, length);
+        out->failed = compress2(out->buffer, &length, pixbuf, size, 9) != Z_OK;
+        out->length = length;
+        g_free(pixbuf);
+        return;
+    }
+#endif
+    out->buffer = pixbuf;
+    out->length = size;
+}
+
+static void tiff_strip_task(int i, void *data)
+{
+    strip_job *job = data;
+    int row0 = (job->first + i) * job->rowsPerStrip;
+    tiff_encode_strip(job->uf, job->Crop, job->bitDepth, job->grayscaleMode,
+                      row0, MIN(job->rowsPerStrip, job->Crop->height - row0),
+                      (tiff_strip *)job->out + i);
+}
+
+static void tiff_write_strips(ufraw_data *uf, TIFF *out,
+                              const UFRectangle *Crop, int bitDepth, int grayscaleMode,
+                              int rowsPerStrip)
+{
+    int strips = (Crop->height + rowsPerStrip - 1) / rowsPerStrip;
+    int batch = MIN(2 * parallel_get_max_threads(), strips);
+    tiff_strip *strip = g_new0(tiff_strip, batch);
+    strip_job job = { uf, Crop, bitDepth, grayscaleMode, 0, strips,
+                      rowsPerStrip, strip
+                    };
+    int s0, i;
+
+    progress(PROGRESS_SAVE, -Crop->height);
+    for (s0 = 0; s0 < strips && !ufraw_is_error(uf); s0 += batch) {
+        int n = MIN(batch, strips - s0);
+        job.first = s0;
+        parallel_for(tiff_strip_task, n, &job);
+        for (i = 0; i < n; i++) {
+            if (!ufraw_is_error(uf)) {
+                if (strip[i].failed) {
+                    ufraw_set_error(uf, _("Error creating file '%s'."),
+                                    uf->conf->outputFilename);
+                } else if (TIFFWriteRawStrip(out, s0 + i, strip[i].buffer,
+                                             strip[i].length) < 0) {
+                    ufraw_set_error(uf, _("Error creating file."));
+                    ufraw_set_error(uf, ufraw_tiff_message());
+                    ufraw_tiff_message()[0] = '\0';
+                }
+            }
+            g_free(strip[i].buffer);
+        }
+    }
+    g_free(strip);
+}
 #endif /*HAVE_LIBTIFF*/
 
 #ifdef HAVE_LIBJPEG
@@ -165,6 +310,273 @@ static int jpeg_row_writer(ufraw_data *uf, void *volatile out, void *pixbuf,
     }
     return UFRAW_SUCCESS;
 }
+
+static void jpeg_set_output_parameters(ufraw_data *uf,
+                                       struct jpeg_compress_struct *cinfo, int width, int height,
+                                       int grayscaleMode)
+{
+    cinfo->image_width = width;
+    cinfo->image_height = height;
+    if (grayscaleMode) {
+        cinfo->input_components = 1;
+        cinfo->in_color_space = JCS_GRAYSCALE;
+    } else {
+        cinfo->input_components = 3;
+        cinfo->in_color_space = JCS_RGB;
+    }
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, uf->conf->compression, TRUE);
+    if (uf->conf->compression > 90)
+        cinfo->comp_info[0].v_samp_factor = 1;
+    if (uf->conf->compression > 92)
+        cinfo->comp_info[0].h_samp_factor = 1;
+    if (uf->conf->progressiveJPEG)
+        jpeg_simple_progression(cinfo);
+
+    cinfo->optimize_coding = 1;
+}
+
+/* Must be called after jpeg_start_compress() */
+static void jpeg_write_output_markers(ufraw_data *uf,
+                                      struct jpeg_compress_struct *cinfo)
+{
+    /* Embed output profile if it is not the internal sRGB. */
+    if (strcmp(uf->developer->profileFile[out_profile], "")) {
+        char *buf;
+        gsize len;
+        if (g_file_get_contents(uf->developer->profileFile[out_profile],
+                                &buf, &len, NULL)) {
+            write_icc_profile(cinfo, (unsigned char *)buf, len);
+            g_free(buf);
+        } else {
+            ufraw_set_warning(uf,
+                              _("Failed to embed output profile '%s' in '%s'."),
+                              uf->developer->profileFile[out_profile],
+                              uf->conf->outputFilename);
+        }
+    } else if (uf->conf->profileIndex[out_profile] == 1) { // Embed sRGB.
+        cmsHPROFILE hOutProfile = uf_colorspaces_create_srgb_profile();
+        cmsUInt32Number len = 0;
+        cmsSaveProfileToMem(hOutProfile, 0, &len); // Calculate len.
+        if (len > 0) {
+            unsigned char buf[len];
+            cmsSaveProfileToMem(hOutProfile, buf, &len);
+            write_icc_profile(cinfo, buf, len);
+        } else {
+            ufraw_set_warning(uf,
+                              _("Failed to embed output profile '%s' in '%s'."),
+                              uf->conf->profile[out_profile]
+                              [uf->conf->profileIndex[out_profile]].name,
+                              uf->conf->outputFilename);
+        }
+        cmsCloseProfile(hOutProfile);
+    }
+    if (uf->conf->embedExif) {
+        ufraw_exif_prepare_output(uf);
+        if (uf->outputExifBuf != NULL) {
+            if (uf->outputExifBufLen > 65533) {
+                ufraw_set_warning(uf,
+                                  _("EXIF buffer length %d, too long, ignored."),
+                                  uf->outputExifBufLen);
+            } else {
+                jpeg_write_marker(cinfo, JPEG_APP0 + 1,
+                                  uf->outputExifBuf, uf->outputExifBufLen);
+            }
+        }
+    }
+}
+
+/*
+ * Parallel JPEG encoding.
+ * The image is cut into strips of JPEG_STRIP_HEIGHT rows. Each strip is
+ * developed and compressed by its own libjpeg instance into a memory buffer,
+ * with a restart marker after every MCU row and the standard Huffman tables.
+ * The strips are then joined into a single baseline scan: the headers of the
+ * first strip are kept with the image height patched, the restart markers are
+ * renumbered and an extra restart marker is inserted between the strips.
+ * Since the DCT blocks do not depend on the entropy coding, the decoded image
+ * is identical to the one produced by the serial encoder.
+ */
+#define JPEG_STRIP_HEIGHT 256	/* Must be a multiple of the MCU height (16) */
+#define JPEG_BUFFER_SIZE 0x10000
+
+typedef struct {
+    struct jpeg_destination_mgr pub;
+    guint8 *buffer;
+    gsize size, length;
+    int mcuRows; /* MCU rows in a full strip */
+} jpeg_strip_dest;
+
+static void jpeg_strip_init_destination(j_compress_ptr cinfo)
+{
+    jpeg_strip_dest *dest = (jpeg_strip_dest *)cinfo->dest;
+    dest->size = JPEG_BUFFER_SIZE;
+    dest->buffer = g_new(guint8, dest->size);
+    dest->pub.next_output_byte = dest->buffer;
+    dest->pub.free_in_buffer = dest->size;
+}
+
+static boolean jpeg_strip_empty_output_buffer(j_compress_ptr cinfo)
+{
+    jpeg_strip_dest *dest = (jpeg_strip_dest *)cinfo->dest;
+    /* libjpeg expects the whole buffer to be flushed here. */
+    gsize oldSize = dest->size;
+    dest->size *= 2;
+    dest->buffer = g_renew(guint8, dest->buffer, dest->size);
+    dest->pub.next_output_byte = dest->buffer + oldSize;
+    dest->pub.free_in_buffer = dest->size - oldSize;
+    return TRUE;
+}
+
+static void jpeg_strip_term_destination(j_compress_ptr cinfo)
+{
+    jpeg_strip_dest *dest = (jpeg_strip_dest *)cinfo->dest;
+    dest->length = dest->size - dest->pub.free_in_buffer;
+}
+
+/* Return the offset of the entropy coded data following the SOS header,
+ * or 0 if the stream is malformed. If height is positive, the image height
+ * in the SOF header is set to it. */
+static gsize jpeg_strip_scan_offset(guint8 *buf, gsize len, int height)
+{
+    gsize pos = 2; /* Skip SOI */
+    while (pos + 4 <= len && buf[pos] == 0xFF) {
+        int marker = buf[pos + 1];
+        gsize markerLen = buf[pos + 2] << 8 | buf[pos + 3];
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+                marker != 0xC8 && marker != 0xCC && height > 0 &&
+                pos + 7 <= len) {
+            buf[pos + 5] = height >> 8;
+            buf[pos + 6] = height & 0xFF;
+        }
+        pos += 2 + markerLen;
+        if (marker == 0xDA)
+            return pos <= len ? pos : 0;
+    }
+    return 0;
+}
+
+/* The results of a strip are stored in job->out and in job->scan. */
+typedef struct {
+    strip_job pub;
+    gsize *scan;
+} jpeg_strip_job;
+
+static void jpeg_strip_task(int s, void *data)
+{
+    jpeg_strip_job *job = data;
+    ufraw_data *uf = job->pub.uf;
+    const UFRectangle *Crop = job->pub.Crop;
+    int grayscaleMode = job->pub.grayscaleMode;
+    jpeg_strip_dest *dest = job->pub.out;
+    gsize *scan = job->scan;
+    int rowStride = uf->Images[ufraw_first_phase].width;
+    ufraw_image_type *rawImage =
+        (ufraw_image_type *)uf->Images[ufraw_first_phase].buffer;
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    int row0 = s * JPEG_STRIP_HEIGHT;
+    int height = MIN(JPEG_STRIP_HEIGHT, Crop->height - row0);
+    int row;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    cinfo.err->output_message = jpeg_warning_handler;
+    cinfo.err->error_exit = jpeg_error_handler;
+    cinfo.client_data = uf;
+    jpeg_create_compress(&cinfo);
+    dest[s].pub.init_destination = jpeg_strip_init_destination;
+    dest[s].pub.empty_output_buffer = jpeg_strip_empty_output_buffer;
+    dest[s].pub.term_destination = jpeg_strip_term_destination;
+    cinfo.dest = &dest[s].pub;
+    jpeg_set_output_parameters(uf, &cinfo, Crop->width, height,
+                               grayscaleMode);
+    cinfo.optimize_coding = 0;
+    cinfo.restart_in_rows = 1;
+    jpeg_start_compress(&cinfo, TRUE);
+    dest[s].mcuRows = JPEG_STRIP_HEIGHT /
+                      (cinfo.max_v_samp_factor * DCTSIZE);
+    if (s == 0)
+        jpeg_write_output_markers(uf, &cinfo);
+
+    guint8 *rowbuf = g_new(guint8, Crop->width * 3);
+    for (row = row0; row < row0 + height; row++) {
+        develop(rowbuf, rawImage[(Crop->y + row)*rowStride + Crop->x],
+                uf->developer, 8, Crop->width);
+        if (grayscaleMode)
+            grayscale_buffer(rowbuf, Crop->width, 8);
+        jpeg_write_scanlines(&cinfo, &rowbuf, 1);
+        progress(PROGRESS_SAVE, 1);
+    }
+    g_free(rowbuf);
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    /* Renumber the restart markers to continue the previous strips. */
+    scan[s] = jpeg_strip_scan_offset(dest[s].buffer, dest[s].length,
+                                     s == 0 ? Crop->height : 0);
+    if (scan[s] > 0) {
+        guint8 *p;
+        int rst = s * dest[s].mcuRows;
+        for (p = dest[s].buffer + scan[s];
+                p + 1 < dest[s].buffer + dest[s].length; p++)
+            if (p[0] == 0xFF && p[1] >= 0xD0 && p[1] <= 0xD7)
+                *++p = 0xD0 + (rst++ & 7);
+    }
+}
+
+static void jpeg_write_strips(ufraw_data *uf, FILE *out,
+                              const UFRectangle *Crop, int grayscaleMode)
+{
+    int strips = (Crop->height + JPEG_STRIP_HEIGHT - 1) / JPEG_STRIP_HEIGHT;
+    jpeg_strip_dest *dest = g_new0(jpeg_strip_dest, strips);
+    gsize *scan = g_new0(gsize, strips);
+    jpeg_strip_job job = {
+        { uf, Crop, 8, grayscaleMode, 0, strips, JPEG_STRIP_HEIGHT, dest },
+        scan
+    };
+    int s;
+
+    progress(PROGRESS_SAVE, -Crop->height);
+    parallel_for(jpeg_strip_task, strips, &job);
+    for (s = 0; s < strips && !ufraw_is_error(uf); s++)
+        if (scan[s] == 0 || dest[s].length < scan[s] + 2)
+            ufraw_set_error(uf, _("Error creating file '%s'."),
+                            uf->conf->outputFilename);
+
+    if (!ufraw_is_error(uf)) {
+        gboolean ok = fwrite(dest[0].buffer, scan[0], 1, out) == 1;
+        for (s = 0; s < strips && ok; s++) {
+            if (s > 0) {
+                guint8 rst[2] = { 0xFF, 0xD0 + ((s * dest[s].mcuRows - 1) & 7) };
+                ok = fwrite(rst, 2, 1, out) == 1;
+            }
+            /* Drop the EOI marker at the end of each strip. */
+            gsize len = dest[s].length - scan[s] - 2;
+            if (ok && len > 0)
+                ok = fwrite(dest[s].buffer + scan[s], len, 1, out) == 1;
+        }
+        if (ok) {
+            static const guint8 eoi[2] = { 0xFF, 0xD9 };
+            ok = fwrite(eoi, 2, 1, out) == 1;
+        }
+        if (!ok) {
+            ufraw_set_error(uf, _("Error creating file '%s'."),
+                            uf->conf->outputFilename);
+            ufraw_set_error(uf, g_strerror(errno));
+        }
+    } else {
+        char *message = g_strdup(ufraw_get_message(uf));
+        ufraw_message_reset(uf);
+        ufraw_set_error(uf, _("Error creating file '%s'."),
+                        uf->conf->outputFilename);
+        ufraw_set_error(uf, message);
+        g_free(message);
+    }
+    for (s = 0; s < strips; s++)
+        g_free(dest[s].buffer);
+    g_free(dest);
+    g_free(scan);
+}
 #endif /*HAVE_LIBJPEG*/
 
 #ifdef HAVE_LIBPNG
@@ -201,6 +613,252 @@ int png_row_writer(ufraw_data *uf, void *volatile out, void *pixbuf,
 
     return UFRAW_SUCCESS;
 }
+
+static const int png_filter_flags[] = {
+    PNG_ALL_FILTERS, PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP,
+    PNG_FILTER_AVG, PNG_FILTER_PAETH
+};
+
+#ifdef HAVE_LIBZ
+/*
+ * Parallel PNG encoding, in the spirit of pigz.
+ * The image is cut into strips of PNG_STRIP_HEIGHT rows. Each strip is
+ * developed, filtered and deflated on its own thread as a raw deflate
+ * stream, primed with the last 32K of filtered data preceding the strip.
+ * All streams but the last end with a sync flush, so they can simply be
+ * concatenated into one zlib stream. The adler32 checksums of the strips
+ * are combined for the zlib trailer. The rows just before a strip are
+ * developed again to build its dictionary. This keeps the strips
+ * independent, so only a few of them are kept in memory at a time.
+ */
+#define PNG_STRIP_HEIGHT 128
+#define PNG_DICT_SIZE 32768
+
+static inline int png_paeth_predictor(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+/* Filter 'row' into 'out', which starts with the filter type byte. */
+static void png_filter_row(guint8 *out, const guint8 *row, const guint8 *prev,
+                           int rowBytes, int bpp, int type)
+{
+    int i;
+    out[0] = type;
+    out++;
+    switch (type) {
+        case 0:
+            memcpy(out, row, rowBytes);
+            break;
+        case 1:
+            for (i = 0; i < bpp; i++)
+                out[i] = row[i];
+            for (; i < rowBytes; i++)
+                out[i] = row[i] - row[i - bpp];
+            break;
+        case 2:
+            for (i = 0; i < rowBytes; i++)
+                out[i] = row[i] - prev[i];
+            break;
+        case 3:
+            for (i = 0; i < bpp; i++)
+                out[i] = row[i] - (prev[i] >> 1);
+            for (; i < rowBytes; i++)
+                out[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+            break;
+        case 4:
+            for (i = 0; i < bpp; i++)
+                out[i] = row[i] - prev[i];
+            for (; i < rowBytes; i++)
+                out[i] = row[i] - png_paeth_predictor(row[i - bpp], prev[i],
+                                                      prev[i - bpp]);
+            break;
+    }
+}
+
+/* Same heuristic as libpng: minimal sum of absolute signed differences. */
+static void png_filter_row_adaptive(guint8 *out, const guint8 *row,
+                                    const guint8 *prev, int rowBytes, int bpp, guint8 *tmp)
+{
+    int type, i, best = 0;
+    guint64 bestSum = G_MAXUINT64;
+    for (type = 0; type < 5; type++) {
+        guint8 *t = tmp + type * (rowBytes + 1);
+        guint64 sum = 0;
+        png_filter_row(t, row, prev, rowBytes, bpp, type);
+        for (i = 1; i <= rowBytes; i++)
+            sum += t[i] < 128 ? t[i] : 256 - t[i];
+        if (sum < bestSum) {
+            bestSum = sum;
+            best = type;
+        }
+    }
+    memcpy(out, tmp + best * (rowBytes + 1), rowBytes + 1);
+}
+
+static void png_develop_row(ufraw_data *uf, const UFRectangle *Crop, int row,
+                            int grayscaleMode, int bitDepth, guint8 *rowbuf)
+{
+    int rowStride = uf->Images[ufraw_first_phase].width;
+    ufraw_image_type *rawImage =
+        (ufraw_image_type *)uf->Images[ufraw_first_phase].buffer;
+    develop(rowbuf, rawImage[(Crop->y + row)*rowStride + Crop->x],
+            uf->developer, bitDepth, Crop->width);
+    if (grayscaleMode)
+        grayscale_buffer(rowbuf, Crop->width, bitDepth);
+    if (bitDepth > 8 && G_BYTE_ORDER == G_LITTLE_ENDIAN) {
+        guint16 *pixbuf16 = (guint16 *)rowbuf;
+        int i;
+        for (i = 0; i < Crop->width * (grayscaleMode ? 1 : 3); i++)
+            pixbuf16[i] = GUINT16_TO_BE(pixbuf16[i]);
+    }
+}
+
+typedef struct {
+    guint8 *buffer;
+    gsize length;       /* Deflated length, without the reserved bytes */
+    gsize inLength;     /* Filtered length */
+    uLong adler;
+    gboolean failed;
+} png_strip;
+
+/* Leave room for the zlib header before and the adler32 trailer after. */
+#define PNG_STRIP_HEAD 2
+#define PNG_STRIP_TAIL 4
+
+static void png_deflate_strip(ufraw_data *uf, const UFRectangle *Crop,
+                              int bitDepth, int grayscaleMode, int strip, gboolean last,
+                              png_strip *out)
+{
+    int byteDepth = bitDepth > 8 ? 2 : 1;
+    int bpp = (grayscaleMode ? 1 : 3) * byteDepth;
+    int rowBytes = Crop->width * bpp;
+    int filter = uf->conf->pngFilter;
+    int row0 = strip * PNG_STRIP_HEIGHT;
+    int row1 = MIN(row0 + PNG_STRIP_HEIGHT, Crop->height);
+    int dictRows = MIN(row0, (PNG_DICT_SIZE + rowBytes) / (rowBytes + 1));
+    int row;
+
+    guint8 *filtered = g_new(guint8, (row1 - row0 + dictRows) * (rowBytes + 1));
+    guint8 *rowbuf = g_new(guint8, 2 * Crop->width * 3 * byteDepth);
+    guint8 *cur = rowbuf, *prev = rowbuf + Crop->width * 3 * byteDepth;
+    guint8 *tmp = filter == adaptive_png_filter ?
+                  g_new(guint8, 5 * (rowBytes + 1)) : NULL;
+    guint8 *f = filtered;
+
+    if (row0 - dictRows > 0)
+        png_develop_row(uf, Crop, row0 - dictRows - 1, grayscaleMode, bitDepth,
+                        prev);
+    else
+        memset(prev, 0, rowBytes);
+    for (row = row0 - dictRows; row < row1; row++, f += rowBytes + 1) {
+        png_develop_row(uf, Crop, row, grayscaleMode, bitDepth, cur);
+        if (filter == adaptive_png_filter)
+            png_filter_row_adaptive(f, cur, prev, rowBytes, bpp, tmp);
+        else
+            png_filter_row(f, cur, prev, rowBytes, bpp, filter - no_png_filter);
+        guint8 *swap = cur;
+        cur = prev;
+        prev = swap;
+        if (row >= row0)
+            progress(PROGRESS_SAVE, 1);
+    }
+    g_free(tmp);
+    g_free(rowbuf);
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    out->failed = deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+                               8, filter == no_png_filter ?
+                               Z_DEFAULT_STRATEGY : Z_FILTERED) != Z_OK;
+    if (out->failed) {
+        g_free(filtered);
+        return;
+    }
+    gsize dictLength = MIN((gsize)dictRows * (rowBytes + 1), PNG_DICT_SIZE);
+    guint8 *in = filtered + dictRows * (rowBytes + 1);
+    if (dictLength > 0)
+        deflateSetDictionary(&z, in - dictLength, dictLength);
+    out->inLength = (row1 - row0) * (rowBytes + 1);
+    out->adler = adler32(adler32(0L, Z_NULL, 0), in, out->inLength);
+    /* A sync flush adds at most an empty stored block. */
+    gsize size = deflateBound(&z, out->inLength) + 16;
+    out->buffer = g_new(guint8, PNG_STRIP_HEAD + size + PNG_STRIP_TAIL);
+    z.next_in = in;
+    z.avail_in = out->inLength;
+    z.next_out = out->buffer + PNG_STRIP_HEAD;
+    z.avail_out = size;
+    int status = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+    out->failed = z.avail_in != 0 ||
+                  status != (last ? Z_STREAM_END : Z_OK);
+    out->length = size - z.avail_out;
+    deflateEnd(&z);
+    g_free(filtered);
+}
+
+static void png_strip_task(int i, void *data)
+{
+    strip_job *job = data;
+    int s = job->first + i;
+    png_deflate_strip(job->uf, job->Crop, job->bitDepth, job->grayscaleMode,
+                      s, s == job->strips - 1, (png_strip *)job->out + i);
+}
+
+static void png_write_strips(ufraw_data *uf, png_structp png,
+                             const UFRectangle *Crop, int bitDepth, int grayscaleMode)
+{
+    int strips = (Crop->height + PNG_STRIP_HEIGHT - 1) / PNG_STRIP_HEIGHT;
+    int batch = MIN(2 * parallel_get_max_threads(), strips);
+    png_strip *strip = g_new0(png_strip, batch);
+    strip_job job = { uf, Crop, bitDepth, grayscaleMode, 0, strips,
+                      PNG_STRIP_HEIGHT, strip
+                    };
+    uLong adler = adler32(0L, Z_NULL, 0);
+    int s0, i;
+
+    progress(PROGRESS_SAVE, -Crop->height);
+    for (s0 = 0; s0 < strips && !ufraw_is_error(uf); s0 += batch) {
+        int n = MIN(batch, strips - s0);
+        job.first = s0;
+        parallel_for(png_strip_task, n, &job);
+        for (i = 0; i < n; i++) {
+            guint8 *data = strip[i].buffer + PNG_STRIP_HEAD;
+            gsize length = strip[i].length;
+            if (strip[i].failed || ufraw_is_error(uf)) {
+                if (!ufraw_is_error(uf))
+                    ufraw_set_error(uf, _("Error creating file '%s'."),
+                                    uf->conf->outputFilename);
+            } else {
+                adler = adler32_combine(adler, strip[i].adler,
+                                        strip[i].inLength);
+                if (s0 + i == 0) {
+                    /* zlib header for a 32K window and maximal compression */
+                    data -= PNG_STRIP_HEAD;
+                    data[0] = 0x78;
+                    data[1] = 0xDA;
+                    length += PNG_STRIP_HEAD;
+                }
+                if (s0 + i == strips - 1) {
+                    data[length++] = adler >> 24;
+                    data[length++] = adler >> 16 & 0xFF;
+                    data[length++] = adler >> 8 & 0xFF;
+                    data[length++] = adler & 0xFF;
+                }
+                png_write_chunk(png, (png_bytep)"IDAT", data, length);
+            }
+            g_free(strip[i].buffer);
+            strip[i].buffer = NULL;
+        }
+    }
+    g_free(strip);
+    if (!ufraw_is_error(uf))
+        png_write_chunk(png, (png_bytep)"IEND", NULL, 0);
+}
+#endif /*HAVE_LIBZ*/
 #endif /*HAVE_LIBPNG*/
 
 #if defined(HAVE_LIBCFITSIO) && defined(_WIN32)
@@ -217,6 +875,42 @@ static struct tm *localtime_r(const time_t *timep, struct tm *result)
 }
 #endif /*HAVE_LIBCFITSIO && _WIN32*/
 
+#ifdef HAVE_LIBCFITSIO
+static void fits_write_statistics(fitsfile *fitsFile, guint16 min[3],
+                                  guint16 max[3], float average[3], int *status)
+{
+    guint16 maxAll = MAX(MAX(max[0], max[1]), max[2]);
+    guint16 minAll = MIN(MIN(min[0], min[1]), min[2]);
+
+    fits_update_key(fitsFile, TUSHORT, "DATAMIN", &minAll,
+                    "minimum data (overall)", status);
+    fits_update_key(fitsFile, TUSHORT, "DATAMAX", &maxAll,
+                    "maximum data (overall)", status);
+
+    fits_update_key(fitsFile, TUSHORT, "DATAMINR", &min[0],
+                    "minimum data (red channel)", status);
+    fits_update_key(fitsFile, TUSHORT, "DATAMAXR", &max[0],
+                    "maximum data (red channel)", status);
+
+    fits_update_key(fitsFile, TUSHORT, "DATAMING", &min[1],
+                    "minimum data (green channel)", status);
+    fits_update_key(fitsFile, TUSHORT, "DATAMAXG", &max[1],
+                    "maximum data (green channel)", status);
+
+    fits_update_key(fitsFile, TUSHORT, "DATAMINB", &min[2],
+                    "minimum data (blue channel)", status);
+    fits_update_key(fitsFile, TUSHORT, "DATAMAXB", &max[2],
+                    "maximum data (blue channel)", status);
+
+    fits_update_key(fitsFile, TFLOAT, "AVERAGER", &average[0],
+                    "average (red channel)", status);
+    fits_update_key(fitsFile, TFLOAT, "AVERAGEG", &average[1],
+                    "average (green channel)", status);
+    fits_update_key(fitsFile, TFLOAT, "AVERAGEB", &average[2],
+                    "average (blue channel)", status);
+}
+#endif /*HAVE_LIBCFITSIO*/
+
 void ufraw_write_image_data(
     ufraw_data *uf, void * volatile out,
     const UFRectangle *Crop, int bitDepth, int grayscaleMode,
@@ -291,21 +985,29 @@ int ufraw_write_image(ufraw_data *uf)
     if (uf->conf->type == tiff_type) {
         TIFFSetErrorHandler(tiff_messenger);
         TIFFSetWarningHandler(tiff_messenger);
-        ufraw_tiff_message[0] = '\0';
+        ufraw_tiff_message()[0] = '\0';
+        const char *mode = "w";
+        if (uf->conf->bigTIFF) {
+#ifdef TIFF_BIGTIFF_VERSION
+            mode = "w8";
+#else
+            ufraw_set_warning(uf, _("ufraw was build without BigTIFF support."));
+#endif
+        }
         if (!strcmp(uf->conf->outputFilename, "-")) {
             out = TIFFFdOpen(fileno((FILE *)stdout),
-                             uf->conf->outputFilename, "w");
+                             uf->conf->outputFilename, mode);
         } else {
             char *filename =
                 uf_win32_locale_filename_from_utf8(uf->conf->outputFilename);
-            out = TIFFOpen(filename, "w");
+            out = TIFFOpen(filename, mode);
             uf_win32_locale_filename_free(filename);
         }
         if (out == NULL) {
             ufraw_set_error(uf, _("Error creating file."));
-            ufraw_set_error(uf, ufraw_tiff_message);
+            ufraw_set_error(uf, ufraw_tiff_message());
             ufraw_set_error(uf, g_strerror(errno));
-            ufraw_tiff_message[0] = '\0';
+            ufraw_tiff_message()[0] = '\0';
             return ufraw_get_status(uf);
         }
     } else
@@ -423,10 +1125,24 @@ int ufraw_write_image(ufraw_data *uf)
             }
             cmsCloseProfile(hOutProfile);
         }
-        TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(out, 0));
-
-        ufraw_write_image_data(uf, out, &Crop, BitDepth, grayscaleMode,
-                               tiff_row_writer);
+        int rowsPerStrip = uf->conf->tiffRowsPerStrip;
+        gboolean parallel = uf->conf->parallelSave &&
+                            parallel_get_max_threads() > 1;
+        if (parallel && rowsPerStrip <= 0) {
+            int rowBytes = Crop.width * (grayscaleMode ? 1 : 3) * BitDepth / 8;
+            rowsPerStrip = MAX(1, TIFF_PARALLEL_STRIP_SIZE / rowBytes);
+        }
+        if (rowsPerStrip <= 0)
+            rowsPerStrip = TIFFDefaultStripSize(out, 0);
+        rowsPerStrip = MIN(rowsPerStrip, Crop.height);
+        TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, rowsPerStrip);
+
+        if (parallel)
+            tiff_write_strips(uf, out, &Crop, BitDepth, grayscaleMode,
+                              rowsPerStrip);
+        else
+            ufraw_write_image_data(uf, out, &Crop, BitDepth, grayscaleMode,
+                                   tiff_row_writer);
 
 #endif /*HAVE_LIBTIFF*/
 #ifdef HAVE_LIBJPEG
@@ -434,95 +1150,43 @@ int ufraw_write_image(ufraw_data *uf)
         if (BitDepth != 8)
             ufraw_set_warning(uf,
                               _("Unsupported bit depth '%d' ignored."), BitDepth);
-        struct jpeg_compress_struct cinfo;
-        struct jpeg_error_mgr jerr;
-
-        cinfo.err = jpeg_std_error(&jerr);
-        cinfo.err->output_message = jpeg_warning_handler;
-        cinfo.err->error_exit = jpeg_error_handler;
-        cinfo.client_data = uf;
-        jpeg_create_compress(&cinfo);
-        jpeg_stdio_dest(&cinfo, out);
-        cinfo.image_width = Crop.width;
-        cinfo.image_height = Crop.height;
-        if (grayscaleMode) {
-            cinfo.input_components = 1;
-            cinfo.in_color_space = JCS_GRAYSCALE;
-        } else {
-            cinfo.input_components = 3;
-            cinfo.in_color_space = JCS_RGB;
-        }
-        jpeg_set_defaults(&cinfo);
-        jpeg_set_quality(&cinfo, uf->conf->compression, TRUE);
-        if (uf->conf->compression > 90)
-            cinfo.comp_info[0].v_samp_factor = 1;
-        if (uf->conf->compression > 92)
-            cinfo.comp_info[0].h_samp_factor = 1;
-        if (uf->conf->progressiveJPEG)
-            jpeg_simple_progression(&cinfo);
+        if (uf->conf->parallelSave && !uf->conf->progressiveJPEG &&
+                parallel_get_max_threads() > 1 &&
+                Crop.height > JPEG_STRIP_HEIGHT &&
+                Crop.height <= JPEG_MAX_DIMENSION) {
+            jpeg_write_strips(uf, out, &Crop, grayscaleMode);
+        } else
+        {
+            struct jpeg_compress_struct cinfo;
+            struct jpeg_error_mgr jerr;
 
-        cinfo.optimize_coding = 1;
+            cinfo.err = jpeg_std_error(&jerr);
+            cinfo.err->output_message = jpeg_warning_handler;
+            cinfo.err->error_exit = jpeg_error_handler;
+            cinfo.client_data = uf;
+            jpeg_create_compress(&cinfo);
+            jpeg_stdio_dest(&cinfo, out);
+            jpeg_set_output_parameters(uf, &cinfo, Crop.width, Crop.height,
+                                       grayscaleMode);
 
-        jpeg_start_compress(&cinfo, TRUE);
+            jpeg_start_compress(&cinfo, TRUE);
 
-        /* Embed output profile if it is not the internal sRGB. */
-        if (strcmp(uf->developer->profileFile[out_profile], "")) {
-            char *buf;
-            gsize len;
-            if (g_file_get_contents(uf->developer->profileFile[out_profile],
-                                    &buf, &len, NULL)) {
-                write_icc_profile(&cinfo, (unsigned char *)buf, len);
-                g_free(buf);
-            } else {
-                ufraw_set_warning(uf,
-                                  _("Failed to embed output profile '%s' in '%s'."),
-                                  uf->developer->profileFile[out_profile],
-                                  uf->conf->outputFilename);
-            }
-        } else if (uf->conf->profileIndex[out_profile] == 1) { // Embed sRGB.
-            cmsHPROFILE hOutProfile = uf_colorspaces_create_srgb_profile();
-            cmsUInt32Number len = 0;
-            cmsSaveProfileToMem(hOutProfile, 0, &len); // Calculate len.
-            if (len > 0) {
-                unsigned char buf[len];
-                cmsSaveProfileToMem(hOutProfile, buf, &len);
-                write_icc_profile(&cinfo, buf, len);
-            } else {
-                ufraw_set_warning(uf,
-                                  _("Failed to embed output profile '%s' in '%s'."),
-                                  uf->conf->profile[out_profile]
-                                  [uf->conf->profileIndex[out_profile]].name,
-                                  uf->conf->outputFilename);
-            }
-            cmsCloseProfile(hOutProfile);
-        }
-        if (uf->conf->embedExif) {
-            ufraw_exif_prepare_output(uf);
-            if (uf->outputExifBuf != NULL) {
-                if (uf->outputExifBufLen > 65533) {
-                    ufraw_set_warning(uf,
-                                      _("EXIF buffer length %d, too long, ignored."),
-                                      uf->outputExifBufLen);
-                } else {
-                    jpeg_write_marker(&cinfo, JPEG_APP0 + 1,
-                                      uf->outputExifBuf, uf->outputExifBufLen);
-                }
-            }
-        }
+            jpeg_write_output_markers(uf, &cinfo);
 
-        ufraw_write_image_data(uf, &cinfo, &Crop, 8, grayscaleMode,
-                               jpeg_row_writer);
+            ufraw_write_image_data(uf, &cinfo, &Crop, 8, grayscaleMode,
+                                   jpeg_row_writer);
 
-        if (ufraw_is_error(uf)) {
-            char *message = g_strdup(ufraw_get_message(uf));
-            ufraw_message_reset(uf);
-            ufraw_set_error(uf, _("Error creating file '%s'."),
-                            uf->conf->outputFilename);
-            ufraw_set_error(uf, message);
-            g_free(message);
-        } else
-            jpeg_finish_compress(&cinfo);
-        jpeg_destroy_compress(&cinfo);
+            if (ufraw_is_error(uf)) {
+                char *message = g_strdup(ufraw_get_message(uf));
+                ufraw_message_reset(uf);
+                ufraw_set_error(uf, _("Error creating file '%s'."),
+                                uf->conf->outputFilename);
+                ufraw_set_error(uf, message);
+                g_free(message);
+            } else
+                jpeg_finish_compress(&cinfo);
+            jpeg_destroy_compress(&cinfo);
+        }
 #endif /*HAVE_LIBJPEG*/
 #ifdef HAVE_LIBPNG
     } else if (uf->conf->type == png_type) {
@@ -544,6 +1208,9 @@ int ufraw_write_image(ufraw_data *uf)
                          PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
                          PNG_FILTER_TYPE_BASE);
             png_set_compression_level(png, Z_BEST_COMPRESSION);
+            if (uf->conf->pngFilter != adaptive_png_filter)
+                png_set_filter(png, PNG_FILTER_TYPE_BASE,
+                               png_filter_flags[uf->conf->pngFilter]);
             png_text text[2];
             text[0].compression = PNG_TEXT_COMPRESSION_NONE;
             text[0].key = "Software";
@@ -599,13 +1266,21 @@ int ufraw_write_image(ufraw_data *uf)
                                        uf->outputExifBuf, uf->outputExifBufLen);
             }
             png_write_info(png, info);
-            if (BitDepth != 8 && G_BYTE_ORDER == G_LITTLE_ENDIAN)
-                png_set_swap(png); // Swap byte order to big-endian
+#ifdef HAVE_LIBZ
+            if (uf->conf->parallelSave && parallel_get_max_threads() > 1 &&
+                    Crop.height > PNG_STRIP_HEIGHT) {
+                png_write_strips(uf, png, &Crop, BitDepth, grayscaleMode);
+            } else
+#endif
+            {
+                if (BitDepth != 8 && G_BYTE_ORDER == G_LITTLE_ENDIAN)
+                    png_set_swap(png); // Swap byte order to big-endian
 
-            ufraw_write_image_data(uf, png, &Crop, BitDepth, grayscaleMode,
-                                   png_row_writer);
+                ufraw_write_image_data(uf, png, &Crop, BitDepth, grayscaleMode,
+                                       png_row_writer);
 
-            png_write_end(png, NULL);
+                png_write_end(png, NULL);
+            }
             png_destroy_write_struct(&png, &info);
         }
 #endif /*HAVE_LIBPNG*/
@@ -613,9 +1288,9 @@ int ufraw_write_image(ufraw_data *uf)
     } else if (uf->conf->type == fits_type) {
 
         // image data and min/max values
-        guint16 *image;
         guint16 max[3] = { 0, 0, 0 }, min[3] = { 65535, 65535, 65535 };
         guint64 sum[3] = { 0, 0, 0 };
+        float average[3] = { 0, 0, 0 };
 
         // FITS Header (taken from cookbook.c)
         int bitpix = USHORT_IMG;    // Use float format
@@ -624,75 +1299,12 @@ int ufraw_write_image(ufraw_data *uf)
 
         long naxes[3]  = { Crop.width, Crop.height, 3 };
         long dim = Crop.width * Crop.height;
-        long offset = 0;
-
-        image = g_new(guint16, 3 * dim);
-
-        int row;
-        int i;
-        ufraw_image_type *rawImage =
-            (ufraw_image_type *)uf->Images[ufraw_first_phase].buffer;
-        int rowStride = uf->Images[ufraw_first_phase].width;
-        guint16 pixbuf16[3];
-
-        // Avoid FITS images being saved upside down
-        ufraw_flip_image(uf, 2);
-
-        progress(PROGRESS_SAVE, -Crop.height);
-        for (row = 0; row < Crop.height; row++) {
-            progress(PROGRESS_SAVE, 1);
-            for (i = 0; i < Crop.width; i++) {
-                offset = row * Crop.width + i;
-                develop_linear(rawImage[(Crop.y + row)*rowStride + Crop.x + i], pixbuf16,
-                               uf->developer);
-                int c;
-                for (c = 0; c < 3; c++) {
-                    sum[c] += image[c * dim + offset] = pixbuf16[c];
-                    max[c] = MAX(pixbuf16[c], max[c]);
-                    min[c] = MIN(pixbuf16[c], min[c]);
-                }
-            }
-        }
-        // calculate averages
-        float average[3];
-        int c;
-        for (c = 0; c < 3; c++)
-            average[c] = (float)sum[c] / dim;
-
-        guint16 maxAll = MAX(MAX(max[0], max[1]), max[2]);
-        guint16 minAll = MIN(MIN(min[0], min[1]), min[2]);
 
         fits_create_img(fitsFile, bitpix, naxis, naxes, &status);
 
-        fits_write_img(fitsFile, TUSHORT, 1, 3 * dim, image, &status);
-        g_free(image);
-
-        fits_update_key(fitsFile, TUSHORT, "DATAMIN", &minAll,
-                        "minimum data (overall)", &status);
-        fits_update_key(fitsFile, TUSHORT, "DATAMAX", &maxAll,
-                        "maximum data (overall)", &status);
-
-        fits_update_key(fitsFile, TUSHORT, "DATAMINR", &min[0],
-                        "minimum data (red channel)", &status);
-        fits_update_key(fitsFile, TUSHORT, "DATAMAXR", &max[0],
-                        "maximum data (red channel)", &status);
-
-        fits_update_key(fitsFile, TUSHORT, "DATAMING", &min[1],
-                        "minimum data (green channel)", &status);
-        fits_update_key(fitsFile, TUSHORT, "DATAMAXG", &max[1],
-                        "maximum data (green channel)", &status);
-
-        fits_update_key(fitsFile, TUSHORT, "DATAMINB", &min[2],
-                        "minimum data (blue channel)", &status);
-        fits_update_key(fitsFile, TUSHORT, "DATAMAXB", &max[2],
-                        "maximum data (blue channel)", &status);
-
-        fits_update_key(fitsFile, TFLOAT, "AVERAGER", &average[0],
-                        "average (red channel)", &status);
-        fits_update_key(fitsFile, TFLOAT, "AVERAGEG", &average[1],
-                        "average (green channel)", &status);
-        fits_update_key(fitsFile, TFLOAT, "AVERAGEB", &average[2],
-                        "average (blue channel)", &status);
+        // Reserve the header space for the statistics, which are only
+        // known after the data is written.
+        fits_write_statistics(fitsFile, min, max, average, &status);
 
         // Save known EXIF properties
         if (strlen(uf->conf->shutterText) > 0)
@@ -747,6 +1359,61 @@ int ufraw_write_image(ufraw_data *uf)
         fits_update_key(fitsFile, TSTRING, "CREATOR",  "UFRaw " VERSION,
                         "Creator Software", &status);
 
+        int row, row0, i, c;
+        ufraw_image_type *rawImage =
+            (ufraw_image_type *)uf->Images[ufraw_first_phase].buffer;
+        int rowStride = uf->Images[ufraw_first_phase].width;
+        // One batch of rows for each of the three planes
+        guint16 *image = g_new(guint16, 3 * Crop.width * DEVELOP_BATCH);
+
+        // FITS images are stored bottom-up, so the rows are developed
+        // from the bottom of the crop area.
+        progress(PROGRESS_SAVE, -Crop.height);
+        for (row0 = 0; row0 < Crop.height && !status; row0 += DEVELOP_BATCH) {
+            int batchHeight = MIN(Crop.height - row0, DEVELOP_BATCH);
+            long planeSize = Crop.width * batchHeight;
+            progress(PROGRESS_SAVE, batchHeight);
+#ifdef _OPENMP
+            #pragma omp parallel for default(shared) private(row, i, c)
+#endif
+            for (row = 0; row < batchHeight; row++) {
+                guint16 rowMax[3] = { 0, 0, 0 };
+                guint16 rowMin[3] = { 65535, 65535, 65535 };
+                guint64 rowSum[3] = { 0, 0, 0 };
+                guint16 pixbuf16[3];
+                int srcRow = Crop.y + Crop.height - 1 - (row0 + row);
+                for (i = 0; i < Crop.width; i++) {
+                    develop_linear(rawImage[srcRow * rowStride + Crop.x + i],
+                                   pixbuf16, uf->developer);
+                    for (c = 0; c < 3; c++) {
+                        image[c * planeSize + row * Crop.width + i] = pixbuf16[c];
+                        rowSum[c] += pixbuf16[c];
+                        rowMax[c] = MAX(pixbuf16[c], rowMax[c]);
+                        rowMin[c] = MIN(pixbuf16[c], rowMin[c]);
+                    }
+                }
+#ifdef _OPENMP
+                #pragma omp critical(fits_statistics)
+#endif
+                for (c = 0; c < 3; c++) {
+                    sum[c] += rowSum[c];
+                    max[c] = MAX(rowMax[c], max[c]);
+                    min[c] = MIN(rowMin[c], min[c]);
+                }
+            }
+            for (c = 0; c < 3; c++) {
+                long fpixel[3] = { 1, row0 + 1, c + 1 };
+                fits_write_pix(fitsFile, TUSHORT, fpixel, planeSize,
+                               image + c * planeSize, &status);
+            }
+        }
+        g_free(image);
+
+        // calculate averages
+        for (c = 0; c < 3; c++)
+            average[c] = (float)sum[c] / dim;
+        fits_write_statistics(fitsFile, min, max, average, &status);
+
         fits_close_file(fitsFile, &status);
 
         if (status) {
@@ -768,12 +1435,12 @@ int ufraw_write_image(ufraw_data *uf)
 #ifdef HAVE_LIBTIFF
     if (uf->conf->type == tiff_type) {
         TIFFClose(out);
-        if (ufraw_tiff_message[0] != '\0') {
+        if (ufraw_tiff_message()[0] != '\0') {
             if (!ufraw_is_error(uf)) {   // Error was not already set before
                 ufraw_set_error(uf, _("Error creating file."));
-                ufraw_set_error(uf, ufraw_tiff_message);
+                ufraw_set_error(uf, ufraw_tiff_message());
             }
-            ufraw_tiff_message[0] = '\0';
+            ufraw_tiff_message()[0] = '\0';
         } else {
             if (uf->conf->embedExif)
                 ufraw_exif_write(uf);
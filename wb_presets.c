@@ -24,6 +24,9 @@
  *	      will be interpolated.
  * Column 5 - Channel multipliers.
  *
+ * All the presets of a camera MUST be in consecutive lines, see
+ * wb_preset_find().
+ *
  * MINOLTA's ALPHA and MAXXUM models are treated as the DYNAX model.
  *
  * WB name is standardized to one of the following: */
@@ -9977,3 +9980,57 @@ const wb_data wb_preset[] = {
 };
 
 const int wb_preset_count = sizeof(wb_preset) / sizeof(wb_data);
+
+typedef struct {
+    int first, count;
+} wb_preset_range;
+
+static char *wb_preset_key(const char *make, const char *model)
+{
+    char *key = g_strdup_printf("%s\n%s", make, model);
+    char *lower = g_ascii_strdown(key, -1);
+    g_free(key);
+    return lower;
+}
+
+/* Index the presets by camera, once. */
+static gpointer wb_preset_index_new(gpointer data)
+{
+    GHashTable *index = g_hash_table_new(g_str_hash, g_str_equal);
+    wb_preset_range *range = g_new(wb_preset_range, wb_preset_count);
+    int i, n = -1;
+
+    (void)data;
+    for (i = 0; i < wb_preset_count; i++) {
+        if (n < 0 ||
+                strcasecmp(wb_preset[i].make, wb_preset[i - 1].make) != 0 ||
+                strcasecmp(wb_preset[i].model, wb_preset[i - 1].model) != 0) {
+            range[++n].first = i;
+            range[n].count = 0;
+            g_hash_table_insert(index,
+                                wb_preset_key(wb_preset[i].make, wb_preset[i].model),
+                                &range[n]);
+        }
+        range[n].count++;
+    }
+    return index;
+}
+
+/* Find the presets of a camera, or the common presets if make and model
+ * are "". The presets are wb_preset[*first] to wb_preset[*first+count-1],
+ * where count is the returned value. */
+int wb_preset_find(const char *make, const char *model, int *first)
+{
+    static GOnce once = G_ONCE_INIT;
+    GHashTable *index = g_once(&once, wb_preset_index_new, NULL);
+    char *key = wb_preset_key(make, model);
+    wb_preset_range *range = g_hash_table_lookup(index, key);
+
+    g_free(key);
+    if (range == NULL) {
+        *first = wb_preset_count;
+        return 0;
+    }
+    *first = range->first;
+    return range->count;
+}